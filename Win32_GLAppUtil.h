@@ -21,6 +21,16 @@
 #include <Extras/OVR_Math.h>
 #include <Kernel/OVR_Log.h>
 #include "OVR_CAPI_GL.h"
+#include "emfield.h"
+#include "empool.h"
+#include "emrandom.h"
+#include "emtree.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
 
  using namespace OVR;
 
@@ -207,6 +217,7 @@ struct OGL
     int                     WinSizeH;
     GLuint                  fboId;
     HINSTANCE               hInstance;
+    int                     DrawCalls;      // glDraw* calls made since the app last reset it
 
     static LRESULT CALLBACK WindowProc(_In_ HWND hWnd, _In_ UINT Msg, _In_ WPARAM wParam, _In_ LPARAM lParam)
     {
@@ -241,7 +252,8 @@ struct OGL
         WinSizeW(0),
         WinSizeH(0),
         fboId(0),
-        hInstance(nullptr)
+        hInstance(nullptr),
+        DrawCalls(0)
     {
 		// Clear input
 		for (int i = 0; i < sizeof(Key) / sizeof(Key[0]); ++i)
@@ -447,10 +459,15 @@ struct OGL
 static OGL Platform;
 
 //------------------------------------------------------------------------------
+// The program's uniform and attribute locations are looked up once here at
+// link time, not per draw; a name the shaders don't use has location -1.
 struct ShaderFill
 {
     GLuint            program;
     TextureBuffer   * texture;
+    GLint             matWVPLoc, matWVLoc, matVPLoc, textureLoc;
+    GLint             posLoc, colorLoc, uvLoc, normalLoc;
+    GLint             instancePosLoc, instanceRotLoc, instanceScaleLoc, instanceColorLoc;
 
     ShaderFill(GLuint vertexShader, GLuint pixelShader, TextureBuffer* _texture)
     {
@@ -474,6 +491,24 @@ struct ShaderFill
             glGetProgramInfoLog(program, sizeof(msg), 0, msg);
             OVR_DEBUG_LOG(("Linking shaders failed: %s\n", msg));
         }
+
+        matWVPLoc = glGetUniformLocation(program, "matWVP");
+        matWVLoc = glGetUniformLocation(program, "matWV");
+        matVPLoc = glGetUniformLocation(program, "matVP");
+        textureLoc = glGetUniformLocation(program, "Texture0");
+        posLoc = glGetAttribLocation(program, "Position");
+        colorLoc = glGetAttribLocation(program, "Color");
+        uvLoc = glGetAttribLocation(program, "TexCoord");
+        normalLoc = glGetAttribLocation(program, "Normal");
+        instancePosLoc = glGetAttribLocation(program, "InstancePos");
+        instanceRotLoc = glGetAttribLocation(program, "InstanceRot");
+        instanceScaleLoc = glGetAttribLocation(program, "InstanceScale");
+        instanceColorLoc = glGetAttribLocation(program, "InstanceColor");
+
+        // Every fill samples its texture from unit 0
+        glUseProgram(program);
+        glUniform1i(textureLoc, 0);
+        glUseProgram(0);
     }
 
     ~ShaderFill()
@@ -533,7 +568,154 @@ struct IndexBuffer
     }
 };
 
+//----------------------------------------------------------------
+// Vertex data rewritten every frame. On GL 4.4 and later the buffer holds
+// Regions copies of RegionSize bytes, mapped once for good with
+// GL_MAP_PERSISTENT_BIT. Begin() moves to the next region, waiting on the
+// fence left when that region was last drawn from, so the GPU can keep
+// reading the other two while the CPU writes. Older contexts get a single
+// region that Begin() orphans and maps again instead.
+struct StreamBuffer
+{
+    enum { Regions = 3 };
+
+    GLuint            buffer;
+    size_t            RegionSize;
+    bool              Persistent;
+    unsigned char   * Mapped;             // The whole buffer while Persistent
+    GLsync            Fences[Regions];
+    int               Current;            // Region last returned by Begin()
+    std::chrono::steady_clock::time_point BeginTime;
+
+    // Since ResetStats()
+    unsigned long long BytesUploaded;
+    int               Uploads;
+    int               Waits;              // Begin() calls that found the GPU still reading
+    double            WaitSeconds;
+    double            CopySeconds;        // Between Begin() and End(), waits excluded
+
+    StreamBuffer(size_t regionSize) :
+        RegionSize(regionSize),
+        Mapped(nullptr),
+        Current(-1)
+    {
+        for (int r = 0; r < Regions; ++r)
+            Fences[r] = 0;
+        ResetStats();
+
+        GLint major = 0, minor = 0;
+        glGetIntegerv(GL_MAJOR_VERSION, &major);
+        glGetIntegerv(GL_MINOR_VERSION, &minor);
+        Persistent = major > 4 || (major == 4 && minor >= 4);
+
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        if (Persistent)
+        {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_ARRAY_BUFFER, RegionSize * Regions, NULL, flags);
+            Mapped = (unsigned char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, RegionSize * Regions, flags);
+            Persistent = Mapped != nullptr;
+        }
+        if (!Persistent)
+            glBufferData(GL_ARRAY_BUFFER, RegionSize, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        OVR_DEBUG_LOG(("Stream buffer of %u bytes %s\n", (unsigned)RegionSize, Persistent ? "persistently mapped" : "orphaned each upload"));
+    }
+
+    ~StreamBuffer()
+    {
+        for (int r = 0; r < Regions; ++r)
+            if (Fences[r])
+                glDeleteSync(Fences[r]);
+        if (buffer)
+        {
+            if (Mapped)
+            {
+                glBindBuffer(GL_ARRAY_BUFFER, buffer);
+                glUnmapBuffer(GL_ARRAY_BUFFER);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+            glDeleteBuffers(1, &buffer);
+            buffer = 0;
+        }
+    }
+
+    // Where region r starts in the buffer, for attribute pointers
+    size_t RegionOffset(int r) const { return Persistent ? r * RegionSize : 0; }
+
+    // Fences the region written last, since every draw reading it has been
+    // issued by now, and returns RegionSize writable bytes in the next one.
+    unsigned char * Begin()
+    {
+        using namespace std::chrono;
+        if (Persistent && Current >= 0)
+            Fences[Current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        Current = (Current + 1) % Regions;
+        BeginTime = steady_clock::now();
+
+        if (!Persistent)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, buffer);
+            glBufferData(GL_ARRAY_BUFFER, RegionSize, NULL, GL_STREAM_DRAW);
+            return (unsigned char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, RegionSize,
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        }
+
+        if (GLsync fence = Fences[Current])
+        {
+            if (glClientWaitSync(fence, 0, 0) == GL_TIMEOUT_EXPIRED)
+            {
+                Waits++;
+                while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+                    ;
+                steady_clock::time_point now = steady_clock::now();
+                WaitSeconds += duration<double>(now - BeginTime).count();
+                BeginTime = now;
+            }
+            glDeleteSync(fence);
+            Fences[Current] = 0;
+        }
+        return Mapped + Current * RegionSize;
+    }
+
+    // bytes is how much of the region Begin() returned was written
+    void End(size_t bytes)
+    {
+        if (!Persistent)
+        {
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        CopySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - BeginTime).count();
+        BytesUploaded += bytes;
+        Uploads++;
+    }
+
+    void ResetStats()
+    {
+        BytesUploaded = 0;
+        Uploads = 0;
+        Waits = 0;
+        WaitSeconds = 0;
+        CopySeconds = 0;
+    }
+
+    // Logs upload bandwidth and time lost to fences over the last seconds
+    void LogStats(double seconds)
+    {
+        OVR_DEBUG_LOG(("Streamed %.2f MB/s in %d uploads, %.0f MB/s while copying; %d waited %.2f ms on the GPU\n",
+            BytesUploaded / (1e6 * seconds), Uploads, CopySeconds > 0 ? BytesUploaded / (1e6 * CopySeconds) : 0.0,
+            Waits, WaitSeconds * 1e3));
+        ResetStats();
+    }
+};
+
 //---------------------------------------------------------------------------
+// Vertices and Indices grow to whatever the Add* calls build, and
+// AllocateBuffers() frees them once they are in GL buffers unless asked to
+// keep them. Indices are 32 bit while building; they go to GL as 16 bit
+// whenever the vertex count allows.
 struct Model
 {
     struct Vertex
@@ -548,14 +730,15 @@ struct Model
     Quatf           Rot;
     Matrix4f        Mat;
 	float           Scale;
-    int             numVertices, numIndices;
-    Vertex          Vertices[2000]; // Note fixed maximum
-    GLushort        Indices[2000];
+    int             numVertices, numIndices;   // Still valid after the CPU copy is freed
+    std::vector<Vertex> Vertices;
+    std::vector<GLuint> Indices;
     ShaderFill    * Fill;
     VertexBuffer  * vertexBuffer;
     IndexBuffer   * indexBuffer;
-	int             IsVisible;
-	int             IsArrow;
+    GLenum          indexType;      // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, what indexBuffer holds
+    size_t          gpuBytes;       // Size of vertexBuffer and indexBuffer
+    GLuint          vao;            // Buffers and attribute layout for Fill, set up by AllocateBuffers()
 
     Model(Vector3f pos, ShaderFill * fill) :
         numVertices(0),
@@ -566,9 +749,10 @@ struct Model
         Fill(fill),
         vertexBuffer(nullptr),
         indexBuffer(nullptr),
-		Scale(1.f),
-		IsVisible(0),
-		IsArrow(0)
+        indexType(GL_UNSIGNED_SHORT),
+        gpuBytes(0),
+        vao(0),
+		Scale(1.f)
     {}
 
     ~Model()
@@ -578,23 +762,85 @@ struct Model
 
     Matrix4f& GetMatrix()
     {
-        Mat = Matrix4f(Rot);
-		Mat = Matrix4f::Scaling(Scale) * Mat;
-		Mat = Matrix4f::Translation(Pos) * Mat;
+        Mat = Transform(Pos, Rot, Scale);
 		return Mat;
     }
 
-	void AddVertex(const Vertex& v) { Vertices[numVertices++] = v; assert(numVertices < sizeof(Vertices) / sizeof(Vertices[0])); }
-	void AddIndex(GLushort a) { Indices[numIndices++] = a; assert(numVertices < sizeof(Indices) / sizeof(Indices[0]));  }
+    static Matrix4f Transform(Vector3f pos, Quatf rot, float scale)
+    {
+        Matrix4f m = Matrix4f(rot);
+		m = Matrix4f::Scaling(scale) * m;
+		m = Matrix4f::Translation(pos) * m;
+		return m;
+    }
+
+	void AddVertex(const Vertex& v) { Vertices.push_back(v); numVertices++; }
+	void AddIndex(GLuint a) { Indices.push_back(a); numIndices++; }
 
-    void AllocateBuffers()
+    // Uploads the mesh. Keep the CPU copy only if something will read or
+    // extend Vertices and Indices afterwards.
+    void AllocateBuffers(bool keepCpuCopy = false)
     {
-        vertexBuffer = new VertexBuffer(&Vertices[0], numVertices * sizeof(Vertices[0]));
-        indexBuffer = new IndexBuffer(&Indices[0], numIndices * sizeof(Indices[0]));
+        assert(numVertices == (int)Vertices.size() && numIndices == (int)Indices.size());
+        vertexBuffer = new VertexBuffer(Vertices.data(), numVertices * sizeof(Vertex));
+        if (numVertices <= 0x10000)
+        {
+            std::vector<GLushort> narrow(Indices.begin(), Indices.end());
+            indexBuffer = new IndexBuffer(narrow.data(), numIndices * sizeof(GLushort));
+            indexType = GL_UNSIGNED_SHORT;
+            gpuBytes = numVertices * sizeof(Vertex) + numIndices * sizeof(GLushort);
+        }
+        else
+        {
+            indexBuffer = new IndexBuffer(Indices.data(), numIndices * sizeof(GLuint));
+            indexType = GL_UNSIGNED_INT;
+            gpuBytes = numVertices * sizeof(Vertex) + numIndices * sizeof(GLuint);
+        }
+
+        glGenVertexArrays(1, &vao);
+        glBindVertexArray(vao);
+        BindAttributes(Fill);
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        if (!keepCpuCopy)
+        {
+            std::vector<Vertex>().swap(Vertices);
+            std::vector<GLuint>().swap(Indices);
+        }
+    }
+
+    // Memory this model holds in system RAM, itself included
+    size_t CpuBytes() const
+    {
+        return sizeof(*this) + Vertices.capacity() * sizeof(Vertex) + Indices.capacity() * sizeof(GLuint);
+    }
+
+    // Points fill's per vertex attributes at this model's buffers, recording
+    // them in whichever VAO is bound
+    void BindAttributes(const ShaderFill * fill)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer->buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer->buffer);
+        const GLint loc[4] = { fill->posLoc, fill->colorLoc, fill->uvLoc, fill->normalLoc };
+        const GLint size[4] = { 3, 4, 2, 3 };
+        const GLenum type[4] = { GL_FLOAT, GL_UNSIGNED_BYTE, GL_FLOAT, GL_FLOAT };
+        const size_t offset[4] = { OVR_OFFSETOF(Vertex, Pos), OVR_OFFSETOF(Vertex, C), OVR_OFFSETOF(Vertex, U), OVR_OFFSETOF(Vertex, Normal) };
+        for (int k = 0; k < 4; ++k) {
+            if (loc[k] < 0)
+                continue;
+            glEnableVertexAttribArray(loc[k]);
+            glVertexAttribPointer(loc[k], size[k], type[k], type[k] == GL_UNSIGNED_BYTE ? GL_TRUE : GL_FALSE, sizeof(Vertex), (void*)offset[k]);
+        }
     }
 
     void FreeBuffers()
     {
+        if (vao)
+        {
+            glDeleteVertexArrays(1, &vao);
+            vao = 0;
+        }
         delete vertexBuffer; vertexBuffer = nullptr;
         delete indexBuffer; indexBuffer = nullptr;
     }
@@ -628,7 +874,7 @@ struct Model
 		};
 
 		for (int i = 0; i < sizeof(CubeIndices) / sizeof(CubeIndices[0]); ++i)
-			AddIndex(CubeIndices[i] + GLushort(numVertices));
+			AddIndex(CubeIndices[i] + GLuint(numVertices));
 
 		// Generate a quad for each box face
 		for (int v = 0; v < 6 * 4; v++)
@@ -693,7 +939,7 @@ struct Model
 		};
 
 		for (int i = 0; i < sizeof(CubeIndices) / sizeof(CubeIndices[0]); ++i)
-			AddIndex(CubeIndices[i] + GLushort(numVertices));
+			AddIndex(CubeIndices[i] + GLuint(numVertices));
 
 		// Generate a quad for each box face
 		for (int v = 0; v < 6 * 4; v++)
@@ -1020,51 +1266,621 @@ struct Model
 		}
 	}
 
+    // Sets the matrices and draws, leaving Fill's program, its texture and
+    // vao for the caller to have bound. RenderQueue::Flush() is the only
+    // caller, and binds them only when they change.
+    void Draw(const Matrix4f & world, const Matrix4f & viewProj)
+    {
+        Matrix4f combined = viewProj * world;
+        glUniformMatrix4fv(Fill->matWVPLoc, 1, GL_TRUE, (FLOAT*)&combined);
+		glUniformMatrix4fv(Fill->matWVLoc, 1, GL_TRUE, (FLOAT*)&world);
 
+        glDrawElements(GL_TRIANGLES, numIndices, indexType, NULL);
+        Platform.DrawCalls++;
+    }
+};
 
-	void Render(Matrix4f view, Matrix4f proj)
+//-------------------------------------------------------------------------
+// A frame's model draws, sorted so that the ones sharing a program, texture
+// and VAO run back to back and Flush() binds each only when it changes.
+// Sort keys pack the three GL names 16 bits apiece, program highest, and
+// Sort() is an LSD radix sort over their bytes that skips any byte all the
+// keys share. Items carry an index into Draws rather than the 64 byte
+// matrix, so the passes move 16 bytes per draw.
+struct RenderQueue
+{
+    struct DrawItem { Model * M; Matrix4f World; };
+    struct Item { uint64_t Key; int Draw; };
+
+    std::vector<DrawItem> Draws;
+    std::vector<Item>     Items, Scratch;
+
+    // Since ResetStats()
+    long long             Binds;          // Program, texture and VAO binds Flush() made
+    long long             BindsAvoided;   // Ones it skipped, as the last draw had bound the same
+
+    RenderQueue() { ResetStats(); }
+
+    void Clear()
     {
-        Matrix4f combined = proj * view * GetMatrix();
+        Draws.clear();
+        Items.clear();
+    }
 
-		Matrix4f viewOnly = GetMatrix();
+    void Add(Model * m, const Matrix4f & world)
+    {
+        Item item;
+        item.Key = ((uint64_t)(m->Fill->program & 0xffff) << 32) |
+                   ((uint64_t)(m->Fill->texture->texId & 0xffff) << 16) |
+                    (uint64_t)(m->vao & 0xffff);
+        item.Draw = (int)Draws.size();
+        DrawItem d = { m, world };
+        Draws.push_back(d);
+        Items.push_back(item);
+    }
 
-        glUseProgram(Fill->program);
-        glUniform1i(glGetUniformLocation(Fill->program, "Texture0"), 0);
-        glUniformMatrix4fv(glGetUniformLocation(Fill->program, "matWVP"), 1, GL_TRUE, (FLOAT*)&combined);
-		glUniformMatrix4fv(glGetUniformLocation(Fill->program, "matWV"), 1, GL_TRUE, (FLOAT*)&viewOnly);
+    void Sort()
+    {
+        size_t n = Items.size();
+        if (n < 2)
+            return;
+        Scratch.resize(n);
+        Item * src = Items.data();
+        Item * dst = Scratch.data();
+        for (int shift = 0; shift < 48; shift += 8) {
+            size_t count[256] = { 0 };
+            for (size_t i = 0; i < n; ++i)
+                count[(src[i].Key >> shift) & 0xff]++;
+            if (count[(src[0].Key >> shift) & 0xff] == n)
+                continue;
+            size_t sum = 0;
+            for (int b = 0; b < 256; ++b) {
+                size_t c = count[b];
+                count[b] = sum;
+                sum += c;
+            }
+            for (size_t i = 0; i < n; ++i)
+                dst[count[(src[i].Key >> shift) & 0xff]++] = src[i];
+            std::swap(src, dst);
+        }
+        if (src != Items.data())
+            Items.swap(Scratch);
+    }
 
+    // Draws the queue in key order; once per eye
+    void Flush(Matrix4f view, Matrix4f proj)
+    {
+        Matrix4f viewProj = proj * view;
+        GLuint program = 0, texture = 0, vao = 0;
         glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, Fill->texture->texId);
+        for (size_t i = 0; i < Items.size(); ++i) {
+            const DrawItem & d = Draws[Items[i].Draw];
+            ShaderFill * fill = d.M->Fill;
+            if (fill->program != program) {
+                glUseProgram(program = fill->program);
+                Binds++;
+            }
+            else
+                BindsAvoided++;
+            if (fill->texture->texId != texture) {
+                glBindTexture(GL_TEXTURE_2D, texture = fill->texture->texId);
+                Binds++;
+            }
+            else
+                BindsAvoided++;
+            if (d.M->vao != vao) {
+                glBindVertexArray(vao = d.M->vao);
+                Binds++;
+            }
+            else
+                BindsAvoided++;
+            d.M->Draw(d.World, viewProj);
+        }
+        glBindVertexArray(0);
+        glUseProgram(0);
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer->buffer);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer->buffer);
+    void ResetStats()
+    {
+        Binds = 0;
+        BindsAvoided = 0;
+    }
+
+    void LogStats()
+    {
+        OVR_DEBUG_LOG(("Render queue made %lld binds and skipped %lld redundant ones\n", Binds, BindsAvoided));
+        ResetStats();
+    }
+};
+
+//-------------------------------------------------------------------------
+// Field of a set of point charges sampled once onto regular grids, so that
+// looking it up for a particle costs the same whatever the number of charges.
+// A coarse grid covers the whole volume and a finer one surrounds each charge,
+// where the field changes fastest. Inside CoreRadius of a charge not even the
+// fine grid follows the 1/r^2 growth, so lookups there use the direct sum.
+struct FieldGrid
+{
+    enum { Direct, Trilinear, Tricubic, Tree };     // Tree is ChargeTree's, Lookup() sums directly for it
+
+    struct Level
+    {
+        Vector3f    Lo;
+        float       Spacing;
+        int         N;          // Nodes per axis
+        int         Charge;     // Charge a fine level surrounds, -1 for the coarse one
+        Vector3f  * F;
+    };
+
+    int         NumCharges;
+    Vector3f  * ChargePos;
+    float     * ChargeQ;
+    Level       Coarse;
+    int         NumFine;
+    Level     * Fine;
+    int       * FineIndex;      // Fine level covering each coarse cell, or -1
+    float       CoreRadius;
+
+    FieldGrid() :
+        NumCharges(0),
+        ChargePos(nullptr),
+        ChargeQ(nullptr),
+        NumFine(0),
+        Fine(nullptr),
+        FineIndex(nullptr),
+        CoreRadius(0)
+    {
+        Coarse.F = nullptr;
+    }
+
+    ~FieldGrid()
+    {
+        Release();
+    }
+
+    void Release()
+    {
+        for (int i = 0; i < NumFine; ++i)
+            delete[] Fine[i].F;
+        delete[] Fine;
+        delete[] Coarse.F;
+        delete[] FineIndex;
+        delete[] ChargePos;
+        delete[] ChargeQ;
+        NumCharges = 0;
+        ChargePos = nullptr;
+        ChargeQ = nullptr;
+        NumFine = 0;
+        Fine = nullptr;
+        FineIndex = nullptr;
+        Coarse.F = nullptr;
+    }
+
+    // The direct sum, which the tree's leaves share
+    static Vector3f Coulomb(Vector3f xyz, int numChg, const Vector3f * chgPos, const float * chg)
+    {
+        return ChargeTreeT<Vector3f>::Coulomb(xyz, numChg, chgPos, chg);
+    }
+
+    bool Matches(int numChg, const Vector3f * chgPos, const float * chg)
+    {
+        if (numChg != NumCharges || !Coarse.F)
+            return false;
+        for (int j = 0; j < numChg; j++) {
+            if (chgPos[j] != ChargePos[j] || chg[j] != ChargeQ[j])
+                return false;
+        }
+        return true;
+    }
+
+    void Fill(Level & l)
+    {
+        int n = l.N;
+        l.F = new Vector3f[n * n * n];
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < n; ++j)
+                for (int k = 0; k < n; ++k)
+                    l.F[(i * n + j) * n + k] = Coulomb(l.Lo + Vector3f((float)i, (float)j, (float)k) * l.Spacing, NumCharges, ChargePos, ChargeQ);
+    }
+
+    // The coarse grid spans [-extent, extent] on every axis with coarseN
+    // nodes per axis. Each charge gets a fineN^3 grid reaching fineRadius
+    // from it; fineN = 0 leaves them out. fineN is rounded up to even so
+    // that no node lands on the charge. Building evaluates the direct sum
+    // once per node, so it costs (coarseN^3 + numChg fineN^3) numChg.
+    void Build(int numChg, const Vector3f * chgPos, const float * chg, float extent, int coarseN, float fineRadius, int fineN, float coreRadius)
+    {
+        Release();
+        NumCharges = numChg;
+        ChargePos = new Vector3f[numChg];
+        ChargeQ = new float[numChg];
+        for (int j = 0; j < numChg; j++) {
+            ChargePos[j] = chgPos[j];
+            ChargeQ[j] = chg[j];
+        }
+        CoreRadius = coreRadius;
+
+        Coarse.Lo = Vector3f(-extent, -extent, -extent);
+        Coarse.Spacing = 2.f * extent / (float)(coarseN - 1);
+        Coarse.N = coarseN;
+        Coarse.Charge = -1;
+        Fill(Coarse);
+
+        int cells = coarseN - 1;
+        FineIndex = new int[cells * cells * cells];
+        for (int c = 0; c < cells * cells * cells; ++c)
+            FineIndex[c] = -1;
+        if (fineN < 4)
+            return;
+
+        fineN += fineN & 1;
+        NumFine = numChg;
+        Fine = new Level[numChg];
+        for (int j = 0; j < numChg; j++) {
+            Level & l = Fine[j];
+            l.Lo = chgPos[j] - Vector3f(fineRadius, fineRadius, fineRadius);
+            l.Spacing = 2.f * fineRadius / (float)(fineN - 1);
+            l.N = fineN;
+            l.Charge = j;
+            Fill(l);
+
+            // Claim the coarse cells whose centre lies in this level. Where
+            // levels overlap the nearest charge keeps the cell, so that the
+            // core test in Lookup() is against the charge that matters.
+            for (int i = 0; i < cells; ++i)
+                for (int k = 0; k < cells; ++k)
+                    for (int m = 0; m < cells; ++m) {
+                        Vector3f centre = Coarse.Lo + Vector3f(i + 0.5f, k + 0.5f, m + 0.5f) * Coarse.Spacing;
+                        Vector3f d = centre - chgPos[j];
+                        if (fabsf(d.x) >= fineRadius || fabsf(d.y) >= fineRadius || fabsf(d.z) >= fineRadius)
+                            continue;
+                        int & owner = FineIndex[(i * cells + k) * cells + m];
+                        if (owner < 0 || d.LengthSq() < (centre - chgPos[owner]).LengthSq())
+                            owner = j;
+                    }
+        }
+    }
+
+    static void CatmullRom(float t, float w[4])
+    {
+        w[0] = ((-t + 2.f) * t - 1.f) * t * 0.5f;
+        w[1] = ((3.f * t - 5.f) * t * t + 2.f) * 0.5f;
+        w[2] = ((-3.f * t + 4.f) * t + 1.f) * t * 0.5f;
+        w[3] = (t - 1.f) * t * t * 0.5f;
+    }
+
+    // Interpolates l at p. Fails when p is outside the nodes the stencil needs.
+    static bool Sample(const Level & l, Vector3f p, int mode, Vector3f & f)
+    {
+        Vector3f g = (p - l.Lo) * (1.f / l.Spacing);
+        int i = (int)floorf(g.x);
+        int j = (int)floorf(g.y);
+        int k = (int)floorf(g.z);
+        int margin = mode == Tricubic ? 1 : 0;
+        int hi = l.N - 1 - margin;
+        if (i < margin || j < margin || k < margin || i >= hi || j >= hi || k >= hi)
+            return false;
+
+        int n = l.N;
+        float wx[4], wy[4], wz[4];
+        if (mode == Tricubic) {
+            CatmullRom(g.x - i, wx);
+            CatmullRom(g.y - j, wy);
+            CatmullRom(g.z - k, wz);
+            i--;
+            j--;
+            k--;
+        }
+        else {
+            wx[1] = g.x - i; wx[0] = 1.f - wx[1];
+            wy[1] = g.y - j; wy[0] = 1.f - wy[1];
+            wz[1] = g.z - k; wz[0] = 1.f - wz[1];
+        }
+        int taps = mode == Tricubic ? 4 : 2;
+        f = Vector3f();
+        for (int a = 0; a < taps; ++a) {
+            for (int b = 0; b < taps; ++b) {
+                const Vector3f * row = &l.F[((i + a) * n + j + b) * n + k];
+                Vector3f r;
+                for (int c = 0; c < taps; ++c)
+                    r += row[c] * wz[c];
+                f += r * (wx[a] * wy[b]);
+            }
+        }
+        return true;
+    }
+
+    Vector3f Lookup(Vector3f p, int mode)
+    {
+        if ((mode == Trilinear || mode == Tricubic) && Coarse.F) {
+            Vector3f g = (p - Coarse.Lo) * (1.f / Coarse.Spacing);
+            int cells = Coarse.N - 1;
+            int i = (int)floorf(g.x);
+            int j = (int)floorf(g.y);
+            int k = (int)floorf(g.z);
+            if (i >= 0 && j >= 0 && k >= 0 && i < cells && j < cells && k < cells) {
+                Vector3f f;
+                int fine = FineIndex[(i * cells + j) * cells + k];
+                if (fine >= 0) {
+                    if ((p - ChargePos[fine]).LengthSq() < CoreRadius * CoreRadius)
+                        return Coulomb(p, NumCharges, ChargePos, ChargeQ);
+                    if (Sample(Fine[fine], p, mode, f))
+                        return f;
+                }
+                if (Sample(Coarse, p, mode, f))
+                    return f;
+            }
+        }
+        return Coulomb(p, NumCharges, ChargePos, ChargeQ);
+    }
+};
+
+//-------------------------------------------------------------------------
+// The charges' Barnes-Hut octree, from emtree.h
+typedef ChargeTreeT<Vector3f> ChargeTree;
+
+//-------------------------------------------------------------------------
+// The live particles as they were at the end of a simulation step, packed
+// and in draw order. Drawing only reads this, never the particle system.
+struct ParticleSnapshot
+{
+    int             Count;
+    int             FieldEvals;     // Stats of the step that produced it
+    bool            TreeChecked;    // The step ran the tree against the direct sum,
+    float           TreeError;      // and this is the worst relative difference it saw
+    Vector3f      * Pos;
+    Quatf         * Rot;
+    float         * Scale;
+    DWORD         * Color;
+    void          * Block;
+
+    ParticleSnapshot(int capacity) :
+        Count(0),
+        FieldEvals(0),
+        TreeChecked(false),
+        TreeError(0)
+    {
+        Block = malloc((size_t)capacity * (sizeof(Quatf) + sizeof(Vector3f) + sizeof(float) + sizeof(DWORD)));
+        VALIDATE(Block, "Snapshot allocation failed.");
+        Rot = (Quatf *)Block;
+        Pos = (Vector3f *)(Rot + capacity);
+        Scale = (float *)(Pos + capacity);
+        Color = (DWORD *)(Scale + capacity);
+    }
+
+    ~ParticleSnapshot()
+    {
+        free(Block);
+    }
+};
+
+//-------------------------------------------------------------------------
+// Lock-free triple buffer of snapshots between one writer and one reader.
+// The writer fills Write() and Publish()es it, the reader takes the newest
+// published one with Acquire() and draws Read(). Each side owns one buffer
+// and they swap through the third, so neither ever waits on the other and
+// the reader never sees a half written snapshot.
+struct SnapshotExchange
+{
+    enum { Fresh = 4 };     // Set in Middle until the reader takes it
 
-        GLuint posLoc = glGetAttribLocation(Fill->program, "Position");
-        GLuint colorLoc = glGetAttribLocation(Fill->program, "Color");
-        GLuint uvLoc = glGetAttribLocation(Fill->program, "TexCoord");
-		GLuint normalLoc = glGetAttribLocation(Fill->program, "Normal");
+    ParticleSnapshot  * Buffers[3];
+    int                 Back;       // Writer's
+    std::atomic<int>    Middle;     // Last published
+    int                 Front;      // Reader's
+
+    SnapshotExchange(int capacity) :
+        Back(0),
+        Middle(1),
+        Front(2)
+    {
+        for (int i = 0; i < 3; ++i)
+            Buffers[i] = new ParticleSnapshot(capacity);
+    }
+
+    ~SnapshotExchange()
+    {
+        for (int i = 0; i < 3; ++i)
+            delete Buffers[i];
+    }
 
-        glEnableVertexAttribArray(posLoc);
-        glEnableVertexAttribArray(colorLoc);
-        glEnableVertexAttribArray(uvLoc);
-		glEnableVertexAttribArray(normalLoc);
+    ParticleSnapshot & Write() { return *Buffers[Back]; }
 
-        glVertexAttribPointer(posLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)OVR_OFFSETOF(Vertex, Pos));
-        glVertexAttribPointer(colorLoc, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(Vertex), (void*)OVR_OFFSETOF(Vertex, C));
-        glVertexAttribPointer(uvLoc, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)OVR_OFFSETOF(Vertex, U));
-		glVertexAttribPointer(normalLoc, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)OVR_OFFSETOF(Vertex, Normal));
+    void Publish()
+    {
+        Back = Middle.exchange(Back | Fresh, std::memory_order_acq_rel) & 3;
+    }
 
-        glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_SHORT, NULL);
+    // Returns false when nothing was published since the last call, in
+    // which case Read() is the same snapshot as before
+    bool Acquire()
+    {
+        if (!(Middle.load(std::memory_order_relaxed) & Fresh))
+            return false;
+        Front = Middle.exchange(Front, std::memory_order_acq_rel) & 3;
+        return true;
+    }
 
-        glDisableVertexAttribArray(posLoc);
-        glDisableVertexAttribArray(colorLoc);
-        glDisableVertexAttribArray(uvLoc);
+    const ParticleSnapshot & Read() const { return *Buffers[Front]; }
+};
 
+//-------------------------------------------------------------------------
+// The streaming arrows. Every attribute lives in its own array so that the
+// update loop reads only what it needs, and all of them share one arrow
+// Model whose Pos, Rot and Scale are set per particle at draw time. The
+// arrays come from a single allocation of BytesPerParticle each, so a
+// million particles is a predictable 60 MB and no per particle GL objects.
+// Rendering never reads these arrays, only a ParticleSnapshot of them.
+// Live holds the indices in use packed at the front and Free the rest as
+// a stack, so Spawn() and Kill() are O(1) and loops over Live never visit
+// a dead particle.
+// RenderInstanced() draws every arrow of a snapshot with one draw call from
+// a region of Instances, which holds the snapshot's Pos, Rot, Scale and
+// Color arrays one after another, each Capacity long. There is a VAO per
+// region, since each sees the arrays at a different offset.
+struct ParticleSystem
+{
+    enum { BytesPerParticle = 6 * sizeof(float) + 2 * sizeof(float) + sizeof(Quatf) + sizeof(DWORD) + 2 * sizeof(int) };
+    enum { BytesPerInstance = sizeof(Vector3f) + sizeof(Quatf) + sizeof(float) + sizeof(DWORD) };
+
+    int             Capacity;
+    float         * PosX, * PosY, * PosZ;
+    float         * VelX, * VelY, * VelZ;
+    float         * Scale;
+    float         * Step;       // Adaptive integrators' next step size
+    DWORD         * Color;      // Multiplies the mesh's vertex colours, white leaves them
+    Quatf         * Rot;
+    int           * Live;
+    int             NumLive;
+    int           * Free;
+    int             NumFree;
+    Model         * Mesh;
+    void          * Block;
+
+    ShaderFill    * InstanceFill;   // Mesh's texture with a shader that reads the Instance attributes
+    StreamBuffer  * Instances;
+    GLuint          InstanceVAO[StreamBuffer::Regions];   // Mesh's vertices per vertex and a region of Instances per instance
+    int             InstanceCount;  // Arrows in the region last uploaded
+
+    ParticleSystem(int capacity, Model * mesh, ShaderFill * instanceFill) :
+        Capacity(capacity),
+        Mesh(mesh),
+        InstanceFill(instanceFill),
+        InstanceCount(0)
+    {
+        // Widest members first so every array stays aligned
+        Block = malloc((size_t)capacity * BytesPerParticle);
+        VALIDATE(Block, "Particle allocation failed.");
+        Rot = (Quatf *)Block;
+        float * f = (float *)(Rot + capacity);
+        PosX = f; f += capacity;
+        PosY = f; f += capacity;
+        PosZ = f; f += capacity;
+        VelX = f; f += capacity;
+        VelY = f; f += capacity;
+        VelZ = f; f += capacity;
+        Scale = f; f += capacity;
+        Step = f; f += capacity;
+        Color = (DWORD *)f;
+        Live = (int *)(Color + capacity);
+        Free = Live + capacity;
+        NumLive = 0;
+        NumFree = capacity;
+        // Popped from the top, so the lowest indices are handed out first
+        for (int i = 0; i < capacity; ++i)
+            Free[i] = capacity - 1 - i;
+
+        Instances = new StreamBuffer((size_t)capacity * BytesPerInstance);
+
+        glGenVertexArrays(StreamBuffer::Regions, InstanceVAO);
+        size_t cap = (size_t)capacity;
+        const GLint loc[4] = { InstanceFill->instancePosLoc, InstanceFill->instanceRotLoc, InstanceFill->instanceScaleLoc, InstanceFill->instanceColorLoc };
+        const GLint size[4] = { 3, 4, 1, 4 };
+        const GLenum type[4] = { GL_FLOAT, GL_FLOAT, GL_FLOAT, GL_UNSIGNED_BYTE };
+        const size_t offset[4] = { 0, cap * sizeof(Vector3f), cap * (sizeof(Vector3f) + sizeof(Quatf)), cap * (sizeof(Vector3f) + sizeof(Quatf) + sizeof(float)) };
+        for (int r = 0; r < StreamBuffer::Regions; ++r) {
+            glBindVertexArray(InstanceVAO[r]);
+            Mesh->BindAttributes(InstanceFill);
+            glBindBuffer(GL_ARRAY_BUFFER, Instances->buffer);
+            for (int k = 0; k < 4; ++k) {
+                if (loc[k] < 0)
+                    continue;
+                glEnableVertexAttribArray(loc[k]);
+                glVertexAttribPointer(loc[k], size[k], type[k], type[k] == GL_UNSIGNED_BYTE ? GL_TRUE : GL_FALSE, 0, (void*)(Instances->RegionOffset(r) + offset[k]));
+                glVertexAttribDivisor(loc[k], 1);
+            }
+        }
+        glBindVertexArray(0);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+
+    ~ParticleSystem()
+    {
+        glDeleteVertexArrays(StreamBuffer::Regions, InstanceVAO);
+        delete Instances;
+        free(Block);
+        delete Mesh;
+        delete InstanceFill;
+    }
+
+    // Returns the index of a particle taken from the free list, or -1 when
+    // the pool is exhausted. Its attributes are left for the caller to set.
+    int Spawn()
+    {
+        if (NumFree == 0)
+            return -1;
+        int i = Free[--NumFree];
+        Live[NumLive++] = i;
+        return i;
+    }
+
+    // Frees the particle in slot k of Live. The last live particle moves
+    // into slot k, so a loop over Live must revisit k after a Kill().
+    void Kill(int k)
+    {
+        Free[NumFree++] = Live[k];
+        Live[k] = Live[--NumLive];
+    }
+
+    // Copies what drawing needs of every live particle into s. Stats are the caller's.
+    void Capture(ParticleSnapshot & s) const
+    {
+        for (int k = 0; k < NumLive; ++k) {
+            int i = Live[k];
+            s.Pos[k] = Vector3f(PosX[i], PosY[i], PosZ[i]);
+            s.Rot[k] = Rot[i];
+            s.Scale[k] = Scale[i];
+            s.Color[k] = Color[i];
+        }
+        s.Count = NumLive;
+    }
+
+    // Copies a snapshot into the next region of Instances for
+    // RenderInstanced(). Once per new snapshot, not per eye.
+    void Upload(const ParticleSnapshot & s)
+    {
+        size_t n = (size_t)s.Count;
+        size_t cap = (size_t)Capacity;
+        unsigned char * region = Instances->Begin();
+        if (region)
+        {
+            memcpy(region, s.Pos, n * sizeof(Vector3f));
+            memcpy(region + cap * sizeof(Vector3f), s.Rot, n * sizeof(Quatf));
+            memcpy(region + cap * (sizeof(Vector3f) + sizeof(Quatf)), s.Scale, n * sizeof(float));
+            memcpy(region + cap * (sizeof(Vector3f) + sizeof(Quatf) + sizeof(float)), s.Color, n * sizeof(DWORD));
+        }
+        Instances->End(region ? n * BytesPerInstance : 0);
+        InstanceCount = region ? s.Count : 0;
+    }
+
+    void RenderInstanced(Matrix4f view, Matrix4f proj)
+    {
+        if (InstanceCount == 0)
+            return;
+
+        Matrix4f viewProj = proj * view;
+        glUseProgram(InstanceFill->program);
+        glUniformMatrix4fv(InstanceFill->matVPLoc, 1, GL_TRUE, (FLOAT*)&viewProj);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, InstanceFill->texture->texId);
+
+        glBindVertexArray(InstanceVAO[Instances->Current]);
+        glDrawElementsInstanced(GL_TRIANGLES, Mesh->numIndices, Mesh->indexType, NULL, InstanceCount);
+        Platform.DrawCalls++;
+        glBindVertexArray(0);
 
         glUseProgram(0);
     }
+
+    // Queues a draw of Mesh per arrow for the first limit arrows, for
+    // comparison with RenderInstanced()
+    void Enqueue(const ParticleSnapshot & s, RenderQueue & queue, int limit)
+    {
+        int count = s.Count < limit ? s.Count : limit;
+        for (int k = 0; k < count; ++k)
+            queue.Add(Mesh, Model::Transform(s.Pos[k], s.Rot[k], s.Scale[k]));
+    }
 };
 
 //------------------------------------------------------------------------- 
@@ -1072,7 +1888,48 @@ struct Scene
 {
     int     numModels;
     Model * Models[5000];
-	const int maxArrows = 100;
+    RenderQueue Queue;   // This frame's draws of Models, and of the arrows when not Instanced
+	const int maxArrows = 100;    // Most arrows the per arrow path draws, since it pays a draw call for each
+	int MaxParticles;    // Capacity of the particle pool and its snapshots, read by Init()
+	ParticleSystem * Particles;
+	SnapshotExchange * Snapshots;
+	int EmitRate;        // Particles spawned per Advect() while the pool has room; 1000 fills a million in about 1500 steps
+	double SimDt;        // Seconds of wall clock per simulation step
+	double SimClock;     // Time Update() last saw, negative before the first call
+	double Accumulator;  // Wall clock not yet simulated
+	int MaxSteps;        // Most steps one Update() takes; it drops the rest of a long stall
+	int SimSteps;        // Steps taken by the last Update()
+
+	// Everything above and below that the simulation writes belongs to the
+	// simulation thread while it runs. The render thread only reads
+	// Snapshots, and steers through the Requested values, which every step
+	// copies into FieldMode, Integrator and CheckTree before it starts.
+	bool SimThreaded;    // Start the simulation thread in Init()
+	Xoshiro128 Random;   // The simulation's own generator, fixed seed so runs repeat
+	std::thread SimThread;
+	std::atomic<bool> SimRunning;
+	std::atomic<int> RequestedFieldMode;
+	std::atomic<int> RequestedIntegrator;
+	std::atomic<bool> RequestedCheckTree;
+	int FramesDrawn;     // Frames BeginFrame() has been called for
+	int StaleFrames;     // Of those, the ones that found no new snapshot and drew the last one again
+	bool Instanced;      // Draw the arrows with one instanced call per eye rather than one call each
+	int DrawCallsLastFrame;
+
+	int FieldMode;       // FieldGrid::Direct, Trilinear, Tricubic or Tree
+	FieldGrid Field;
+	ChargeTree Tree;
+	EMWorkPool Pool;     // The simulation's workers, for the tree's octants and CoulombLive()
+	EMFieldCharges Charges;              // The step's charges as CoulombLive() hands them to emfieldCoulomb()
+	std::vector<float> BatchPos[3];      // Live particles' positions gathered by CoulombLive()
+	std::vector<float> BatchField[3];    // And the field there
+	bool CheckTree;      // Also take the direct sum in Tree mode and keep the worst difference
+	float TreeError;     // Largest relative difference seen by the last Advect()
+	enum { Euler, RK4, RK45 };
+	int Integrator;
+	float FrameTime;     // Field line parameter advanced per frame
+	float Tolerance;     // RK45 position error allowed per step, in world units
+	int FieldEvals;      // Field evaluations made by the last Advect()
 
     void Add(Model * n)
     {
@@ -1080,64 +1937,333 @@ struct Scene
         Models[numModels++] = n;
     }
 
-	float randf() {
-		return (float)(rand() % 1000) / 1000.f - 0.5f;
+	// Logs what the scene's meshes cost, next to what they cost when every
+	// Model embedded room for 2000 vertices and 2000 16 bit indices
+	void LogMemory()
+	{
+		size_t fixedBytes = sizeof(Model) - sizeof(std::vector<Model::Vertex>) - sizeof(std::vector<GLuint>)
+			+ 2000 * sizeof(Model::Vertex) + 2000 * sizeof(GLushort);
+		size_t cpuBytes = 0, gpuBytes = 0;
+		int models = numModels;
+		for (int i = 0; i < numModels; ++i) {
+			cpuBytes += Models[i]->CpuBytes();
+			gpuBytes += Models[i]->gpuBytes;
+		}
+		if (Particles) {
+			cpuBytes += Particles->Mesh->CpuBytes();
+			gpuBytes += Particles->Mesh->gpuBytes;
+			models++;
+		}
+		OVR_DEBUG_LOG(("%d models: %u bytes of RAM, %u of GL buffers; fixed arrays took %u bytes of RAM\n",
+			models, (unsigned)cpuBytes, (unsigned)gpuBytes, (unsigned)(models * fixedBytes)));
 	}
 
-    void Render(Matrix4f view, Matrix4f proj)
-    {
-		Vector3f cen( 0, 0, 0 );
-		const int numChg = 2;
-		Vector3f chgPos[numChg];
-		chgPos[0] = cen - Vector3f(-2.f, 0, 0);
-		chgPos[1] = cen - Vector3f(+2.f, 0, 0);
-		float chg[2] = { -1.f, +1.f };
-		Vector3f z(0.f, 0.f, 1.f);
+	Vector3f FieldAt(Vector3f xyz, int numChg, const Vector3f * chgPos, const float * chg)
+	{
+		FieldEvals++;
+		if (FieldMode == FieldGrid::Tree) {
+			Vector3f f = Tree.Field(xyz);
+			if (CheckTree) {
+				Vector3f d = FieldGrid::Coulomb(xyz, numChg, chgPos, chg);
+				float e = (f - d).Length() / d.Length();
+				TreeError = e > TreeError ? e : TreeError;
+			}
+			return f;
+		}
+		return FieldMode == FieldGrid::Direct ? FieldGrid::Coulomb(xyz, numChg, chgPos, chg) : Field.Lookup(xyz, FieldMode);
+	}
 
-		for (int i = 0; i < numModels; ++i) {
-			if (Models[i]->IsArrow) {
-				if (Models[i]->IsVisible) {
-					// INTEGRATE along f
-					Vector3f xyz = Models[i]->Pos;
-					Vector3f f;//(0.f, 1.f, 0.f);
-					
-					for (int j = 0; j < numChg; j++) {
-						Vector3f r = xyz - chgPos[j];
-						float mag = chg[j] / r.LengthSq();
-						r.Normalize();
-						f += r * mag;
-					}
+	// One Dormand-Prince 5(4) step of size h from y, whose field is k1.
+	// Returns the 5th order result and the field there in k7, and the
+	// length of the difference to the embedded 4th order result in err.
+	Vector3f DormandPrince(Vector3f y, Vector3f k1, float h, Vector3f & k7, float & err, int numChg, const Vector3f * chgPos, const float * chg)
+	{
+		Vector3f k2 = FieldAt(y + k1 * (h * (1.f / 5.f)), numChg, chgPos, chg);
+		Vector3f k3 = FieldAt(y + (k1 * (3.f / 40.f) + k2 * (9.f / 40.f)) * h, numChg, chgPos, chg);
+		Vector3f k4 = FieldAt(y + (k1 * (44.f / 45.f) + k2 * (-56.f / 15.f) + k3 * (32.f / 9.f)) * h, numChg, chgPos, chg);
+		Vector3f k5 = FieldAt(y + (k1 * (19372.f / 6561.f) + k2 * (-25360.f / 2187.f) + k3 * (64448.f / 6561.f) + k4 * (-212.f / 729.f)) * h, numChg, chgPos, chg);
+		Vector3f k6 = FieldAt(y + (k1 * (9017.f / 3168.f) + k2 * (-355.f / 33.f) + k3 * (46732.f / 5247.f) + k4 * (49.f / 176.f) + k5 * (-5103.f / 18656.f)) * h, numChg, chgPos, chg);
+		Vector3f y5 = y + (k1 * (35.f / 384.f) + k3 * (500.f / 1113.f) + k4 * (125.f / 192.f) + k5 * (-2187.f / 6784.f) + k6 * (11.f / 84.f)) * h;
+		k7 = FieldAt(y5, numChg, chgPos, chg);
+		Vector3f e = (k1 * (71.f / 57600.f) + k3 * (-71.f / 16695.f) + k4 * (71.f / 1920.f) + k5 * (-17253.f / 339200.f) + k6 * (22.f / 525.f) + k7 * (-1.f / 40.f)) * h;
+		err = e.Length();
+		return y5;
+	}
 
-					Models[i]->Pos += f * 0.01f;
-					Models[i]->Scale = f.Length();
-					f.Normalize();
-					Models[i]->Rot = Quatf::Align(f, z);
-					Models[i]->Render(view, proj);
+	// The direct sum at every live particle as one emfieldCoulomb() batch on
+	// Pool, stored as the particles' velocities for EulerStep()
+	void CoulombLive(ParticleSystem & p, int numChg, const Vector3f * chgPos, const float * chg)
+	{
+		Charges.reset();
+		for (int j = 0; j < numChg; j++)
+			Charges.add(DVec3(chgPos[j].x, chgPos[j].y, chgPos[j].z), chg[j]);
+		int n = p.NumLive;
+		for (int c = 0; c < 3; ++c) {
+			BatchPos[c].resize(n);
+			BatchField[c].resize(n);
+		}
+		for (int k = 0; k < n; ++k) {
+			int i = p.Live[k];
+			BatchPos[0][k] = p.PosX[i];
+			BatchPos[1][k] = p.PosY[i];
+			BatchPos[2][k] = p.PosZ[i];
+		}
+		float * out[3] = { BatchField[0].data(), BatchField[1].data(), BatchField[2].data() };
+		emfieldCoulomb(&Pool, n, BatchPos[0].data(), BatchPos[1].data(), BatchPos[2].data(), Charges, out);
+		for (int k = 0; k < n; ++k) {
+			int i = p.Live[k];
+			p.VelX[i] = out[0][k];
+			p.VelY[i] = out[1][k];
+			p.VelZ[i] = out[2][k];
+		}
+		FieldEvals += n;
+	}
 
-					Vector3f rToChg0 = xyz - chgPos[0];
-					if (rToChg0.Length() < 1.f) {
-						Models[i]->IsVisible = 0;
-					}
+	// Euler's step for particle i from the field k1 where it is
+	Vector3f EulerStep(ParticleSystem & p, int i, Vector3f k1)
+	{
+		float dt = FrameTime;
+		p.VelX[i] = k1.x;
+		p.VelY[i] = k1.y;
+		p.VelZ[i] = k1.z;
+		p.PosX[i] += k1.x * dt;
+		p.PosY[i] += k1.y * dt;
+		p.PosZ[i] += k1.z * dt;
+		return k1;
+	}
 
-					if (xyz.Length() > 6.f) {
-						Models[i]->IsVisible = 0;
-					}
+	// Advances particle i from y by FrameTime along the field with the selected
+	// integrator, storing its new position and the field there as its velocity.
+	// Returns that field, or for Euler the field at y as it has always done.
+	Vector3f Integrate(ParticleSystem & p, int i, Vector3f y, int numChg, const Vector3f * chgPos, const float * chg)
+	{
+		Vector3f k1 = FieldAt(y, numChg, chgPos, chg);
+		float dt = FrameTime;
+		if (Integrator == Euler)
+			return EulerStep(p, i, k1);
+
+		if (Integrator == RK4) {
+			Vector3f k2 = FieldAt(y + k1 * (dt * 0.5f), numChg, chgPos, chg);
+			Vector3f k3 = FieldAt(y + k2 * (dt * 0.5f), numChg, chgPos, chg);
+			Vector3f k4 = FieldAt(y + k3 * dt, numChg, chgPos, chg);
+			y += (k1 + (k2 + k3) * 2.f + k4) * (dt / 6.f);
+			k1 = FieldAt(y, numChg, chgPos, chg);
+		}
+		else {
+			// Steps of the particle's own size until the frame is covered. The
+			// size carries over between frames so a particle that has left the
+			// charges takes one step per frame. A frame may end early where
+			// the field is too steep, which shows as the particle lagging.
+			const int maxSteps = 32;
+			float left = dt;
+			float h = p.Step[i] > 0.f ? p.Step[i] : dt;
+			for (int n = 0; n < maxSteps && left > 0.f; n++) {
+				float hh = h < left ? h : left;
+				Vector3f k7;
+				float err;
+				Vector3f y5 = DormandPrince(y, k1, hh, k7, err, numChg, chgPos, chg);
+				float scale = err > 0.f ? 0.9f * powf(Tolerance / err, 0.2f) : 5.f;
+				scale = scale < 0.2f ? 0.2f : (scale > 5.f ? 5.f : scale);
+				if (err <= Tolerance) {
+					y = y5;
+					k1 = k7;
+					left -= hh;
+					// A step cut short by the end of the frame says nothing
+					// about the size the next one could have been
+					if (hh == h || scale < 1.f)
+						h = hh * scale;
 				}
 				else {
-					if (rand() % 1 == 0) {
-						Models[i]->IsVisible = 1;
-						Models[i]->Pos = Vector3f(randf(), randf(), randf());
-						Models[i]->Pos.Normalize();
-						Models[i]->Pos *= 0.1f;
-						Models[i]->Pos += chgPos[1];
-					}
+					h = hh * scale;
 				}
 			}
+			p.Step[i] = h;
+		}
+		p.PosX[i] = y.x;
+		p.PosY[i] = y.y;
+		p.PosZ[i] = y.z;
+		p.VelX[i] = k1.x;
+		p.VelY[i] = k1.y;
+		p.VelZ[i] = k1.z;
+		return k1;
+	}
+
+	// Moves every live particle along the field of the charges, then spawns
+	// up to EmitRate new ones next to the positive charge
+	void Advect(ParticleSystem & p, int numChg, const Vector3f * chgPos, const float * chg)
+	{
+		Vector3f z(0.f, 0.f, 1.f);
+		FieldEvals = 0;
+		TreeError = 0.f;
+		// Euler on the direct sum needs nothing but the field where every
+		// particle is now, so that is taken for all of them at once
+		bool batched = Integrator == Euler && FieldMode == FieldGrid::Direct;
+		if (batched)
+			CoulombLive(p, numChg, chgPos, chg);
+		for (int k = 0; k < p.NumLive; ) {
+			int i = p.Live[k];
+			// INTEGRATE along f
+			Vector3f xyz(p.PosX[i], p.PosY[i], p.PosZ[i]);
+			Vector3f f = batched ? EulerStep(p, i, Vector3f(p.VelX[i], p.VelY[i], p.VelZ[i])) : Integrate(p, i, xyz, numChg, chgPos, chg);
+			p.Scale[i] = f.Length();
+			f.Normalize();
+			p.Rot[i] = Quatf::Align(f, z);
+
+			Vector3f rToChg0 = xyz - chgPos[0];
+			if (rToChg0.Length() < 1.f || xyz.Length() > 6.f) {
+				p.Kill(k);
+			}
 			else {
-				Models[i]->Render(view, proj);
+				++k;
 			}
 		}
-    }
+
+		// Directions are drawn a batch at a time, Lanes per generator call
+		float dx[Xoshiro128::Lanes], dy[Xoshiro128::Lanes], dz[Xoshiro128::Lanes];
+		int emit = EmitRate < p.NumFree ? EmitRate : p.NumFree;
+		for (int n = 0; n < emit; ++n) {
+			int l = n % Xoshiro128::Lanes;
+			if (l == 0)
+				Random.UnitSphere(dx, dy, dz, Xoshiro128::Lanes);
+			int i = p.Spawn();
+			Vector3f spawn = chgPos[1] + Vector3f(dx[l], dy[l], dz[l]) * 0.1f;
+			p.PosX[i] = spawn.x;
+			p.PosY[i] = spawn.y;
+			p.PosZ[i] = spawn.z;
+			p.VelX[i] = p.VelY[i] = p.VelZ[i] = 0.f;
+			p.Scale[i] = 0.f;    // Drawn for the first time after its next Advect()
+			p.Step[i] = 0.f;
+			p.Color[i] = 0xffffffff;
+			p.Rot[i] = Quatf();
+		}
+	}
+
+	// One fixed step of the simulation: FrameTime of field line for every
+	// particle, whatever the display is doing
+	void Simulate()
+	{
+		FieldMode = RequestedFieldMode.load();
+		Integrator = RequestedIntegrator.load();
+		CheckTree = RequestedCheckTree.load();
+
+		Vector3f cen( 0, 0, 0 );
+		const int numChg = 2;
+		Vector3f chgPos[numChg];
+		chgPos[0] = cen - Vector3f(-2.f, 0, 0);
+		chgPos[1] = cen - Vector3f(+2.f, 0, 0);
+		float chg[2] = { -1.f, +1.f };
+
+		// Particles die beyond 6 so the grids only need to reach a little past that
+		if ((FieldMode == FieldGrid::Trilinear || FieldMode == FieldGrid::Tricubic) && !Field.Matches(numChg, chgPos, chg)) {
+			Field.Build(numChg, chgPos, chg, 6.5f, 64, 1.f, 33, 0.2f);
+		}
+		// The tree is rebuilt every step so the charges may move
+		if (FieldMode == FieldGrid::Tree) {
+			Tree.Build(numChg, chgPos, chg, &Pool);
+		}
+
+		if (Particles) {
+			Advect(*Particles, numChg, chgPos, chg);
+		}
+	}
+
+	// Runs as many SimDt steps as the time in seconds since the last call
+	// covers and publishes the result to Snapshots. Called by the
+	// simulation thread, or by BeginFrame() when there is none.
+	void Update(double seconds)
+	{
+		if (SimClock < 0.0) {
+			// Start with one step so there is something to draw
+			SimClock = seconds;
+			Accumulator = SimDt;
+		}
+		Accumulator += seconds - SimClock;
+		SimClock = seconds;
+		if (Accumulator > MaxSteps * SimDt) {
+			Accumulator = MaxSteps * SimDt;
+		}
+
+		SimSteps = 0;
+		while (Accumulator >= SimDt) {
+			Simulate();
+			Accumulator -= SimDt;
+			SimSteps++;
+		}
+		if (SimSteps && Particles) {
+			ParticleSnapshot & snap = Snapshots->Write();
+			Particles->Capture(snap);
+			snap.FieldEvals = FieldEvals;
+			snap.TreeChecked = FieldMode == FieldGrid::Tree && CheckTree;
+			snap.TreeError = TreeError;
+			Snapshots->Publish();
+		}
+	}
+
+	static double Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// The simulation thread: steps on its own clock and sleeps until the
+	// next step is due, publishing as it goes
+	void SimLoop()
+	{
+		while (SimRunning.load()) {
+			Update(Now());
+			double wait = SimDt - Accumulator;
+			std::this_thread::sleep_for(std::chrono::duration<double>(wait > 0.0 ? wait : 0.0));
+		}
+	}
+
+	void StartSimThread()
+	{
+		if (SimThread.joinable() || !Particles)
+			return;
+		SimRunning = true;
+		SimThread = std::thread(&Scene::SimLoop, this);
+	}
+
+	void StopSimThread()
+	{
+		if (!SimThread.joinable())
+			return;
+		SimRunning = false;
+		SimThread.join();
+	}
+
+	// Called once per displayed frame, before either eye is drawn, with the
+	// current time in seconds. Picks up the newest snapshot, stepping the
+	// simulation here first when it has no thread of its own.
+	void BeginFrame(double seconds)
+	{
+		if (Snapshots) {
+			if (!SimThread.joinable())
+				Update(seconds);
+			FramesDrawn++;
+			if (Snapshots->Acquire())
+				Particles->Upload(Snapshots->Read());
+			else
+				StaleFrames++;
+		}
+		DrawCallsLastFrame = Platform.DrawCalls;
+		Platform.DrawCalls = 0;
+
+		Queue.Clear();
+		for (int i = 0; i < numModels; ++i)
+			Queue.Add(Models[i], Models[i]->GetMatrix());
+		if (Particles && !Instanced)
+			Particles->Enqueue(Snapshots->Read(), Queue, maxArrows);
+		Queue.Sort();
+	}
+
+	// Draws what BeginFrame() queued; called once per eye and changes nothing
+	void Render(Matrix4f view, Matrix4f proj)
+	{
+		if (Particles && Instanced) {
+			Particles->RenderInstanced(view, proj);
+		}
+		Queue.Flush(view, proj);
+	}
 
     GLuint CreateShader(GLenum type, const GLchar* src)
     {
@@ -1186,6 +2312,34 @@ struct Scene
 			"   oColor.a    = Color.a;\n"
             "}\n";
 
+        // The same lighting for a copy of the arrow per instance, placed by the
+        // instance's position, rotation quaternion and scale instead of matWV
+        static const GLchar* InstancedVertexShaderSrc =
+            "#version 150\n"
+            "uniform mat4 matVP;\n"
+            "in      vec4 Position;\n"
+            "in      vec4 Color;\n"
+            "in      vec2 TexCoord;\n"
+            "in      vec3 Normal;\n"
+            "in      vec3 InstancePos;\n"
+            "in      vec4 InstanceRot;\n"
+            "in      float InstanceScale;\n"
+            "in      vec4 InstanceColor;\n"
+            "out     vec2 oTexCoord;\n"
+            "out     vec4 oColor;\n"
+            "vec3 rotate(vec4 q, vec3 v) { return v + 2.0 * cross(q.xyz, cross(q.xyz, v) + q.w * v); }\n"
+            "void main()\n"
+            "{\n"
+            "	vec4 n = vec4(rotate(InstanceRot, Normal) * InstanceScale, 0.0);\n"
+            "	float nDotVP = max(0.0, dot(n, vec4(1.414213562373095, 1.414213562373095, 0.0, 1.0)));\n"
+            "	if(length(Normal)==0.0) { nDotVP = 1; }\n"
+            "   gl_Position = matVP * vec4(rotate(InstanceRot, Position.xyz) * InstanceScale + InstancePos, 1.0);\n"
+            "   oTexCoord   = TexCoord;\n"
+            "   vec4 c      = Color * InstanceColor;\n"
+            "   oColor.rgb  = pow(c.rgb, vec3(2.2)) * nDotVP + vec3(0.06);\n"
+            "   oColor.a    = c.a;\n"
+            "}\n";
+
         static const char* FragmentShaderSrc =
             "#version 150\n"
             "uniform sampler2D Texture0;\n"
@@ -1198,10 +2352,12 @@ struct Scene
             "}\n";
 
         GLuint    vshader = CreateShader(GL_VERTEX_SHADER, VertexShaderSrc);
+        GLuint    ivshader = CreateShader(GL_VERTEX_SHADER, InstancedVertexShaderSrc);
         GLuint    fshader = CreateShader(GL_FRAGMENT_SHADER, FragmentShaderSrc);
 
         // Make textures
         ShaderFill * grid_material[5];
+        ShaderFill * arrow_instanced = nullptr;
         for (int k = 0; k < 5; ++k)
         {
             static DWORD tex_pixels[256 * 256];
@@ -1221,21 +2377,24 @@ struct Scene
             }
             TextureBuffer * generated_texture = new TextureBuffer(nullptr, false, false, Sizei(256, 256), 4, (unsigned char *)tex_pixels, 1);
             grid_material[k] = new ShaderFill(vshader, fshader, generated_texture);
+            if (k == 4) {
+                // Each fill owns its texture, so the instanced arrows get their own copy
+                TextureBuffer * arrow_texture = new TextureBuffer(nullptr, false, false, Sizei(256, 256), 4, (unsigned char *)tex_pixels, 1);
+                arrow_instanced = new ShaderFill(ivshader, fshader, arrow_texture);
+            }
         }
 
         glDeleteShader(vshader);
+        glDeleteShader(ivshader);
         glDeleteShader(fshader);
 
 		Model *m;
 
-		for (int i = 0; i < maxArrows; i++ ) {
-			m = new Model(Vector3f(0, 0, 0), grid_material[4]);
-			m->AddArrow();
-			m->AllocateBuffers();
-			m->IsVisible = 0;
-			m->IsArrow = 1;
-			Add(m);
-		}
+		m = new Model(Vector3f(0, 0, 0), grid_material[4]);
+		m->AddArrow();
+		m->AllocateBuffers();
+		Particles = new ParticleSystem(MaxParticles, m, arrow_instanced);
+		Snapshots = new SnapshotExchange(MaxParticles);
 
 		float x1 = -10.f;
 		float x2 = +10.f;
@@ -1261,18 +2420,53 @@ struct Scene
         m->AddSolidColorBox(x1, y2, z1, x2, y2+0.1f, z2, 0xff808080);
         m->AllocateBuffers();
         Add(m);
+
+        if (SimThreaded)
+            StartSimThread();
     }
 
-    Scene() : numModels(0) {}
-    Scene(bool includeIntensiveGPUobject) :
-        numModels(0)
+    Scene() : numModels(0), MaxParticles(1000000), Particles(nullptr), Snapshots(nullptr), EmitRate(1000), SimDt(1.0 / 90.0), SimClock(-1.0), Accumulator(0), MaxSteps(4), SimSteps(0),
+        SimThreaded(true), SimRunning(false), RequestedFieldMode(FieldGrid::Direct), RequestedIntegrator(Euler), RequestedCheckTree(false), FramesDrawn(0), StaleFrames(0), Instanced(true), DrawCallsLastFrame(0), FieldMode(FieldGrid::Direct), CheckTree(false), TreeError(0), Integrator(Euler), FrameTime(0.01f), Tolerance(1e-3f), FieldEvals(0) {}
+    Scene(bool includeIntensiveGPUobject, int maxParticles = 1000000) :
+        numModels(0),
+        MaxParticles(maxParticles),
+        Particles(nullptr),
+        Snapshots(nullptr),
+        EmitRate(1000),
+        SimDt(1.0 / 90.0),
+        SimClock(-1.0),
+        Accumulator(0),
+        MaxSteps(4),
+        SimSteps(0),
+        SimThreaded(true),
+        SimRunning(false),
+        RequestedFieldMode(FieldGrid::Direct),
+        RequestedIntegrator(Euler),
+        RequestedCheckTree(false),
+        FramesDrawn(0),
+        StaleFrames(0),
+        Instanced(true),
+        DrawCallsLastFrame(0),
+        FieldMode(FieldGrid::Direct),
+        CheckTree(false),
+        TreeError(0),
+        Integrator(Euler),
+        FrameTime(0.01f),
+        Tolerance(1e-3f),
+        FieldEvals(0)
     {
         Init(includeIntensiveGPUobject);
     }
     void Release()
     {
+        StopSimThread();
+        Queue.Clear();
         while (numModels-- > 0)
             delete Models[numModels];
+        delete Particles;
+        Particles = nullptr;
+        delete Snapshots;
+        Snapshots = nullptr;
     }
     ~Scene()
     {
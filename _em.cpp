@@ -6,6 +6,9 @@
 // STDLIB includes:
 #include "math.h"
 // MODULE includes:
+#include "emfield.h"
+#include "emmultipole.h"
+#include "empool.h"
 // ZBSLIB includes:
 #include "zvars.h"
 #include "zplugin.h"
@@ -20,8 +23,52 @@
 ZPLUGIN_BEGIN( em );
 
 ZVAR( float, Em_scale, 1.0 );
+ZVAR( int, Em_threads, 0 );
+	// Threads used to evaluate the field grid, 0 means one per core
+ZVARB( int, Em_resX, 16, 1, 256 );
+ZVARB( int, Em_resY, 16, 1, 256 );
+ZVARB( int, Em_resZ, 16, 1, 256 );
+	// Sample points per axis
+ZVAR( float, Em_minX, -7.5 );
+ZVAR( float, Em_maxX, 7.5 );
+ZVAR( float, Em_minY, -7.5 );
+ZVAR( float, Em_maxY, 7.5 );
+ZVAR( float, Em_minZ, -7.5 );
+ZVAR( float, Em_maxZ, 7.5 );
+	// Inclusive bounds of the sample points. The defaults reproduce the old 17 step, 17 unit cube.
+ZVAR( int, Em_autoDensity, 1 );
+ZVAR( float, Em_frameBudgetMs, 16.0 );
+	// When the frame takes longer than the budget only every n-th arrow is drawn along each axis
+ZVAR( int, Em_incremental, 1 );
+	// Advance the field from the previous frame with one complex multiply per point
+ZVAR( int, Em_float, 0 );
+	// Evaluate and store the field grid in float. Twice the SIMD lanes and half the
+	// memory traffic for ~1e-6 relative error, which is invisible in the arrows.
+
+ZVAR( int, Em_arraySources, 0 );
+ZVAR( float, Em_arrayPhase, 0.5 );
+	// When non-zero the field is that many z dipoles along x, half a wavelength
+	// apart, each Em_arrayPhase radians behind the previous one
+ZVAR( int, Em_drawH, 0 );
+	// Draw the real part of H with the magnetic material instead of the
+	// imaginary part of E that it has always shown
+ZVAR( int, Em_drawPoynting, 0 );
+	// Draw the instantaneous Poynting vector with the electric material
+	// instead of the real part of E
+ZVAR( float, Em_multipoleTol, 0.0 );
+	// When non-zero the sources are summed through cluster expansions of this
+	// relative accuracy. Only worth it for many sources packed close together.
 
 GLuint arrow = 0;
+EMWorkPool *fieldPool = 0;
+EMFieldSampler fieldSampler;
+EMFieldSamplerF fieldSamplerF;
+EMFieldSources fieldSources;
+EMFieldMultipole fieldMultipole;
+int fieldSourcesCount = 0;
+double fieldSourcesPhase = 0.0;
+int arrowStride = 1;
+double lastFrameTime = 0.0;
 
 GLuint makeArrow() {
 	GLuint index = glGenLists(1);
@@ -49,67 +96,6 @@ GLuint makeArrow() {
 	return index;
 }
 
-DVec3 rectToSpherePos( DVec3 a ) {
-	DVec3 b;
-	
-	// r
-	b.x = sqrt( a.x*a.x + a.y*a.y + a.z*a.z );
-	
-	// theta
-	b.y = acos( a.z / b.x );
-	
-	// phi
-	b.z = atan2( a.x, a.y );
-	
-	return b;
-}
-
-DVec3 sphereToRectPos( DVec3 a ) {
-	DVec3 b;
-	
-	b.x = a.x * sin(a.y) * cos(a.z);
-	b.y = a.x * sin(a.y) * sin(a.z);
-	b.z = a.x * cos(a.y);
-	
-	return b;
-}
-
-DMat3 sphereToRectUnitVectors( double theta, double phi ) {
-	DMat3 a;
-	double st = sin(theta);
-	double ct = cos(theta);
-	double sp = sin(phi);
-	double cp = cos(phi);
-	a.m[0][0] = st * cp;
-	a.m[1][0] = ct * cp;
-	a.m[2][0] = -sp;
-	a.m[0][1] = st * sp;
-	a.m[1][1] = ct * sp;
-	a.m[2][1] = cp;
-	a.m[0][2] = ct;
-	a.m[1][2] = -st;
-	a.m[2][2] = 0.0;
-	return a;
-}
-
-DMat3 rectToSphereUnitVectors( double theta, double phi ) {
-	DMat3 a;
-	double st = sin(theta);
-	double ct = cos(theta);
-	double sp = sin(phi);
-	double cp = cos(phi);
-	a.m[0][0] = st * cp;
-	a.m[1][0] = st * sp;
-	a.m[2][0] = ct;
-	a.m[0][1] = ct * cp;
-	a.m[1][1] = ct * sp;
-	a.m[2][1] = -st;
-	a.m[0][2] = -sp;
-	a.m[1][2] = cp;
-	a.m[2][2] = 0.0;
-	return a;
-}
-
 void arrowInUnitDirecton( DVec3 pos, DVec3 dir, double mag ) {
 	static double arrowMat[16] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0 };
 	arrowMat[0] = dir.x;
@@ -125,75 +111,48 @@ void arrowInUnitDirecton( DVec3 pos, DVec3 dir, double mag ) {
 	glPopMatrix();
 }
 
-void render() {
-	glClear( GL_DEPTH_BUFFER_BIT );
-	zviewpointSetupView();
-
-	glEnable( GL_DEPTH_TEST );
-	glEnable( GL_NORMALIZE );
-	glEnable( GL_LIGHTING );
-	glEnable( GL_LIGHT0 );
-
-	GLfloat lightPosition[] = { 1.0f, 1.0f, 1.0f, 0.0f };
-	glLightfv( GL_LIGHT0, GL_POSITION, lightPosition );
-	GLfloat lightAmbient[] = { 0.4f, 0.4f, 0.4f, 1.0f };
-	glLightfv(GL_LIGHT0, GL_AMBIENT, lightAmbient);
-	GLfloat lightDiffuse[] = { 1.0f, 1.0f, 1.0f, 1.0f };
-	glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
-	
-	float electricMatDiffuse[] = { 1.0f, 0.5f, 0.5f, 1.0f };
-	float electricMatAmbient[] = { 0.5f, 0.1f, 0.1f, 1.0f };
-	float magneticMatDiffuse[] = { 0.5f, 0.5f, 1.0f, 1.0f };
-	float magneticMatAmbient[] = { 0.1f, 0.1f, 0.5f, 1.0f };
+template< class T >
+void updateField( EMFieldSamplerT<T> &sampler, EMFieldGrid &grid ) {
+	if( !sampler.grid.equals( grid ) ) {
+		sampler.setGrid( grid );
+	}
+	sampler.omega = 1.0;
+	sampler.beta = 2.0;
+	sampler.unitAmplitude = 1;
+	sampler.magnetic = Em_drawH;
+	sampler.derived = Em_drawPoynting;
+	sampler.sources = fieldSources.count > 0 ? &fieldSources : 0;
+	sampler.multipole = Em_multipoleTol > 0.f ? &fieldMultipole : 0;
+	fieldMultipole.tolerance = Em_multipoleTol;
+	if( Em_incremental ) {
+		sampler.step( zTime - sampler.stepTime );
+	}
+	else {
+		sampler.sample( zTime );
+	}
+}
 
-	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, electricMatDiffuse);
-	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, electricMatAmbient);
-	
-	const int steps = 17;
-	const double stepsF = (double)steps;
-	const double dimF = 17.0;
+template< class T >
+void drawField( EMFieldSamplerT<T> &sampler, EMFieldGrid &grid, float *electricMatDiffuse, float *electricMatAmbient, float *magneticMatDiffuse, float *magneticMatAmbient ) {
+	if( sampler.count != grid.count() ) {
+		// The grid could not be allocated
+		return;
+	}
 
-	double c1[16] = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 1.0 };
-	//DVec3 charge( cos(zTime)+dimF/2.0, dimF/2.0, dimF/2.0 );
+	for( int xi=0; xi<grid.n[0]; xi+=arrowStride ) {
+		for( int yi=0; yi<grid.n[1]; yi+=arrowStride ) {
+			for( int zi=0; zi<grid.n[2]; zi+=arrowStride ) {
+				int i = grid.index( xi, yi, zi );
+				DVec3 rect0( sampler.px[i], sampler.py[i], sampler.pz[i] );
+				DVec3 eFieldInRectReal( sampler.eReX[i], sampler.eReY[i], sampler.eReZ[i] );
+				DVec3 eFieldInRectImag( sampler.eImX[i], sampler.eImY[i], sampler.eImZ[i] );
+				if( sampler.magnetic && sampler.stepMagnetic ) {
+					eFieldInRectImag = DVec3( sampler.hReX[i], sampler.hReY[i], sampler.hReZ[i] );
+				}
+				if( sampler.derived && sampler.stepDerived ) {
+					eFieldInRectReal = DVec3( sampler.sX[i], sampler.sY[i], sampler.sZ[i] );
+				}
 
-	for( int xi=1; xi<steps; xi++ ) {
-		double x = (double)xi * dimF / stepsF;
-		for( int yi=1; yi<steps; yi++ ) {
-			double y = (double)yi * dimF / stepsF;
-			for( int zi=1; zi<steps; zi++ ) {
-				double z = (double)zi * dimF / stepsF;
-			
-				DVec3 rect0(x-dimF/2.0,y-dimF/2.0,z-dimF/2.0);
-				DVec3 sphe0 = rectToSpherePos( rect0 );
-				
-				DVec3 eField;
-				double omega = 1.0;
-				double beta = 2.0;
-				double ot = omega * zTime - beta * sphe0.r;
-				double eField_rReal_inside = (2.0 * omega) / (beta * sphe0.r * sphe0.r) * cos(sphe0.t);
-				double eField_rImag_inside = -(2.0 * omega) / (beta*beta * sphe0.r * sphe0.r * sphe0.r) * cos(sphe0.t);
-				double eField_tReal_inside = omega / (beta * sphe0.r * sphe0.r) * sin(sphe0.t);
-				double eField_tImag_inside = ( -omega / (beta*beta * sphe0.r * sphe0.r * sphe0.r) + omega / sphe0.r ) * sin(sphe0.t);
-				double eField_pReal_inside = 0.0;
-				double eField_pImag_inside = 0.0;
-
-				eField_rReal_inside = 0.0;
-				eField_rImag_inside = 0.0;
-				eField_tReal_inside = 1.0;
-				eField_tImag_inside = 0.0;
-				
-				double eField_rReal = eField_rReal_inside * cos(ot) - eField_rImag_inside * sin(ot);
-				double eField_rImag = eField_rImag_inside * cos(ot) + eField_rReal_inside * sin(ot);
-				double eField_tReal = eField_tReal_inside * cos(ot) - eField_tImag_inside * sin(ot);
-				double eField_tImag = eField_tImag_inside * cos(ot) + eField_tReal_inside * sin(ot);
-				double eField_pReal = eField_pReal_inside * cos(ot) - eField_pImag_inside * sin(ot);
-				double eField_pImag = eField_pImag_inside * cos(ot) + eField_pReal_inside * sin(ot);
-		
-				
-				DMat3 uv = rectToSphereUnitVectors( sphe0.t, sphe0.p );
-				DVec3 eFieldInRectReal = uv.mul( DVec3( eField_rReal, eField_tReal, eField_pReal ) );
-				DVec3 eFieldInRectImag = uv.mul( DVec3( eField_rImag, eField_tImag, eField_pImag ) );
-				
 				glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, electricMatDiffuse);
 				glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, electricMatAmbient);
 				double eFieldInRectRealMag = eFieldInRectReal.mag();
@@ -225,11 +184,91 @@ void render() {
 	}
 }
 
+void render() {
+	glClear( GL_DEPTH_BUFFER_BIT );
+	zviewpointSetupView();
+
+	glEnable( GL_DEPTH_TEST );
+	glEnable( GL_NORMALIZE );
+	glEnable( GL_LIGHTING );
+	glEnable( GL_LIGHT0 );
+
+	GLfloat lightPosition[] = { 1.0f, 1.0f, 1.0f, 0.0f };
+	glLightfv( GL_LIGHT0, GL_POSITION, lightPosition );
+	GLfloat lightAmbient[] = { 0.4f, 0.4f, 0.4f, 1.0f };
+	glLightfv(GL_LIGHT0, GL_AMBIENT, lightAmbient);
+	GLfloat lightDiffuse[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+	glLightfv(GL_LIGHT0, GL_DIFFUSE, lightDiffuse);
+	
+	float electricMatDiffuse[] = { 1.0f, 0.5f, 0.5f, 1.0f };
+	float electricMatAmbient[] = { 0.5f, 0.1f, 0.1f, 1.0f };
+	float magneticMatDiffuse[] = { 0.5f, 0.5f, 1.0f, 1.0f };
+	float magneticMatAmbient[] = { 0.1f, 0.1f, 0.5f, 1.0f };
+
+	glMaterialfv(GL_FRONT_AND_BACK, GL_DIFFUSE, electricMatDiffuse);
+	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, electricMatAmbient);
+	
+	// The field is evaluated headless by EMFieldSampler; here we only draw it
+	fieldPool->setThreadCount( Em_threads );
+	EMFieldGrid grid(
+		DVec3( Em_minX, Em_minY, Em_minZ ), DVec3( Em_maxX, Em_maxY, Em_maxZ ),
+		Em_resX < 1 ? 1 : Em_resX, Em_resY < 1 ? 1 : Em_resY, Em_resZ < 1 ? 1 : Em_resZ
+	);
+
+	// Thin out the arrows when the previous frame went over budget and bring
+	// them back once there is plenty of headroom again
+	double now = zTimeNow();
+	double frameMs = lastFrameTime > 0.0 ? ( now - lastFrameTime ) * 1000.0 : 0.0;
+	lastFrameTime = now;
+	if( !Em_autoDensity ) {
+		arrowStride = 1;
+	}
+	else if( frameMs > Em_frameBudgetMs && arrowStride < 16 ) {
+		arrowStride++;
+	}
+	else if( frameMs < 0.5 * Em_frameBudgetMs && arrowStride > 1 ) {
+		arrowStride--;
+	}
+
+	//DVec3 charge( cos(zTime)+dimF/2.0, dimF/2.0, dimF/2.0 );
+
+	if( Em_arraySources != fieldSourcesCount || Em_arrayPhase != fieldSourcesPhase ) {
+		// beta is 2 so half a wavelength is pi/2. Sources sit between grid
+		// points so that none of them lands exactly on a sample.
+		fieldSourcesCount = Em_arraySources;
+		fieldSourcesPhase = Em_arrayPhase;
+		fieldSources.reset();
+		for( int i=0; i<fieldSourcesCount; i++ ) {
+			double x = ( i - 0.5*(fieldSourcesCount-1) ) * PI2 / 4.0;
+			fieldSources.add( DVec3( x, 0.01, 0.01 ), DVec3( 0.0, 0.0, 1.0 ), 1.0, -i * fieldSourcesPhase );
+		}
+	}
+
+	// Only the sampler in use keeps its memory
+	if( Em_float ) {
+		fieldSampler.clear();
+		updateField( fieldSamplerF, grid );
+		drawField( fieldSamplerF, grid, electricMatDiffuse, electricMatAmbient, magneticMatDiffuse, magneticMatAmbient );
+	}
+	else {
+		fieldSamplerF.clear();
+		updateField( fieldSampler, grid );
+		drawField( fieldSampler, grid, electricMatDiffuse, electricMatAmbient, magneticMatDiffuse, magneticMatAmbient );
+	}
+}
+
 void startup() {
 	arrow = makeArrow();
+	fieldPool = new EMWorkPool( Em_threads );
+	fieldSampler.pool = fieldPool;
+	fieldSamplerF.pool = fieldPool;
 }
 
 void shutdown() {
+	fieldSampler.pool = 0;
+	fieldSamplerF.pool = 0;
+	delete fieldPool;
+	fieldPool = 0;
 }
 
 void handleMsg( ZMsg *msg ) {
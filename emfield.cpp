@@ -0,0 +1,1123 @@
+// @ZBS {
+//		*MASTER_FILE 1
+//		+DESCRIPTION {
+//			Headless dipole field evaluation on a regular grid
+//		}
+//		*PORTABILITY win32 unix
+//		*REQUIRED_FILES emfield.cpp emfield.h emfieldkernel.h emfield_avx2.cpp emfield_avx512.cpp emmultipole.cpp emmultipole.h empool.cpp empool.h zvec.cpp zvec.h
+//		*VERSION 1.0
+//		+HISTORY {
+//			1.0 Split out of the render() loop in _em.cpp
+//		}
+//		+TODO {
+//		}
+//		*SELF_TEST no
+//		*PUBLISH no
+// }
+// OPERATING SYSTEM specific includes:
+// SDK includes:
+// STDLIB includes:
+#include "math.h"
+#include "stdlib.h"
+#include "string.h"
+// MODULE includes:
+#include "emfield.h"
+#include "emfieldkernel.h"
+#include "emmultipole.h"
+#include "empool.h"
+// ZBSLIB includes:
+
+#if defined(EMFIELD_X86) && defined(_MSC_VER)
+	#include "intrin.h"
+#endif
+
+DVec3 rectToSpherePos( DVec3 a ) {
+	DVec3 b;
+
+	// r
+	b.x = sqrt( a.x*a.x + a.y*a.y + a.z*a.z );
+
+	// theta
+	b.y = acos( a.z / b.x );
+
+	// phi
+	b.z = atan2( a.x, a.y );
+
+	return b;
+}
+
+DVec3 sphereToRectPos( DVec3 a ) {
+	DVec3 b;
+
+	b.x = a.x * sin(a.y) * cos(a.z);
+	b.y = a.x * sin(a.y) * sin(a.z);
+	b.z = a.x * cos(a.y);
+
+	return b;
+}
+
+DMat3 sphereToRectUnitVectors( double theta, double phi ) {
+	DMat3 a;
+	double st = sin(theta);
+	double ct = cos(theta);
+	double sp = sin(phi);
+	double cp = cos(phi);
+	a.m[0][0] = st * cp;
+	a.m[1][0] = ct * cp;
+	a.m[2][0] = -sp;
+	a.m[0][1] = st * sp;
+	a.m[1][1] = ct * sp;
+	a.m[2][1] = cp;
+	a.m[0][2] = ct;
+	a.m[1][2] = -st;
+	a.m[2][2] = 0.0;
+	return a;
+}
+
+DMat3 rectToSphereUnitVectors( double theta, double phi ) {
+	DMat3 a;
+	double st = sin(theta);
+	double ct = cos(theta);
+	double sp = sin(phi);
+	double cp = cos(phi);
+	a.m[0][0] = st * cp;
+	a.m[1][0] = st * sp;
+	a.m[2][0] = ct;
+	a.m[0][1] = ct * cp;
+	a.m[1][1] = ct * sp;
+	a.m[2][1] = -st;
+	a.m[0][2] = -sp;
+	a.m[1][2] = cp;
+	a.m[2][2] = 0.0;
+	return a;
+}
+
+void emfieldDipoleReference( DVec3 pos, double omega, double beta, double t, int unitAmplitude, DVec3 &eRe, DVec3 &eIm ) {
+	DVec3 hRe, hIm;
+	emfieldDipoleReference( pos, omega, beta, t, unitAmplitude, eRe, eIm, hRe, hIm );
+}
+
+void emfieldDipoleReference( DVec3 pos, double omega, double beta, double t, int unitAmplitude, DVec3 &eRe, DVec3 &eIm, DVec3 &hRe, DVec3 &hIm ) {
+	DVec3 sphe0 = rectToSpherePos( pos );
+	if( sphe0.r == 0.0 ) {
+		// On the dipole itself. An odd grid resolution puts a sample here.
+		eRe = eIm = hRe = hIm = DVec3( 0.0, 0.0, 0.0 );
+		return;
+	}
+
+	double ot = omega * t - beta * sphe0.r;
+	double eField_rReal_inside = (2.0 * omega) / (beta * sphe0.r * sphe0.r) * cos(sphe0.t);
+	double eField_rImag_inside = -(2.0 * omega) / (beta*beta * sphe0.r * sphe0.r * sphe0.r) * cos(sphe0.t);
+	double eField_tReal_inside = omega / (beta * sphe0.r * sphe0.r) * sin(sphe0.t);
+	double eField_tImag_inside = ( -omega / (beta*beta * sphe0.r * sphe0.r * sphe0.r) + omega / sphe0.r ) * sin(sphe0.t);
+	double eField_pReal_inside = 0.0;
+	double eField_pImag_inside = 0.0;
+	double hField_pReal_inside = omega / (beta * sphe0.r * sphe0.r) * sin(sphe0.t);
+	double hField_pImag_inside = omega / sphe0.r * sin(sphe0.t);
+
+	if( unitAmplitude ) {
+		eField_rReal_inside = 0.0;
+		eField_rImag_inside = 0.0;
+		eField_tReal_inside = 1.0;
+		eField_tImag_inside = 0.0;
+		hField_pReal_inside = 1.0;
+		hField_pImag_inside = 0.0;
+	}
+
+	double eField_rReal = eField_rReal_inside * cos(ot) - eField_rImag_inside * sin(ot);
+	double eField_rImag = eField_rImag_inside * cos(ot) + eField_rReal_inside * sin(ot);
+	double eField_tReal = eField_tReal_inside * cos(ot) - eField_tImag_inside * sin(ot);
+	double eField_tImag = eField_tImag_inside * cos(ot) + eField_tReal_inside * sin(ot);
+	double eField_pReal = eField_pReal_inside * cos(ot) - eField_pImag_inside * sin(ot);
+	double eField_pImag = eField_pImag_inside * cos(ot) + eField_pReal_inside * sin(ot);
+	double hField_pReal = hField_pReal_inside * cos(ot) - hField_pImag_inside * sin(ot);
+	double hField_pImag = hField_pImag_inside * cos(ot) + hField_pReal_inside * sin(ot);
+
+	DMat3 uv = rectToSphereUnitVectors( sphe0.t, sphe0.p );
+	eRe = uv.mul( DVec3( eField_rReal, eField_tReal, eField_pReal ) );
+	eIm = uv.mul( DVec3( eField_rImag, eField_tImag, eField_pImag ) );
+	hRe = uv.mul( DVec3( 0.0, 0.0, hField_pReal ) );
+	hIm = uv.mul( DVec3( 0.0, 0.0, hField_pImag ) );
+}
+
+// Kernel dispatch
+//------------------------------------------------------------------------------------------
+
+void emfieldDipoleAVX2( int count, const double *px, const double *py, const double *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, double *out[12] );
+void emfieldDipoleAVX512( int count, const double *px, const double *py, const double *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, double *out[12] );
+void emfieldDipoleAVX2F( int count, const float *px, const float *py, const float *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, float *out[12] );
+void emfieldDipoleAVX512F( int count, const float *px, const float *py, const float *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, float *out[12] );
+
+static void emfieldDipoleScalar( int count, const double *px, const double *py, const double *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, double *out[12] ) {
+	emfieldDipoleBlock<EMLaneScalar>( count, px, py, pz, omega, beta, phase, unitAmplitude, magnetic, out );
+}
+
+static void emfieldDipoleScalarF( int count, const float *px, const float *py, const float *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, float *out[12] ) {
+	emfieldDipoleBlock<EMLaneScalarF>( count, px, py, pz, omega, beta, phase, unitAmplitude, magnetic, out );
+}
+
+typedef void (*EMFieldDipoleFunc)( int count, const double *px, const double *py, const double *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, double *out[12] );
+typedef void (*EMFieldDipoleFuncF)( int count, const float *px, const float *py, const float *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, float *out[12] );
+
+static EMFieldDipoleFunc emfieldDipoleFuncs[EMFIELD_ISA_COUNT] = {
+	emfieldDipoleScalar,
+	emfieldDipoleAVX2,
+	emfieldDipoleAVX512,
+};
+
+static EMFieldDipoleFuncF emfieldDipoleFuncsF[EMFIELD_ISA_COUNT] = {
+	emfieldDipoleScalarF,
+	emfieldDipoleAVX2F,
+	emfieldDipoleAVX512F,
+};
+
+void emfieldSourcesAVX2( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, double *out[12] );
+void emfieldSourcesAVX512( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, double *out[12] );
+void emfieldSourcesAVX2F( int count, const float *px, const float *py, const float *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, float *out[12] );
+void emfieldSourcesAVX512F( int count, const float *px, const float *py, const float *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, float *out[12] );
+
+static void emfieldSourcesScalar( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, double *out[12] ) {
+	emfieldSourcesBlock<EMLaneScalar>( count, px, py, pz, numSources, src, omega, beta, phase, magnetic, out );
+}
+
+static void emfieldSourcesScalarF( int count, const float *px, const float *py, const float *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, float *out[12] ) {
+	emfieldSourcesBlock<EMLaneScalarF>( count, px, py, pz, numSources, src, omega, beta, phase, magnetic, out );
+}
+
+typedef void (*EMFieldSourcesFunc)( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, double *out[12] );
+typedef void (*EMFieldSourcesFuncF)( int count, const float *px, const float *py, const float *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, float *out[12] );
+
+static EMFieldSourcesFunc emfieldSourcesFuncs[EMFIELD_ISA_COUNT] = {
+	emfieldSourcesScalar,
+	emfieldSourcesAVX2,
+	emfieldSourcesAVX512,
+};
+
+static EMFieldSourcesFuncF emfieldSourcesFuncsF[EMFIELD_ISA_COUNT] = {
+	emfieldSourcesScalarF,
+	emfieldSourcesAVX2F,
+	emfieldSourcesAVX512F,
+};
+
+void emfieldMultipoleAVX2( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] );
+void emfieldMultipoleAVX512( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] );
+
+static void emfieldMultipoleScalar( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] ) {
+	emfieldMultipoleBlock<EMLaneScalar>( count, px, py, pz, cx, cy, cz, k, order, invH, coef, ab, magnetic, out );
+}
+
+typedef void (*EMFieldMultipoleFunc)( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] );
+
+static EMFieldMultipoleFunc emfieldMultipoleFuncs[EMFIELD_ISA_COUNT] = {
+	emfieldMultipoleScalar,
+	emfieldMultipoleAVX2,
+	emfieldMultipoleAVX512,
+};
+
+void emfieldDerivedAVX2( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] );
+void emfieldDerivedAVX512( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] );
+void emfieldDerivedAVX2F( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] );
+void emfieldDerivedAVX512F( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] );
+
+static void emfieldDerivedScalar( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] ) {
+	emfieldDerivedBlock<EMLaneScalar>( count, src, dst, c, sn, halfEps, inst, avg, out );
+}
+
+static void emfieldDerivedScalarF( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] ) {
+	emfieldDerivedBlock<EMLaneScalarF>( count, src, dst, c, sn, halfEps, inst, avg, out );
+}
+
+typedef void (*EMFieldDerivedFunc)( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] );
+typedef void (*EMFieldDerivedFuncF)( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] );
+
+static EMFieldDerivedFunc emfieldDerivedFuncs[EMFIELD_ISA_COUNT] = {
+	emfieldDerivedScalar,
+	emfieldDerivedAVX2,
+	emfieldDerivedAVX512,
+};
+
+static EMFieldDerivedFuncF emfieldDerivedFuncsF[EMFIELD_ISA_COUNT] = {
+	emfieldDerivedScalarF,
+	emfieldDerivedAVX2F,
+	emfieldDerivedAVX512F,
+};
+
+void emfieldCoulombAVX2( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] );
+void emfieldCoulombAVX512( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] );
+
+static void emfieldCoulombScalar( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] ) {
+	emfieldCoulombBlock<EMLaneScalarF,1>( count, px, py, pz, numCharges, chg, out );
+}
+
+typedef void (*EMFieldCoulombFunc)( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] );
+
+static EMFieldCoulombFunc emfieldCoulombFuncs[EMFIELD_ISA_COUNT] = {
+	emfieldCoulombScalar,
+	emfieldCoulombAVX2,
+	emfieldCoulombAVX512,
+};
+
+static int emfieldIsa = -1;
+
+int emfieldIsaDetect() {
+	int isa = EMFIELD_ISA_SCALAR;
+	#if defined(EMFIELD_X86) && defined(_MSC_VER)
+		int info[4];
+		__cpuid( info, 0 );
+		int maxLeaf = info[0];
+		__cpuid( info, 1 );
+		int osxsave = ( info[2] >> 27 ) & 1;
+		int fma = ( info[2] >> 12 ) & 1;
+		if( maxLeaf >= 7 && osxsave ) {
+			unsigned __int64 xcr0 = _xgetbv( 0 );
+			__cpuidex( info, 7, 0 );
+			int avx2 = ( info[1] >> 5 ) & 1;
+			int avx512f = ( info[1] >> 16 ) & 1;
+			if( avx2 && fma && (xcr0 & 0x06) == 0x06 ) {
+				isa = EMFIELD_ISA_AVX2;
+			}
+			if( avx512f && (xcr0 & 0xe6) == 0xe6 ) {
+				isa = EMFIELD_ISA_AVX512;
+			}
+		}
+	#elif defined(EMFIELD_X86) && defined(__GNUC__)
+		__builtin_cpu_init();
+		if( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) ) {
+			isa = EMFIELD_ISA_AVX2;
+		}
+		if( __builtin_cpu_supports( "avx512f" ) ) {
+			isa = EMFIELD_ISA_AVX512;
+		}
+	#endif
+	#ifdef EMFIELD_NO_AVX512
+		if( isa > EMFIELD_ISA_AVX2 ) {
+			isa = EMFIELD_ISA_AVX2;
+		}
+	#endif
+	return isa;
+}
+
+int emfieldIsaSet( int isa ) {
+	int best = emfieldIsaDetect();
+	emfieldIsa = isa < 0 ? 0 : ( isa > best ? best : isa );
+	return emfieldIsa;
+}
+
+int emfieldIsaGet() {
+	if( emfieldIsa < 0 ) {
+		emfieldIsa = emfieldIsaDetect();
+	}
+	return emfieldIsa;
+}
+
+const char *emfieldIsaName( int isa ) {
+	switch( isa ) {
+		case EMFIELD_ISA_SCALAR: return "scalar";
+		case EMFIELD_ISA_AVX2: return "avx2";
+		case EMFIELD_ISA_AVX512: return "avx512";
+	}
+	return "unknown";
+}
+
+void emfieldDipoleKernel( int count, const double *px, const double *py, const double *pz, double omega, double beta, double t, int unitAmplitude, int magnetic, double *out[12] ) {
+	(*emfieldDipoleFuncs[emfieldIsaGet()])( count, px, py, pz, omega, beta, omega * t, unitAmplitude, magnetic, out );
+}
+
+void emfieldDipoleKernel( int count, const float *px, const float *py, const float *pz, double omega, double beta, double t, int unitAmplitude, int magnetic, float *out[12] ) {
+	// omega*t grows without bound and a float keeps only ~7 digits of it,
+	// so whole turns are taken off in double before the kernel sees it
+	double phase = fmod( omega * t, 6.28318530717958647693 );
+	(*emfieldDipoleFuncsF[emfieldIsaGet()])( count, px, py, pz, omega, beta, phase, unitAmplitude, magnetic, out );
+}
+
+void emfieldSourcesKernel( int count, const double *px, const double *py, const double *pz, EMFieldSources &sources, double omega, double beta, double t, int magnetic, double *out[12] ) {
+	const double *src[8] = { sources.x, sources.y, sources.z, sources.nx, sources.ny, sources.nz, sources.aRe, sources.aIm };
+	emfieldSourcesKernel( count, px, py, pz, sources.count, src, omega, beta, t, magnetic, out );
+}
+
+void emfieldSourcesKernel( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double t, int magnetic, double *out[12] ) {
+	(*emfieldSourcesFuncs[emfieldIsaGet()])( count, px, py, pz, numSources, src, omega, beta, omega * t, magnetic, out );
+}
+
+void emfieldMultipoleKernel( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] ) {
+	(*emfieldMultipoleFuncs[emfieldIsaGet()])( count, px, py, pz, cx, cy, cz, k, order, invH, coef, ab, magnetic, out );
+}
+
+void emfieldSourcesKernel( int count, const float *px, const float *py, const float *pz, EMFieldSources &sources, double omega, double beta, double t, int magnetic, float *out[12] ) {
+	const double *src[8] = { sources.x, sources.y, sources.z, sources.nx, sources.ny, sources.nz, sources.aRe, sources.aIm };
+	double phase = fmod( omega * t, 6.28318530717958647693 );
+	(*emfieldSourcesFuncsF[emfieldIsaGet()])( count, px, py, pz, sources.count, src, omega, beta, phase, magnetic, out );
+}
+
+void emfieldDerivedKernel( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] ) {
+	(*emfieldDerivedFuncs[emfieldIsaGet()])( count, src, dst, c, sn, halfEps, inst, avg, out );
+}
+
+void emfieldDerivedKernel( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] ) {
+	(*emfieldDerivedFuncsF[emfieldIsaGet()])( count, src, dst, c, sn, halfEps, inst, avg, out );
+}
+
+void emfieldCoulombKernel( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] ) {
+	(*emfieldCoulombFuncs[emfieldIsaGet()])( count, px, py, pz, numCharges, chg, out );
+}
+
+// EMFieldSources
+//------------------------------------------------------------------------------------------
+
+EMFieldSources::EMFieldSources() {
+	count = 0;
+	alloced = 0;
+	version = 0;
+	x = y = z = 0;
+	nx = ny = nz = 0;
+	aRe = aIm = 0;
+}
+
+EMFieldSources::~EMFieldSources() {
+	clear();
+}
+
+void EMFieldSources::clear() {
+	if( x ) {
+		free( x );
+	}
+	count = 0;
+	alloced = 0;
+	version++;
+	x = y = z = 0;
+	nx = ny = nz = 0;
+	aRe = aIm = 0;
+}
+
+int EMFieldSources::add( DVec3 pos, DVec3 axis, double amplitude, double phase ) {
+	if( count == alloced ) {
+		// All eight streams share one block, grown by doubling
+		int newAlloced = alloced ? alloced * 2 : 64;
+		double *block = (double *)malloc( sizeof(double) * 8 * (size_t)newAlloced );
+		if( !block ) {
+			return -1;
+		}
+		double *old[8] = { x, y, z, nx, ny, nz, aRe, aIm };
+		double **dst[8] = { &x, &y, &z, &nx, &ny, &nz, &aRe, &aIm };
+		for( int k=0; k<8; k++ ) {
+			if( count ) {
+				memcpy( &block[k*newAlloced], old[k], sizeof(double) * count );
+			}
+			*dst[k] = &block[k*newAlloced];
+		}
+		if( old[0] ) {
+			free( old[0] );
+		}
+		alloced = newAlloced;
+	}
+	count++;
+	set( count-1, pos, axis, amplitude, phase );
+	return count-1;
+}
+
+void EMFieldSources::set( int i, DVec3 pos, DVec3 axis, double amplitude, double phase ) {
+	axis.normalize();
+	x[i] = pos.x;
+	y[i] = pos.y;
+	z[i] = pos.z;
+	nx[i] = axis.x;
+	ny[i] = axis.y;
+	nz[i] = axis.z;
+	aRe[i] = amplitude * cos( phase );
+	aIm[i] = amplitude * sin( phase );
+	version++;
+}
+
+static DVec3 emfieldFromLocal( DVec3 u, DVec3 v, DVec3 n, DVec3 l ) {
+	return DVec3( u.x*l.x + v.x*l.y + n.x*l.z, u.y*l.x + v.y*l.y + n.y*l.z, u.z*l.x + v.z*l.y + n.z*l.z );
+}
+
+void emfieldSourcesReference( DVec3 pos, EMFieldSources &sources, double omega, double beta, double t, DVec3 &eRe, DVec3 &eIm ) {
+	DVec3 hRe, hIm;
+	emfieldSourcesReference( pos, sources, omega, beta, t, eRe, eIm, hRe, hIm );
+}
+
+void emfieldSourcesReference( DVec3 pos, EMFieldSources &sources, double omega, double beta, double t, DVec3 &eRe, DVec3 &eIm, DVec3 &hRe, DVec3 &hIm ) {
+	eRe.origin();
+	eIm.origin();
+	hRe.origin();
+	hIm.origin();
+	for( int j=0; j<sources.count; j++ ) {
+		// Local frame (u, v, n) around the dipole axis
+		DVec3 n( sources.nx[j], sources.ny[j], sources.nz[j] );
+		DVec3 u = fabs( n.x ) < 0.9 ? DVec3::XAxis : DVec3::YAxis;
+		u.cross( n );
+		u.normalize();
+		DVec3 v = n;
+		v.cross( u );
+
+		DVec3 d = pos;
+		d.sub( DVec3( sources.x[j], sources.y[j], sources.z[j] ) );
+		DVec3 local( d.dot( u ), d.dot( v ), d.dot( n ) );
+		double r = local.mag();
+		double theta = acos( local.z / r );
+		double phi = atan2( local.y, local.x );
+
+		double ot = omega * t - beta * r + atan2( sources.aIm[j], sources.aRe[j] );
+		double amp = sqrt( sources.aRe[j]*sources.aRe[j] + sources.aIm[j]*sources.aIm[j] );
+		double erRe = 2.0 * omega / (beta * r * r) * cos( theta );
+		double erIm = -2.0 * omega / (beta * beta * r * r * r) * cos( theta );
+		double etRe = omega / (beta * r * r) * sin( theta );
+		double etIm = ( omega / r - omega / (beta * beta * r * r * r) ) * sin( theta );
+		double rReal = amp * ( erRe * cos( ot ) - erIm * sin( ot ) );
+		double rImag = amp * ( erIm * cos( ot ) + erRe * sin( ot ) );
+		double tReal = amp * ( etRe * cos( ot ) - etIm * sin( ot ) );
+		double tImag = amp * ( etIm * cos( ot ) + etRe * sin( ot ) );
+		double hpRe = omega / (beta * r * r) * sin( theta );
+		double hpIm = omega / r * sin( theta );
+		double pReal = amp * ( hpRe * cos( ot ) - hpIm * sin( ot ) );
+		double pImag = amp * ( hpIm * cos( ot ) + hpRe * sin( ot ) );
+
+		// Standard spherical unit vectors in the local frame
+		DVec3 rHat( sin( theta ) * cos( phi ), sin( theta ) * sin( phi ), cos( theta ) );
+		DVec3 tHat( cos( theta ) * cos( phi ), cos( theta ) * sin( phi ), -sin( theta ) );
+		DVec3 lRe( rReal*rHat.x + tReal*tHat.x, rReal*rHat.y + tReal*tHat.y, rReal*rHat.z + tReal*tHat.z );
+		DVec3 lIm( rImag*rHat.x + tImag*tHat.x, rImag*rHat.y + tImag*tHat.y, rImag*rHat.z + tImag*tHat.z );
+		eRe.add( emfieldFromLocal( u, v, n, lRe ) );
+		eIm.add( emfieldFromLocal( u, v, n, lIm ) );
+
+		DVec3 pHat( -sin( phi ), cos( phi ), 0.0 );
+		hRe.add( emfieldFromLocal( u, v, n, DVec3( pReal*pHat.x, pReal*pHat.y, 0.0 ) ) );
+		hIm.add( emfieldFromLocal( u, v, n, DVec3( pImag*pHat.x, pImag*pHat.y, 0.0 ) ) );
+	}
+}
+
+// EMFieldGrid
+//------------------------------------------------------------------------------------------
+
+double EMFieldGrid::coord( int axis, int i ) {
+	double l = ((double *)lo)[axis];
+	double h = ((double *)hi)[axis];
+	if( n[axis] < 2 ) {
+		return l;
+	}
+	return l + (h - l) * (double)i / (double)(n[axis]-1);
+}
+
+int EMFieldGrid::equals( EMFieldGrid &o ) {
+	return lo.equals( o.lo ) && hi.equals( o.hi ) && n[0]==o.n[0] && n[1]==o.n[1] && n[2]==o.n[2];
+}
+
+// EMFieldSampler
+//------------------------------------------------------------------------------------------
+
+template< class T >
+EMFieldSamplerT<T>::EMFieldSamplerT() {
+	omega = 1.0;
+	beta = 2.0;
+	unitAmplitude = 0;
+	pool = 0;
+	sources = 0;
+	multipole = 0;
+	magnetic = 0;
+	derived = 0;
+	count = 0;
+	alloced = 0;
+	allocedMagnetic = 0;
+	allocedDerived = 0;
+	block = 0;
+	cacheValid = 0;
+	cacheOmega = 0.0;
+	cacheBeta = 0.0;
+	cacheUnitAmplitude = 0;
+	cacheMagnetic = 0;
+	cacheDerived = 0;
+	cacheSources = 0;
+	cacheSourcesVersion = 0;
+	cacheMultipole = 0;
+	cacheMultipoleVersion = 0;
+	stepValid = 0;
+	stepMagnetic = 0;
+	stepDerived = 0;
+	stepTime = 0.0;
+	stepCount = 0;
+	resyncSteps = 256;
+	rotorDt = 0.0;
+	rotorC = 1.0;
+	rotorS = 0.0;
+	px = py = pz = 0;
+	eReX = eReY = eReZ = 0;
+	eImX = eImY = eImZ = 0;
+	aReX = aReY = aReZ = 0;
+	aImX = aImY = aImZ = 0;
+	hReX = hReY = hReZ = 0;
+	hImX = hImY = hImZ = 0;
+	bReX = bReY = bReZ = 0;
+	bImX = bImY = bImZ = 0;
+	sX = sY = sZ = u = 0;
+	sAvgX = sAvgY = sAvgZ = uAvg = 0;
+}
+
+template< class T >
+EMFieldSamplerT<T>::~EMFieldSamplerT() {
+	clear();
+}
+
+template< class T >
+void EMFieldSamplerT<T>::clear() {
+	if( block ) {
+		free( block );
+	}
+	block = 0;
+	grid = EMFieldGrid();
+	count = 0;
+	alloced = 0;
+	allocedMagnetic = 0;
+	allocedDerived = 0;
+	cacheValid = 0;
+	stepValid = 0;
+	px = py = pz = 0;
+	eReX = eReY = eReZ = 0;
+	eImX = eImY = eImZ = 0;
+	aReX = aReY = aReZ = 0;
+	aImX = aImY = aImZ = 0;
+	hReX = hReY = hReZ = 0;
+	hImX = hImY = hImZ = 0;
+	bReX = bReY = bReZ = 0;
+	bImX = bImY = bImZ = 0;
+	sX = sY = sZ = u = 0;
+	sAvgX = sAvgY = sAvgZ = uAvg = 0;
+}
+
+template< class T >
+void EMFieldSamplerT<T>::setGrid( EMFieldGrid &g ) {
+	grid = g;
+	count = grid.count();
+	cacheValid = 0;
+	stepValid = 0;
+	stepMagnetic = 0;
+	stepDerived = 0;
+
+	int wantH = needsH();
+	if( count > alloced || ( wantH && !allocedMagnetic ) || ( derived && !allocedDerived ) ) {
+		if( block ) {
+			free( block );
+		}
+		// Every stream starts on a 64 byte boundary so SIMD loads never split
+		// a cache line and no two bricks of different streams share one.
+		// 256^3 points is ~2GB in double so the size is computed in size_t.
+		int streams = 15 + ( wantH ? 12 : 0 ) + ( derived ? 8 : 0 );
+		alloced = ( count + 15 ) & ~15;
+		allocedMagnetic = wantH;
+		allocedDerived = derived;
+		block = malloc( sizeof(T) * streams * ( (size_t)alloced + 16 ) + 64 );
+		if( !block ) {
+			clear();
+			return;
+		}
+	}
+
+	// Streams are a cache line or two further apart than they need to be.
+	// Grids like 64^3 would otherwise put every stream a power of two
+	// apart, and the fused loops that touch ~30 of them at the same index
+	// would all land in one cache set.
+	size_t pitch = (size_t)alloced + 16;
+	T *d = (T *)( ( (size_t)block + 63 ) & ~(size_t)63 );
+	px = d; d += pitch;
+	py = d; d += pitch;
+	pz = d; d += pitch;
+	eReX = d; d += pitch;
+	eReY = d; d += pitch;
+	eReZ = d; d += pitch;
+	eImX = d; d += pitch;
+	eImY = d; d += pitch;
+	eImZ = d; d += pitch;
+	aReX = d; d += pitch;
+	aReY = d; d += pitch;
+	aReZ = d; d += pitch;
+	aImX = d; d += pitch;
+	aImY = d; d += pitch;
+	aImZ = d; d += pitch;
+	hReX = hReY = hReZ = 0;
+	hImX = hImY = hImZ = 0;
+	bReX = bReY = bReZ = 0;
+	bImX = bImY = bImZ = 0;
+	if( allocedMagnetic ) {
+		hReX = d; d += pitch;
+		hReY = d; d += pitch;
+		hReZ = d; d += pitch;
+		hImX = d; d += pitch;
+		hImY = d; d += pitch;
+		hImZ = d; d += pitch;
+		bReX = d; d += pitch;
+		bReY = d; d += pitch;
+		bReZ = d; d += pitch;
+		bImX = d; d += pitch;
+		bImY = d; d += pitch;
+		bImZ = d; d += pitch;
+	}
+	sX = sY = sZ = u = 0;
+	sAvgX = sAvgY = sAvgZ = uAvg = 0;
+	if( allocedDerived ) {
+		sX = d; d += pitch;
+		sY = d; d += pitch;
+		sZ = d; d += pitch;
+		u = d; d += pitch;
+		sAvgX = d; d += pitch;
+		sAvgY = d; d += pitch;
+		sAvgZ = d; d += pitch;
+		uAvg = d; d += pitch;
+	}
+
+	for( int xi=0; xi<grid.n[0]; xi++ ) {
+		double x = grid.coord( 0, xi );
+		for( int yi=0; yi<grid.n[1]; yi++ ) {
+			double y = grid.coord( 1, yi );
+			for( int zi=0; zi<grid.n[2]; zi++ ) {
+				int i = grid.index( xi, yi, zi );
+				px[i] = (T)x;
+				py[i] = (T)y;
+				pz[i] = (T)grid.coord( 2, zi );
+			}
+		}
+	}
+}
+
+// Brick jobs
+//------------------------------------------------------------------------------------------
+
+enum {
+	EMFIELD_JOB_CACHE,
+	EMFIELD_JOB_ROTATE,
+	EMFIELD_JOB_DIRECT,
+	EMFIELD_JOB_STEP,
+};
+
+template< class T >
+struct EMFieldJob {
+	EMFieldSamplerT<T> *s;
+	int kind;
+	double t;
+	double c, sn;
+	int magnetic;
+	int derived;
+		// Set by emfieldRunJob() from the sampler
+
+	EMFieldJob( EMFieldSamplerT<T> *_s, int _kind, double _t, double _c, double _sn ) { s = _s; kind = _kind; t = _t; c = _c; sn = _sn; magnetic = 0; derived = 0; }
+};
+
+template< class T >
+static void emfieldEvalBrick( EMFieldSamplerT<T> *s, int lo, int n, double t, int magnetic, T *out[12] ) {
+	if( s->sources && s->multipole ) {
+		s->multipole->evaluate( n, &s->px[lo], &s->py[lo], &s->pz[lo], t, magnetic, out );
+	}
+	else if( s->sources ) {
+		emfieldSourcesKernel( n, &s->px[lo], &s->py[lo], &s->pz[lo], *s->sources, s->omega, s->beta, t, magnetic, out );
+	}
+	else {
+		emfieldDipoleKernel( n, &s->px[lo], &s->py[lo], &s->pz[lo], s->omega, s->beta, t, s->unitAmplitude, magnetic, out );
+	}
+}
+
+template< class T >
+static void emfieldRotate( T *dst[6], T *src[6], int lo, int hi, T c, T sn ) {
+	// Re/Im( src * e^(i omega t) ): one rotation shared by every point
+	for( int k=0; k<3; k++ ) {
+		T *re = dst[k];
+		T *im = dst[k+3];
+		T *aRe = src[k];
+		T *aIm = src[k+3];
+		for( int i=lo; i<hi; i++ ) {
+			re[i] = aRe[i] * c - aIm[i] * sn;
+			im[i] = aIm[i] * c + aRe[i] * sn;
+		}
+	}
+}
+
+template< class T >
+static void emfieldStep( T *e[6], int lo, int hi, double c, double sn ) {
+	// e *= e^(i omega dt) in place. Half the streams of a rotate.
+	// The multiply stays in double even for float streams: a float
+	// rotor would be off by the same angle every step and the phase
+	// error would grow linearly instead of as a random walk.
+	for( int k=0; k<3; k++ ) {
+		T *re = e[k];
+		T *im = e[k+3];
+		for( int i=lo; i<hi; i++ ) {
+			double r = re[i];
+			double m = im[i];
+			re[i] = (T)( r * c - m * sn );
+			im[i] = (T)( m * c + r * sn );
+		}
+	}
+}
+
+template< class T >
+static void emfieldBrick( void *user, int brick ) {
+	EMFieldJob<T> *job = (EMFieldJob<T> *)user;
+	EMFieldSamplerT<T> *s = job->s;
+	int lo = brick * EMFIELD_BRICK_POINTS;
+	int hi = lo + EMFIELD_BRICK_POINTS;
+	if( hi > s->count ) {
+		hi = s->count;
+	}
+	int n = hi - lo;
+
+	// E then H, as the kernels lay them out
+	T *e[12] = { s->eReX, s->eReY, s->eReZ, s->eImX, s->eImY, s->eImZ, s->hReX, s->hReY, s->hReZ, s->hImX, s->hImY, s->hImZ };
+	T *a[12] = { s->aReX, s->aReY, s->aReZ, s->aImX, s->aImY, s->aImZ, s->bReX, s->bReY, s->bReZ, s->bImX, s->bImY, s->bImZ };
+	int channels = job->magnetic ? 12 : 6;
+
+	// S and u then their averages, offset to the brick like the field streams
+	T *d[8] = { s->sX, s->sY, s->sZ, s->u, s->sAvgX, s->sAvgY, s->sAvgZ, s->uAvg };
+	T *ea[12], *aa[12];
+	if( job->derived ) {
+		for( int k=0; k<12; k++ ) {
+			ea[k] = &e[k][lo];
+			aa[k] = &a[k][lo];
+		}
+		for( int k=0; k<8; k++ ) {
+			d[k] = &d[k][lo];
+		}
+	}
+	double halfEps = 0.5 * s->beta / s->omega;
+
+	switch( job->kind ) {
+		case EMFIELD_JOB_CACHE: {
+			T *out[12];
+			for( int k=0; k<channels; k++ ) {
+				out[k] = &a[k][lo];
+			}
+			emfieldEvalBrick( s, lo, n, 0.0, job->magnetic, out );
+			if( job->derived ) {
+				// The brick is still in cache from the kernel writing it
+				emfieldDerivedKernel( n, aa, 0, 1.0, 0.0, halfEps, 0, 1, d );
+			}
+			break;
+		}
+		case EMFIELD_JOB_DIRECT: {
+			T *out[12];
+			for( int k=0; k<channels; k++ ) {
+				out[k] = &e[k][lo];
+			}
+			emfieldEvalBrick( s, lo, n, job->t, job->magnetic, out );
+			if( job->derived ) {
+				emfieldDerivedKernel( n, ea, 0, 1.0, 0.0, halfEps, 1, 1, d );
+			}
+			break;
+		}
+		case EMFIELD_JOB_ROTATE: {
+			if( job->derived ) {
+				// One pass that rotates E and H and forms S and u from them
+				emfieldDerivedKernel( n, aa, ea, job->c, job->sn, halfEps, 1, 0, d );
+				break;
+			}
+			for( int k=0; k<channels; k+=6 ) {
+				emfieldRotate( &e[k], &a[k], lo, hi, (T)job->c, (T)job->sn );
+			}
+			break;
+		}
+		case EMFIELD_JOB_STEP: {
+			// The step multiplies in double, which the lanes can not mix
+			// with float, so S and u follow while the brick is still in cache
+			for( int k=0; k<channels; k+=6 ) {
+				emfieldStep( &e[k], lo, hi, job->c, job->sn );
+			}
+			if( job->derived ) {
+				emfieldDerivedKernel( n, ea, 0, 1.0, 0.0, halfEps, 1, 0, d );
+			}
+			break;
+		}
+	}
+}
+
+template< class T >
+static void emfieldRunJob( EMFieldSamplerT<T> *s, EMFieldJob<T> &job ) {
+	// Resolve the kernel before any worker can race on the lazy detect
+	emfieldIsaGet();
+	job.magnetic = s->needsH() && s->allocedMagnetic;
+	job.derived = s->derived && s->allocedDerived;
+
+	// Likewise the cluster expansions are built once up front, not per brick
+	if( ( job.kind == EMFIELD_JOB_CACHE || job.kind == EMFIELD_JOB_DIRECT ) && s->sources && s->multipole ) {
+		if( s->multipole->stale( *s->sources, s->omega, s->beta, job.magnetic ) ) {
+			s->multipole->build( *s->sources, s->omega, s->beta, job.magnetic );
+		}
+	}
+
+	int bricks = s->brickCount();
+	if( s->pool ) {
+		s->pool->run( bricks, emfieldBrick<T>, &job );
+	}
+	else {
+		for( int b=0; b<bricks; b++ ) {
+			emfieldBrick<T>( &job, b );
+		}
+	}
+}
+
+template< class T >
+void EMFieldSamplerT<T>::buildPhasorCache() {
+	// The phase of every point is omega*t - beta*r. Evaluating at t=0 leaves
+	// only the static -beta*r part, which is exactly the phasor A we want.
+	if( ( needsH() && !allocedMagnetic ) || ( derived && !allocedDerived ) ) {
+		setGrid( grid );
+	}
+	EMFieldJob<T> job( this, EMFIELD_JOB_CACHE, 0.0, 1.0, 0.0 );
+	emfieldRunJob( this, job );
+	cacheOmega = omega;
+	cacheBeta = beta;
+	cacheUnitAmplitude = unitAmplitude;
+	cacheMagnetic = job.magnetic;
+	cacheDerived = job.derived;
+	cacheSources = sources;
+	cacheSourcesVersion = sources ? sources->version : 0;
+	cacheMultipole = sources ? multipole : 0;
+	cacheMultipoleVersion = cacheMultipole ? multipole->version : 0;
+	cacheValid = 1;
+}
+
+template< class T >
+int EMFieldSamplerT<T>::cacheStale() {
+	if( !cacheValid || cacheOmega != omega || cacheBeta != beta || cacheSources != sources ) {
+		return 1;
+	}
+	if( ( needsH() && !cacheMagnetic ) || ( derived && !cacheDerived ) ) {
+		return 1;
+	}
+	if( sources && multipole ) {
+		if( cacheMultipole != multipole || cacheMultipoleVersion != multipole->version || multipole->stale( *sources, omega, beta, needsH() ) ) {
+			return 1;
+		}
+	}
+	else if( cacheMultipole ) {
+		return 1;
+	}
+	if( sources ) {
+		return cacheSourcesVersion != sources->version;
+	}
+	return cacheUnitAmplitude != unitAmplitude;
+}
+
+template< class T >
+void EMFieldSamplerT<T>::sample( double t ) {
+	if( cacheStale() ) {
+		buildPhasorCache();
+	}
+
+	EMFieldJob<T> job( this, EMFIELD_JOB_ROTATE, t, cos( omega * t ), sin( omega * t ) );
+	emfieldRunJob( this, job );
+	stepValid = 1;
+	stepMagnetic = job.magnetic;
+	stepDerived = job.derived;
+	stepTime = t;
+	stepCount = 0;
+}
+
+template< class T >
+void EMFieldSamplerT<T>::step( double dt ) {
+	double t = stepTime + dt;
+	if( !stepValid || cacheStale() || ( needsH() && !stepMagnetic ) || ( derived && !stepDerived ) ) {
+		sample( t );
+		return;
+	}
+	if( resyncSteps > 0 && stepCount + 1 >= resyncSteps ) {
+		// Every in-place multiply adds an ulp or so of magnitude and phase
+		// error. Rotating the exact phasors again puts the drift back to zero.
+		sample( t );
+		return;
+	}
+
+	// A fixed timestep reuses the rotor so the steady state has no trig at all
+	if( dt != rotorDt ) {
+		rotorDt = dt;
+		rotorC = cos( omega * dt );
+		rotorS = sin( omega * dt );
+		double norm = 1.0 / sqrt( rotorC*rotorC + rotorS*rotorS );
+		rotorC *= norm;
+		rotorS *= norm;
+	}
+	EMFieldJob<T> job( this, EMFIELD_JOB_STEP, t, rotorC, rotorS );
+	emfieldRunJob( this, job );
+	stepTime = t;
+	stepCount++;
+}
+
+template< class T >
+void EMFieldSamplerT<T>::sampleDirect( double t ) {
+	if( ( needsH() && !allocedMagnetic ) || ( derived && !allocedDerived ) ) {
+		setGrid( grid );
+	}
+	EMFieldJob<T> job( this, EMFIELD_JOB_DIRECT, t, 1.0, 0.0 );
+	emfieldRunJob( this, job );
+	stepValid = 1;
+	stepMagnetic = job.magnetic;
+	stepDerived = job.derived;
+	stepTime = t;
+	stepCount = 0;
+}
+
+template< class T >
+void EMFieldSamplerT<T>::sampleReference( double t ) {
+	if( ( needsH() && !allocedMagnetic ) || ( derived && !allocedDerived ) ) {
+		setGrid( grid );
+	}
+	int withH = needsH() && allocedMagnetic;
+	int withDerived = derived && allocedDerived;
+	double halfEps = 0.5 * beta / omega;
+	for( int i=0; i<count; i++ ) {
+		DVec3 eRe, eIm, hRe, hIm;
+		if( sources ) {
+			emfieldSourcesReference( DVec3( px[i], py[i], pz[i] ), *sources, omega, beta, t, eRe, eIm, hRe, hIm );
+		}
+		else {
+			emfieldDipoleReference( DVec3( px[i], py[i], pz[i] ), omega, beta, t, unitAmplitude, eRe, eIm, hRe, hIm );
+		}
+		eReX[i] = (T)eRe.x;
+		eReY[i] = (T)eRe.y;
+		eReZ[i] = (T)eRe.z;
+		eImX[i] = (T)eIm.x;
+		eImY[i] = (T)eIm.y;
+		eImZ[i] = (T)eIm.z;
+		if( withH ) {
+			hReX[i] = (T)hRe.x;
+			hReY[i] = (T)hRe.y;
+			hReZ[i] = (T)hRe.z;
+			hImX[i] = (T)hIm.x;
+			hImY[i] = (T)hIm.y;
+			hImZ[i] = (T)hIm.z;
+		}
+		if( withDerived ) {
+			// Straight from the definitions, all in double
+			DVec3 s = eRe;
+			s.cross( hRe );
+			sX[i] = (T)s.x;
+			sY[i] = (T)s.y;
+			sZ[i] = (T)s.z;
+			u[i] = (T)( halfEps * ( eRe.mag2() + hRe.mag2() ) );
+			DVec3 sAvg = eRe;
+			sAvg.cross( hRe );
+			DVec3 sIm = eIm;
+			sIm.cross( hIm );
+			sAvg.add( sIm );
+			sAvg.mul( 0.5 );
+			sAvgX[i] = (T)sAvg.x;
+			sAvgY[i] = (T)sAvg.y;
+			sAvgZ[i] = (T)sAvg.z;
+			uAvg[i] = (T)( 0.5 * halfEps * ( eRe.mag2() + eIm.mag2() + hRe.mag2() + hIm.mag2() ) );
+		}
+	}
+	stepValid = 1;
+	stepMagnetic = withH;
+	stepDerived = withDerived;
+	stepTime = t;
+	stepCount = 0;
+}
+
+// The sampler is only ever used in these two precisions
+template struct EMFieldSamplerT<double>;
+template struct EMFieldSamplerT<float>;
+
+// EMFieldCharges
+//------------------------------------------------------------------------------------------
+
+EMFieldCharges::EMFieldCharges() {
+	count = 0;
+	alloced = 0;
+	version = 0;
+	x = y = z = q = 0;
+}
+
+EMFieldCharges::~EMFieldCharges() {
+	clear();
+}
+
+void EMFieldCharges::clear() {
+	if( x ) {
+		free( x );
+	}
+	count = 0;
+	alloced = 0;
+	version++;
+	x = y = z = q = 0;
+}
+
+int EMFieldCharges::add( DVec3 pos, double charge ) {
+	if( count == alloced ) {
+		// All four streams share one block, grown by doubling
+		int newAlloced = alloced ? alloced * 2 : 64;
+		float *block = (float *)malloc( sizeof(float) * 4 * (size_t)newAlloced );
+		if( !block ) {
+			return -1;
+		}
+		float *old[4] = { x, y, z, q };
+		float **dst[4] = { &x, &y, &z, &q };
+		for( int k=0; k<4; k++ ) {
+			if( count ) {
+				memcpy( &block[k*newAlloced], old[k], sizeof(float) * count );
+			}
+			*dst[k] = &block[k*newAlloced];
+		}
+		if( old[0] ) {
+			free( old[0] );
+		}
+		alloced = newAlloced;
+	}
+	count++;
+	set( count-1, pos, charge );
+	return count-1;
+}
+
+void EMFieldCharges::set( int i, DVec3 pos, double charge ) {
+	x[i] = (float)pos.x;
+	y[i] = (float)pos.y;
+	z[i] = (float)pos.z;
+	q[i] = (float)charge;
+	version++;
+}
+
+void emfieldCoulombReference( DVec3 pos, EMFieldCharges &charges, DVec3 &f ) {
+	f = DVec3( 0.0, 0.0, 0.0 );
+	for( int j=0; j<charges.count; j++ ) {
+		DVec3 d( pos.x - charges.x[j], pos.y - charges.y[j], pos.z - charges.z[j] );
+		double r = d.mag();
+		d.mul( charges.q[j] / ( r * r * r ) );
+		f.add( d );
+	}
+}
+
+struct EMFieldCoulombJob {
+	int count;
+	const float *px, *py, *pz;
+	int numCharges;
+	const float *chg[4];
+	float **out;
+};
+
+static void emfieldCoulombBrick( void *user, int brick ) {
+	EMFieldCoulombJob *job = (EMFieldCoulombJob *)user;
+	int lo = brick * EMFIELD_BRICK_POINTS;
+	int n = job->count - lo < EMFIELD_BRICK_POINTS ? job->count - lo : EMFIELD_BRICK_POINTS;
+	float *out[3] = { &job->out[0][lo], &job->out[1][lo], &job->out[2][lo] };
+	emfieldCoulombKernel( n, &job->px[lo], &job->py[lo], &job->pz[lo], job->numCharges, job->chg, out );
+}
+
+void emfieldCoulomb( EMWorkPool *pool, int count, const float *px, const float *py, const float *pz, EMFieldCharges &charges, float *out[3] ) {
+	emfieldIsaGet();
+	EMFieldCoulombJob job;
+	job.count = count;
+	job.px = px;
+	job.py = py;
+	job.pz = pz;
+	job.numCharges = charges.count;
+	job.chg[0] = charges.x;
+	job.chg[1] = charges.y;
+	job.chg[2] = charges.z;
+	job.chg[3] = charges.q;
+	job.out = out;
+
+	int bricks = ( count + EMFIELD_BRICK_POINTS - 1 ) / EMFIELD_BRICK_POINTS;
+	if( pool ) {
+		pool->run( bricks, emfieldCoulombBrick, &job );
+	}
+	else {
+		for( int b=0; b<bricks; b++ ) {
+			emfieldCoulombBrick( &job, b );
+		}
+	}
+}
@@ -0,0 +1,298 @@
+// @ZBS {
+//		*MODULE_OWNER_NAME emfield
+// }
+
+// Headless evaluation of the oscillating dipole E and H fields on a regular
+// grid, either the single dipole render() has always drawn or a
+// superposition of any number of dipoles.
+// Nothing in here touches OpenGL so that the physics can be timed and run
+// on machines without a display. The results are stored as structure of
+// arrays so that render() and batch tools can stream through them.
+
+#ifndef EMFIELD_H
+#define EMFIELD_H
+
+#include "zvec.h"
+
+struct EMWorkPool;
+struct EMFieldMultipole;
+
+// Coordinate helpers. Spherical vectors are stored as (r, theta, phi)
+// which DVec3 also names (x, t, p).
+DVec3 rectToSpherePos( DVec3 a );
+DVec3 sphereToRectPos( DVec3 a );
+DMat3 sphereToRectUnitVectors( double theta, double phi );
+DMat3 rectToSphereUnitVectors( double theta, double phi );
+
+void emfieldDipoleReference( DVec3 pos, double omega, double beta, double t, int unitAmplitude, DVec3 &eRe, DVec3 &eIm );
+	// Evaluates the E phasor of a single dipole at the origin, rotated to time t.
+	// This is the original per-point math from render() kept as the scalar reference.
+	// The origin itself has no field and gives zeros.
+void emfieldDipoleReference( DVec3 pos, double omega, double beta, double t, int unitAmplitude, DVec3 &eRe, DVec3 &eIm, DVec3 &hRe, DVec3 &hIm );
+	// Also the H phasor, Hphi = (omega/(beta r^2) + i omega/r) sin(theta) in the
+	// phi slot of the same unit vectors. H is in units where the wave impedance
+	// is 1, so |H| = |E| in the far field. unitAmplitude makes it a unit phi.
+
+// Kernel dispatch. The SIMD kernels evaluate several grid points per
+// instruction with a polynomial sincos and no acos/atan2. The best ISA
+// is picked at first use; emfieldIsaSet() can force a lower one.
+enum {
+	EMFIELD_ISA_SCALAR = 0,
+	EMFIELD_ISA_AVX2,
+	EMFIELD_ISA_AVX512,
+	EMFIELD_ISA_COUNT
+};
+
+int emfieldIsaDetect();
+	// Best ISA supported by both the CPU and the OS
+int emfieldIsaSet( int isa );
+	// Selects a kernel, clamped to what emfieldIsaDetect() allows. Returns the ISA in use.
+int emfieldIsaGet();
+const char *emfieldIsaName( int isa );
+
+void emfieldDipoleKernel( int count, const double *px, const double *py, const double *pz, double omega, double beta, double t, int unitAmplitude, int magnetic, double *out[12] );
+	// Same result as emfieldDipoleReference() for each point, written to out[0..5] as
+	// eRe.x, eRe.y, eRe.z, eIm.x, eIm.y, eIm.z. When magnetic is set H goes to
+	// out[6..11] in the same order, computed in the same pass; otherwise only
+	// out[0..5] need to exist.
+void emfieldDipoleKernel( int count, const float *px, const float *py, const float *pz, double omega, double beta, double t, int unitAmplitude, int magnetic, float *out[12] );
+	// Float build of the same kernel with twice the lanes. Expect ~1e-6 relative error.
+
+// Superposition of Hertzian dipoles
+//------------------------------------------------------------------------------------------
+
+struct EMFieldSources {
+	// Any number of dipoles sharing omega and beta, stored as structure of
+	// arrays so the kernels can broadcast one source at a time against a lane
+	// of grid points. Unlike emfieldDipoleReference() this is the textbook
+	// field with the usual theta unit vector, for a dipole along any axis.
+
+	int count;
+	int alloced;
+	int version;
+		// Bumped on every change so samplers know to rebuild their phasor cache
+	double *x, *y, *z;
+		// Positions
+	double *nx, *ny, *nz;
+		// Unit dipole axes
+	double *aRe, *aIm;
+		// Complex amplitude, amplitude * e^(i phase)
+
+	EMFieldSources();
+	~EMFieldSources();
+
+	int add( DVec3 pos, DVec3 axis, double amplitude, double phase );
+		// Returns the index of the new source. The axis need not be normalized.
+	void set( int i, DVec3 pos, DVec3 axis, double amplitude, double phase );
+	void reset() { count = 0; version++; }
+		// Removes every source but keeps the memory
+	void clear();
+};
+
+void emfieldSourcesReference( DVec3 pos, EMFieldSources &sources, double omega, double beta, double t, DVec3 &eRe, DVec3 &eIm );
+void emfieldSourcesReference( DVec3 pos, EMFieldSources &sources, double omega, double beta, double t, DVec3 &eRe, DVec3 &eIm, DVec3 &hRe, DVec3 &hIm );
+	// Sum of every source's E (and H) phasor at pos rotated to time t, through
+	// acos/atan2 and a per-source local frame. The scalar reference for the
+	// kernels below. H is normalized as in emfieldDipoleReference().
+
+void emfieldSourcesKernel( int count, const double *px, const double *py, const double *pz, EMFieldSources &sources, double omega, double beta, double t, int magnetic, double *out[12] );
+void emfieldSourcesKernel( int count, const float *px, const float *py, const float *pz, EMFieldSources &sources, double omega, double beta, double t, int magnetic, float *out[12] );
+	// Same result as emfieldSourcesReference() for each point, laid out as in
+	// emfieldDipoleKernel(). A point exactly on a source gives inf/NaN.
+void emfieldSourcesKernel( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double t, int magnetic, double *out[12] );
+	// As above for raw streams in the EMFieldSources order x, y, z, nx, ny, nz, aRe, aIm
+
+void emfieldMultipoleKernel( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] );
+	// Adds the outgoing spherical harmonic expansion of one source cluster
+	// centred on (cx,cy,cz) to out. With magnetic the expansion must have been
+	// fitted with H, twelve coefficients per (n,m) instead of six. The layout of invH, coef and ab is set
+	// by EMFieldMultipole, see emfieldMultipoleLanes() in emfieldkernel.h.
+
+void emfieldDerivedKernel( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] );
+void emfieldDerivedKernel( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] );
+	// Poynting vector and energy density of E and H laid out as in
+	// emfieldDipoleKernel(), with eps = mu = 2 halfEps. inst writes
+	// S = Re E x Re H and u to out[0..3], avg the period averages to out[4..7].
+	// When dst is given src is first rotated by c + i sn into it and only
+	// S and u are written.
+
+#define EMFIELD_BRICK_POINTS (1024)
+	// Points per unit of threaded work. The buffers are SoA over the linear
+	// grid index and every point is independent, so a brick is a contiguous
+	// run of indices: 1024 points of the 15 streams is ~120KB, inside L2,
+	// ~220KB with the 12 H streams and ~280KB with the 8 derived ones.
+	// It is a multiple of every lane width, so a point always goes through
+	// the same kernel path no matter how many threads are used.
+
+struct EMFieldGrid {
+	DVec3 lo, hi;
+		// Inclusive bounds of the sample points
+	int n[3];
+		// Number of sample points along each axis
+
+	EMFieldGrid() { n[0] = n[1] = n[2] = 0; }
+	EMFieldGrid( DVec3 _lo, DVec3 _hi, int nx, int ny, int nz ) { lo = _lo; hi = _hi; n[0] = nx; n[1] = ny; n[2] = nz; }
+
+	int count() { return n[0] * n[1] * n[2]; }
+	int index( int xi, int yi, int zi ) { return ( xi * n[1] + yi ) * n[2] + zi; }
+		// x is the outer axis and z the inner one to match the render() loop order
+	double coord( int axis, int i );
+	int equals( EMFieldGrid &o );
+};
+
+template< class T >
+struct EMFieldSamplerT {
+	// T is the storage and arithmetic precision of every per-point stream,
+	// double or float. Grid coordinates and parameters are always double.
+
+	EMFieldGrid grid;
+	double omega;
+	double beta;
+	int unitAmplitude;
+		// When set the spherical amplitudes are replaced by a unit theta component.
+		// This is how render() has always drawn the field.
+
+	EMWorkPool *pool;
+		// Optional. When set the grid is evaluated in bricks on this pool.
+	EMFieldSources *sources;
+		// Optional. When set the grid holds the superposed field of these
+		// sources instead of the single dipole at the origin, and
+		// unitAmplitude is ignored.
+	EMFieldMultipole *multipole;
+		// Optional, only used with sources. When set the sources are
+		// evaluated through its cluster expansions, rebuilt as needed.
+	int magnetic;
+		// When set H is evaluated in the same pass as E into the h streams.
+		// The H streams are only allocated once this has been set.
+	int derived;
+		// When set the Poynting vector and energy density are produced in the
+		// same loops that write E and H. Implies H.
+
+	int count;
+	int alloced;
+	int allocedMagnetic;
+	int allocedDerived;
+	void *block;
+		// All of the arrays below live in this one allocation
+
+	int cacheValid;
+	double cacheOmega;
+	double cacheBeta;
+	int cacheUnitAmplitude;
+	int cacheMagnetic;
+	int cacheDerived;
+	EMFieldSources *cacheSources;
+	int cacheSourcesVersion;
+	EMFieldMultipole *cacheMultipole;
+	int cacheMultipoleVersion;
+		// The parameters the phasor cache was built with
+
+	int stepValid;
+	int stepMagnetic;
+	int stepDerived;
+	double stepTime;
+		// Time the E (and, with stepMagnetic, H, with stepDerived, S and u)
+		// buffers currently hold, set by every sample*() call
+	int stepCount;
+	int resyncSteps;
+		// step() re-rotates from the phasor cache every resyncSteps steps to
+		// reset the rounding drift of the in-place updates. 0 never resyncs.
+	double rotorDt, rotorC, rotorS;
+		// e^(i omega dt) for the last dt passed to step()
+
+	T *px, *py, *pz;
+		// Sample positions
+	T *eReX, *eReY, *eReZ;
+		// Real part of E in cartesian coordinates
+	T *eImX, *eImY, *eImZ;
+		// Imaginary part of E in cartesian coordinates
+	T *aReX, *aReY, *aReZ;
+	T *aImX, *aImY, *aImZ;
+		// Cached cartesian phasor A of each point such that E(t) = A * e^(i omega t).
+		// It depends only on the grid, omega, beta and unitAmplitude.
+	T *hReX, *hReY, *hReZ;
+	T *hImX, *hImY, *hImZ;
+		// H in cartesian coordinates, normalized as in emfieldDipoleReference().
+		// Null until magnetic is set.
+	T *bReX, *bReY, *bReZ;
+	T *bImX, *bImY, *bImZ;
+		// Cached phasor B such that H(t) = B * e^(i omega t)
+	T *sX, *sY, *sZ, *u;
+		// Instantaneous Poynting vector S = Re E x Re H and energy density
+		// u = eps/2 (|Re E|^2 + |Re H|^2) at stepTime. In the units of H
+		// above eps = mu = beta/omega. Null until derived is set.
+	T *sAvgX, *sAvgY, *sAvgZ, *uAvg;
+		// Their time averages over a period, 1/2 Re(A x conj B) and
+		// eps/4 (|A|^2 + |B|^2), filled with the phasor cache
+
+	EMFieldSamplerT();
+	~EMFieldSamplerT();
+
+	void setGrid( EMFieldGrid &g );
+		// Reallocates only when the number of points grows
+	void sample( double t );
+		// Fills the E (and H) buffers for time t by rotating the cached phasors
+	void step( double dt );
+		// Advances the E buffers from stepTime to stepTime+dt in place with one
+		// complex multiply per point. Falls back to sample() when the buffers
+		// are stale or the parameters changed.
+	void sampleDirect( double t );
+		// Fills the E buffers for time t with the full per-point kernel, bypassing
+		// the cache. The averages come from the same E and H phasors, as
+		// E x conj H does not depend on t.
+	void sampleReference( double t );
+		// As sampleDirect() but through emfieldDipoleReference(), for accuracy checks
+	void buildPhasorCache();
+	int cacheStale();
+		// True when the phasor cache no longer matches the parameters or sources
+	void invalidate() { cacheValid = 0; stepValid = 0; }
+	int needsH() { return magnetic || derived; }
+	int brickCount() { return ( count + EMFIELD_BRICK_POINTS - 1 ) / EMFIELD_BRICK_POINTS; }
+	void clear();
+		// Frees the buffers and forgets the grid
+};
+
+typedef EMFieldSamplerT<double> EMFieldSampler;
+typedef EMFieldSamplerT<float> EMFieldSamplerF;
+
+// Static point charges
+//------------------------------------------------------------------------------------------
+
+struct EMFieldCharges {
+	// Any number of point charges for the particle tools, which want the
+	// Coulomb field at many moving points rather than on a grid. Float
+	// structure of arrays like EMFieldSources, grown the same way.
+
+	int count;
+	int alloced;
+	int version;
+		// Bumped on every change
+	float *x, *y, *z;
+		// Positions
+	float *q;
+		// Charges
+
+	EMFieldCharges();
+	~EMFieldCharges();
+
+	int add( DVec3 pos, double charge );
+		// Returns the index of the new charge
+	void set( int i, DVec3 pos, double charge );
+	void reset() { count = 0; version++; }
+		// Removes every charge but keeps the memory
+	void clear();
+};
+
+void emfieldCoulombReference( DVec3 pos, EMFieldCharges &charges, DVec3 &f );
+	// Sum of q d/|d|^3 over every charge, d = pos - charge, in double.
+	// No 1/(4 pi eps0): the particle tools only care about the shape.
+void emfieldCoulombKernel( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] );
+	// Same sum for each point into out[0..2] as x, y, z, from raw streams in
+	// the EMFieldCharges order x, y, z, q. The SIMD kernels take 1/|d| from
+	// the hardware reciprocal square root plus one Newton step, so expect
+	// ~1e-6 relative error per pair. A point exactly on a charge gives inf/NaN.
+void emfieldCoulomb( EMWorkPool *pool, int count, const float *px, const float *py, const float *pz, EMFieldCharges &charges, float *out[3] );
+	// emfieldCoulombKernel() over EMFIELD_BRICK_POINTS bricks on pool, which
+	// may be null. Costs count * charges.count pair interactions.
+
+#endif
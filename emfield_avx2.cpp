@@ -0,0 +1,138 @@
+// @ZBS {
+//		*MODULE_OWNER_NAME emfield
+// }
+// AVX2 + FMA build of the dipole kernel, four doubles or eight floats per lane.
+// Only called when emfieldIsaDetect() reports AVX2 support.
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) ) && !defined(__AVX2__)
+	#pragma GCC target("avx2,fma")
+#endif
+
+// OPERATING SYSTEM specific includes:
+// SDK includes:
+// STDLIB includes:
+// MODULE includes:
+#include "emfieldkernel.h"
+// ZBSLIB includes:
+
+#ifdef EMFIELD_X86
+
+#include "immintrin.h"
+
+struct EMMaskAVX2 {
+	__m256d m;
+	EMMaskAVX2( __m256d _m ) { m = _m; }
+};
+
+struct EMLaneAVX2 {
+	enum { Width = 4 };
+	typedef EMMaskAVX2 Mask;
+	typedef double Real;
+	__m256d v;
+	EMLaneAVX2() {}
+	EMLaneAVX2( __m256d _v ) { v = _v; }
+	EMLaneAVX2( double _v ) { v = _mm256_set1_pd( _v ); }
+	static EMLaneAVX2 load( const double *p ) { return EMLaneAVX2( _mm256_loadu_pd( p ) ); }
+};
+
+static inline void vstore( double *p, EMLaneAVX2 a ) { _mm256_storeu_pd( p, a.v ); }
+static inline EMLaneAVX2 operator + ( EMLaneAVX2 a, EMLaneAVX2 b ) { return EMLaneAVX2( _mm256_add_pd( a.v, b.v ) ); }
+static inline EMLaneAVX2 operator - ( EMLaneAVX2 a, EMLaneAVX2 b ) { return EMLaneAVX2( _mm256_sub_pd( a.v, b.v ) ); }
+static inline EMLaneAVX2 operator * ( EMLaneAVX2 a, EMLaneAVX2 b ) { return EMLaneAVX2( _mm256_mul_pd( a.v, b.v ) ); }
+static inline EMLaneAVX2 operator / ( EMLaneAVX2 a, EMLaneAVX2 b ) { return EMLaneAVX2( _mm256_div_pd( a.v, b.v ) ); }
+static inline EMLaneAVX2 vsqrt( EMLaneAVX2 a ) { return EMLaneAVX2( _mm256_sqrt_pd( a.v ) ); }
+static inline EMLaneAVX2 vround( EMLaneAVX2 a ) { return EMLaneAVX2( _mm256_round_pd( a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) ); }
+static inline EMLaneAVX2 vfloor( EMLaneAVX2 a ) { return EMLaneAVX2( _mm256_floor_pd( a.v ) ); }
+static inline EMMaskAVX2 vcmpeq( EMLaneAVX2 a, EMLaneAVX2 b ) { return EMMaskAVX2( _mm256_cmp_pd( a.v, b.v, _CMP_EQ_OQ ) ); }
+static inline EMMaskAVX2 vor( EMMaskAVX2 a, EMMaskAVX2 b ) { return EMMaskAVX2( _mm256_or_pd( a.m, b.m ) ); }
+static inline EMLaneAVX2 vselect( EMMaskAVX2 m, EMLaneAVX2 a, EMLaneAVX2 b ) { return EMLaneAVX2( _mm256_blendv_pd( b.v, a.v, m.m ) ); }
+
+struct EMMaskAVX2F {
+	__m256 m;
+	EMMaskAVX2F( __m256 _m ) { m = _m; }
+};
+
+struct EMLaneAVX2F {
+	enum { Width = 8 };
+	typedef EMMaskAVX2F Mask;
+	typedef float Real;
+	__m256 v;
+	EMLaneAVX2F() {}
+	EMLaneAVX2F( __m256 _v ) { v = _v; }
+	EMLaneAVX2F( double _v ) { v = _mm256_set1_ps( (float)_v ); }
+	static EMLaneAVX2F load( const float *p ) { return EMLaneAVX2F( _mm256_loadu_ps( p ) ); }
+};
+
+static inline void vstore( float *p, EMLaneAVX2F a ) { _mm256_storeu_ps( p, a.v ); }
+static inline EMLaneAVX2F operator + ( EMLaneAVX2F a, EMLaneAVX2F b ) { return EMLaneAVX2F( _mm256_add_ps( a.v, b.v ) ); }
+static inline EMLaneAVX2F operator - ( EMLaneAVX2F a, EMLaneAVX2F b ) { return EMLaneAVX2F( _mm256_sub_ps( a.v, b.v ) ); }
+static inline EMLaneAVX2F operator * ( EMLaneAVX2F a, EMLaneAVX2F b ) { return EMLaneAVX2F( _mm256_mul_ps( a.v, b.v ) ); }
+static inline EMLaneAVX2F operator / ( EMLaneAVX2F a, EMLaneAVX2F b ) { return EMLaneAVX2F( _mm256_div_ps( a.v, b.v ) ); }
+static inline EMLaneAVX2F vsqrt( EMLaneAVX2F a ) { return EMLaneAVX2F( _mm256_sqrt_ps( a.v ) ); }
+static inline EMLaneAVX2F vround( EMLaneAVX2F a ) { return EMLaneAVX2F( _mm256_round_ps( a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) ); }
+static inline EMLaneAVX2F vfloor( EMLaneAVX2F a ) { return EMLaneAVX2F( _mm256_floor_ps( a.v ) ); }
+static inline EMMaskAVX2F vcmpeq( EMLaneAVX2F a, EMLaneAVX2F b ) { return EMMaskAVX2F( _mm256_cmp_ps( a.v, b.v, _CMP_EQ_OQ ) ); }
+static inline EMMaskAVX2F vor( EMMaskAVX2F a, EMMaskAVX2F b ) { return EMMaskAVX2F( _mm256_or_ps( a.m, b.m ) ); }
+static inline EMLaneAVX2F vselect( EMMaskAVX2F m, EMLaneAVX2F a, EMLaneAVX2F b ) { return EMLaneAVX2F( _mm256_blendv_ps( b.v, a.v, m.m ) ); }
+static inline EMLaneAVX2F vrsqrt( EMLaneAVX2F a ) { return EMLaneAVX2F( _mm256_rsqrt_ps( a.v ) ); }
+
+void emfieldDipoleAVX2( int count, const double *px, const double *py, const double *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, double *out[12] ) {
+	emfieldDipoleBlock<EMLaneAVX2>( count, px, py, pz, omega, beta, phase, unitAmplitude, magnetic, out );
+}
+
+void emfieldDipoleAVX2F( int count, const float *px, const float *py, const float *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, float *out[12] ) {
+	emfieldDipoleBlock<EMLaneAVX2F>( count, px, py, pz, omega, beta, phase, unitAmplitude, magnetic, out );
+}
+
+void emfieldSourcesAVX2( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, double *out[12] ) {
+	emfieldSourcesBlock<EMLaneAVX2>( count, px, py, pz, numSources, src, omega, beta, phase, magnetic, out );
+}
+
+void emfieldSourcesAVX2F( int count, const float *px, const float *py, const float *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, float *out[12] ) {
+	emfieldSourcesBlock<EMLaneAVX2F>( count, px, py, pz, numSources, src, omega, beta, phase, magnetic, out );
+}
+
+void emfieldMultipoleAVX2( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] ) {
+	emfieldMultipoleBlock<EMLaneAVX2>( count, px, py, pz, cx, cy, cz, k, order, invH, coef, ab, magnetic, out );
+}
+
+void emfieldDerivedAVX2( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] ) {
+	emfieldDerivedBlock<EMLaneAVX2>( count, src, dst, c, sn, halfEps, inst, avg, out );
+}
+
+void emfieldDerivedAVX2F( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] ) {
+	emfieldDerivedBlock<EMLaneAVX2F>( count, src, dst, c, sn, halfEps, inst, avg, out );
+}
+
+void emfieldCoulombAVX2( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] ) {
+	// 2 lane groups per charge broadcast fit the 16 vector registers
+	emfieldCoulombBlock<EMLaneAVX2F,2>( count, px, py, pz, numCharges, chg, out );
+}
+
+#else
+
+void emfieldDipoleAVX2( int count, const double *px, const double *py, const double *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, double *out[12] ) {
+}
+
+void emfieldDipoleAVX2F( int count, const float *px, const float *py, const float *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, float *out[12] ) {
+}
+
+void emfieldSourcesAVX2( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, double *out[12] ) {
+}
+
+void emfieldSourcesAVX2F( int count, const float *px, const float *py, const float *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, float *out[12] ) {
+}
+
+void emfieldMultipoleAVX2( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] ) {
+}
+
+void emfieldDerivedAVX2( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] ) {
+}
+
+void emfieldDerivedAVX2F( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] ) {
+}
+
+void emfieldCoulombAVX2( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] ) {
+}
+
+#endif
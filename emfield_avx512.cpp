@@ -0,0 +1,144 @@
+// @ZBS {
+//		*MODULE_OWNER_NAME emfield
+// }
+// AVX-512F build of the dipole kernel, eight doubles or sixteen floats per lane.
+// Only called when emfieldIsaDetect() reports AVX-512F support.
+// Compilers without AVX-512 intrinsics (VS2015 and older) and non-x86
+// targets get EMFIELD_NO_AVX512 from emfieldkernel.h and an empty stub.
+
+#if defined(__GNUC__) && ( defined(__x86_64__) || defined(__i386__) ) && !defined(__AVX512F__)
+	#pragma GCC target("avx512f")
+#endif
+
+// OPERATING SYSTEM specific includes:
+// SDK includes:
+// STDLIB includes:
+// MODULE includes:
+#include "emfieldkernel.h"
+// ZBSLIB includes:
+
+#ifndef EMFIELD_NO_AVX512
+
+#include "immintrin.h"
+
+// sqrt, roundscale and rsqrt14 go through their zero-masked forms with every
+// lane set, which compile to the same instructions. gcc reports the plain
+// intrinsics' undefined pass-through operand as maybe uninitialized.
+
+struct EMMaskAVX512 {
+	__mmask8 m;
+	EMMaskAVX512( __mmask8 _m ) { m = _m; }
+};
+
+struct EMLaneAVX512 {
+	enum { Width = 8 };
+	typedef EMMaskAVX512 Mask;
+	typedef double Real;
+	__m512d v;
+	EMLaneAVX512() {}
+	EMLaneAVX512( __m512d _v ) { v = _v; }
+	EMLaneAVX512( double _v ) { v = _mm512_set1_pd( _v ); }
+	static EMLaneAVX512 load( const double *p ) { return EMLaneAVX512( _mm512_loadu_pd( p ) ); }
+};
+
+static inline void vstore( double *p, EMLaneAVX512 a ) { _mm512_storeu_pd( p, a.v ); }
+static inline EMLaneAVX512 operator + ( EMLaneAVX512 a, EMLaneAVX512 b ) { return EMLaneAVX512( _mm512_add_pd( a.v, b.v ) ); }
+static inline EMLaneAVX512 operator - ( EMLaneAVX512 a, EMLaneAVX512 b ) { return EMLaneAVX512( _mm512_sub_pd( a.v, b.v ) ); }
+static inline EMLaneAVX512 operator * ( EMLaneAVX512 a, EMLaneAVX512 b ) { return EMLaneAVX512( _mm512_mul_pd( a.v, b.v ) ); }
+static inline EMLaneAVX512 operator / ( EMLaneAVX512 a, EMLaneAVX512 b ) { return EMLaneAVX512( _mm512_div_pd( a.v, b.v ) ); }
+static inline EMLaneAVX512 vsqrt( EMLaneAVX512 a ) { return EMLaneAVX512( _mm512_maskz_sqrt_pd( 0xff, a.v ) ); }
+static inline EMLaneAVX512 vround( EMLaneAVX512 a ) { return EMLaneAVX512( _mm512_maskz_roundscale_pd( 0xff, a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) ); }
+static inline EMLaneAVX512 vfloor( EMLaneAVX512 a ) { return EMLaneAVX512( _mm512_maskz_roundscale_pd( 0xff, a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC ) ); }
+static inline EMMaskAVX512 vcmpeq( EMLaneAVX512 a, EMLaneAVX512 b ) { return EMMaskAVX512( _mm512_cmp_pd_mask( a.v, b.v, _CMP_EQ_OQ ) ); }
+static inline EMMaskAVX512 vor( EMMaskAVX512 a, EMMaskAVX512 b ) { return EMMaskAVX512( (__mmask8)( a.m | b.m ) ); }
+static inline EMLaneAVX512 vselect( EMMaskAVX512 m, EMLaneAVX512 a, EMLaneAVX512 b ) { return EMLaneAVX512( _mm512_mask_blend_pd( m.m, b.v, a.v ) ); }
+
+struct EMMaskAVX512F {
+	__mmask16 m;
+	EMMaskAVX512F( __mmask16 _m ) { m = _m; }
+};
+
+struct EMLaneAVX512F {
+	enum { Width = 16 };
+	typedef EMMaskAVX512F Mask;
+	typedef float Real;
+	__m512 v;
+	EMLaneAVX512F() {}
+	EMLaneAVX512F( __m512 _v ) { v = _v; }
+	EMLaneAVX512F( double _v ) { v = _mm512_set1_ps( (float)_v ); }
+	static EMLaneAVX512F load( const float *p ) { return EMLaneAVX512F( _mm512_loadu_ps( p ) ); }
+};
+
+static inline void vstore( float *p, EMLaneAVX512F a ) { _mm512_storeu_ps( p, a.v ); }
+static inline EMLaneAVX512F operator + ( EMLaneAVX512F a, EMLaneAVX512F b ) { return EMLaneAVX512F( _mm512_add_ps( a.v, b.v ) ); }
+static inline EMLaneAVX512F operator - ( EMLaneAVX512F a, EMLaneAVX512F b ) { return EMLaneAVX512F( _mm512_sub_ps( a.v, b.v ) ); }
+static inline EMLaneAVX512F operator * ( EMLaneAVX512F a, EMLaneAVX512F b ) { return EMLaneAVX512F( _mm512_mul_ps( a.v, b.v ) ); }
+static inline EMLaneAVX512F operator / ( EMLaneAVX512F a, EMLaneAVX512F b ) { return EMLaneAVX512F( _mm512_div_ps( a.v, b.v ) ); }
+static inline EMLaneAVX512F vsqrt( EMLaneAVX512F a ) { return EMLaneAVX512F( _mm512_maskz_sqrt_ps( 0xffff, a.v ) ); }
+static inline EMLaneAVX512F vround( EMLaneAVX512F a ) { return EMLaneAVX512F( _mm512_maskz_roundscale_ps( 0xffff, a.v, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC ) ); }
+static inline EMLaneAVX512F vfloor( EMLaneAVX512F a ) { return EMLaneAVX512F( _mm512_maskz_roundscale_ps( 0xffff, a.v, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC ) ); }
+static inline EMMaskAVX512F vcmpeq( EMLaneAVX512F a, EMLaneAVX512F b ) { return EMMaskAVX512F( _mm512_cmp_ps_mask( a.v, b.v, _CMP_EQ_OQ ) ); }
+static inline EMMaskAVX512F vor( EMMaskAVX512F a, EMMaskAVX512F b ) { return EMMaskAVX512F( (__mmask16)( a.m | b.m ) ); }
+static inline EMLaneAVX512F vselect( EMMaskAVX512F m, EMLaneAVX512F a, EMLaneAVX512F b ) { return EMLaneAVX512F( _mm512_mask_blend_ps( m.m, b.v, a.v ) ); }
+static inline EMLaneAVX512F vrsqrt( EMLaneAVX512F a ) { return EMLaneAVX512F( _mm512_maskz_rsqrt14_ps( 0xffff, a.v ) ); }
+
+void emfieldDipoleAVX512( int count, const double *px, const double *py, const double *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, double *out[12] ) {
+	emfieldDipoleBlock<EMLaneAVX512>( count, px, py, pz, omega, beta, phase, unitAmplitude, magnetic, out );
+}
+
+void emfieldDipoleAVX512F( int count, const float *px, const float *py, const float *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, float *out[12] ) {
+	emfieldDipoleBlock<EMLaneAVX512F>( count, px, py, pz, omega, beta, phase, unitAmplitude, magnetic, out );
+}
+
+void emfieldSourcesAVX512( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, double *out[12] ) {
+	emfieldSourcesBlock<EMLaneAVX512>( count, px, py, pz, numSources, src, omega, beta, phase, magnetic, out );
+}
+
+void emfieldSourcesAVX512F( int count, const float *px, const float *py, const float *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, float *out[12] ) {
+	emfieldSourcesBlock<EMLaneAVX512F>( count, px, py, pz, numSources, src, omega, beta, phase, magnetic, out );
+}
+
+void emfieldMultipoleAVX512( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] ) {
+	emfieldMultipoleBlock<EMLaneAVX512>( count, px, py, pz, cx, cy, cz, k, order, invH, coef, ab, magnetic, out );
+}
+
+void emfieldDerivedAVX512( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] ) {
+	emfieldDerivedBlock<EMLaneAVX512>( count, src, dst, c, sn, halfEps, inst, avg, out );
+}
+
+void emfieldDerivedAVX512F( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] ) {
+	emfieldDerivedBlock<EMLaneAVX512F>( count, src, dst, c, sn, halfEps, inst, avg, out );
+}
+
+void emfieldCoulombAVX512( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] ) {
+	// 4 lane groups per charge broadcast fit the 32 vector registers
+	emfieldCoulombBlock<EMLaneAVX512F,4>( count, px, py, pz, numCharges, chg, out );
+}
+
+#else
+
+void emfieldDipoleAVX512( int count, const double *px, const double *py, const double *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, double *out[12] ) {
+}
+
+void emfieldDipoleAVX512F( int count, const float *px, const float *py, const float *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, float *out[12] ) {
+}
+
+void emfieldSourcesAVX512( int count, const double *px, const double *py, const double *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, double *out[12] ) {
+}
+
+void emfieldSourcesAVX512F( int count, const float *px, const float *py, const float *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, float *out[12] ) {
+}
+
+void emfieldMultipoleAVX512( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] ) {
+}
+
+void emfieldDerivedAVX512( int count, double *src[12], double *dst[12], double c, double sn, double halfEps, int inst, int avg, double *out[8] ) {
+}
+
+void emfieldDerivedAVX512F( int count, float *src[12], float *dst[12], double c, double sn, double halfEps, int inst, int avg, float *out[8] ) {
+}
+
+void emfieldCoulombAVX512( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] ) {
+}
+
+#endif
@@ -0,0 +1,1025 @@
+// @ZBS {
+//		*MASTER_FILE 1
+//		+DESCRIPTION {
+//			Command line driver that times the headless field evaluation
+//		}
+//		*PORTABILITY win32 unix
+//		*REQUIRED_FILES emfieldbench.cpp emfield.cpp emfield.h emfieldkernel.h emfield_avx2.cpp emfield_avx512.cpp emmultipole.cpp emmultipole.h empool.cpp empool.h emrandom.h emtree.h zvec.cpp zvec.h
+//		*VERSION 1.0
+//		+HISTORY {
+//		}
+//		+TODO {
+//		}
+//		*SELF_TEST no
+//		*PUBLISH no
+// }
+// OPERATING SYSTEM specific includes:
+// SDK includes:
+// STDLIB includes:
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "math.h"
+#include <chrono>
+// MODULE includes:
+#include "emfield.h"
+#include "emmultipole.h"
+#include "empool.h"
+#include "emrandom.h"
+#include "emtree.h"
+// ZBSLIB includes:
+
+// Usage: emfieldbench [options]
+//   -res n      Points per axis (default 16)
+//   -dim d      Edge length of the sampled cube (default 15)
+//   -iters n    Number of timed evaluations (default 100)
+//   -dt s       Simulated time advanced between evaluations (default 0.016)
+//   -direct     Time the full per-point kernel instead of the phasor cache
+//   -reference  Time the original scalar math (acos/atan2 per point)
+//   -step       Time the incremental in-place rotation by dt
+//   -resync n   Steps between resyncs to the phasor cache in -step mode (default 256, 0 = never)
+//   -float      Store and evaluate the grid in float instead of double
+//   -sources n  Evaluate a planar phased array of n dipoles instead of the single dipole
+//   -cloud      Place the sources in a compact random cloud below the grid instead of the array
+//   -multipole tol
+//               Evaluate the sources through cluster expansions of this accuracy
+//   -sourcescaling
+//               Time the superposition for 1, 10, 100, 1000 and 10000 sources, and
+//               with -multipole the expanded sum and its error against the direct one
+//   -isa name   Force a kernel: scalar, avx2 or avx512 (default: best available)
+//   -unit       Use the unit theta amplitudes that render() draws
+//   -magnetic   Evaluate H alongside E in the same pass
+//   -derived    Also produce the Poynting vector and energy density (implies H)
+//   -verify     Compare every available kernel in double and float against the
+//               double reference and exit non-zero if any error exceeds the
+//               tolerance for that precision. Also checks the particle
+//               generator against the reference xoshiro128+, and the charge
+//               tree's pool build and field against the serial build and sum
+//   -threads n  Evaluate bricks on a pool of n threads (default 1, 0 = all cores)
+//   -scaling    Time 1, 2, 4 .. n threads (n from -threads, default all cores),
+//               report the speedup and check the output is bitwise identical
+//   -coulomb c p
+//               Time the static field of c random point charges at p random
+//               points, on the -threads pool, and check it against the double sum
+
+static double nowSeconds() {
+	return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+static double worse( double worst, double err ) {
+	// The larger error, where NaN counts as larger than anything and, once
+	// in, stays, so one bad point anywhere fails the check
+	return err != err || err > worst ? err : worst;
+}
+
+template< class T >
+static double checksum( EMFieldSamplerT<T> &s ) {
+	double sum = 0.0;
+	for( int i=0; i<s.count; i++ ) {
+		sum += (double)s.eReX[i]*s.eReX[i] + (double)s.eReY[i]*s.eReY[i] + (double)s.eReZ[i]*s.eReZ[i];
+		sum += (double)s.eImX[i]*s.eImX[i] + (double)s.eImY[i]*s.eImY[i] + (double)s.eImZ[i]*s.eImZ[i];
+	}
+	return sum;
+}
+
+template< class T >
+static T *copyE( EMFieldSamplerT<T> &s ) {
+	T *copy = (T *)malloc( sizeof(T) * 6 * s.count );
+	T *src[6] = { s.eReX, s.eReY, s.eReZ, s.eImX, s.eImY, s.eImZ };
+	for( int k=0; k<6; k++ ) {
+		memcpy( &copy[k*s.count], src[k], sizeof(T) * s.count );
+	}
+	return copy;
+}
+
+template< class T >
+static double derivedError( T *sx, T *sy, T *sz, T *u, double *wx, double *wy, double *wz, double *wu, double *scale, int count, double eps ) {
+	// S and u both vanish where E and H cross zero together, so they are
+	// measured against 2<u>/eps = (|E|^2 + |H|^2)/2, the peak of u/eps
+	// and a bound on |S|
+	double worst = 0.0;
+	for( int i=0; i<count; i++ ) {
+		double dx = (double)sx[i] - wx[i];
+		double dy = (double)sy[i] - wy[i];
+		double dz = (double)sz[i] - wz[i];
+		double du = ( (double)u[i] - wu[i] ) / eps;
+		double rel = sqrt( dx*dx + dy*dy + dz*dz + du*du ) / ( 2.0 * scale[i] / eps + 1e-30 );
+		worst = worse( worst, rel );
+	}
+	return worst;
+}
+
+template< class T >
+static double maxRelativeError( EMFieldSamplerT<T> &s, EMFieldSampler &ref ) {
+	// Error of each point's complex vector relative to its own magnitude,
+	// for E and, when both sides hold them, separately for H, S and u
+	T *got[12] = { s.eReX, s.eReY, s.eReZ, s.eImX, s.eImY, s.eImZ, s.hReX, s.hReY, s.hReZ, s.hImX, s.hImY, s.hImZ };
+	double *want[12] = { ref.eReX, ref.eReY, ref.eReZ, ref.eImX, ref.eImY, ref.eImZ, ref.hReX, ref.hReY, ref.hReZ, ref.hImX, ref.hImY, ref.hImZ };
+	int channels = s.stepMagnetic && ref.stepMagnetic ? 12 : 6;
+	double worst = 0.0;
+	for( int i=0; i<s.count; i++ ) {
+		// On the single dipole's axis H is exactly zero, which the kernels
+		// reproduce but the reference rounds to sin(pi) times the field. Held
+		// to zero there, against |E| as H has no magnitude of its own.
+		int hVanishes = !ref.sources && !ref.unitAmplitude && ref.px[i] == 0.0 && ref.py[i] == 0.0;
+		double err2[2] = { 0.0, 0.0 };
+		double mag2[2] = { 0.0, 0.0 };
+		for( int k=0; k<channels; k++ ) {
+			double r = k >= 6 && hVanishes ? 0.0 : want[k][i];
+			double d = (double)got[k][i] - r;
+			err2[k/6] += d * d;
+			mag2[k/6] += r * r;
+		}
+		for( int k0=0; k0<channels/6; k0++ ) {
+			double mag = k0 && hVanishes ? mag2[0] : mag2[k0];
+			double rel = sqrt( err2[k0] ) / ( sqrt( mag ) + 1e-30 );
+			worst = worse( worst, rel );
+		}
+	}
+	if( s.stepDerived && ref.stepDerived ) {
+		double err = derivedError( s.sX, s.sY, s.sZ, s.u, ref.sX, ref.sY, ref.sZ, ref.u, ref.uAvg, s.count, ref.beta / ref.omega );
+		double errAvg = derivedError( s.sAvgX, s.sAvgY, s.sAvgZ, s.uAvg, ref.sAvgX, ref.sAvgY, ref.sAvgZ, ref.uAvg, ref.uAvg, s.count, ref.beta / ref.omega );
+		// |dS| <= |dE||H| + |E||dH|, twice the relative error of the fields,
+		// so halve it to hold both to the same tolerance
+		err *= 0.5;
+		errAvg *= 0.5;
+		worst = worse( worst, err );
+		worst = worse( worst, errAvg );
+	}
+	return worst;
+}
+
+static void makeArray( EMFieldSources &sources, int n, EMFieldGrid &grid ) {
+	// A square array of z dipoles half a wavelength apart, one unit below the
+	// grid, with a progressive phase along x that steers the beam
+	sources.reset();
+	int side = (int)ceil( sqrt( (double)n ) );
+	double spacing = 3.14159265358979323846 / 2.0;
+	double z = grid.lo.z - 1.0;
+	for( int i=0; i<n; i++ ) {
+		int ix = i % side;
+		int iy = i / side;
+		DVec3 pos( ( ix - 0.5*(side-1) ) * spacing, ( iy - 0.5*(side-1) ) * spacing, z );
+		sources.add( pos, DVec3( 0.0, 0.0, 1.0 ), 1.0, 0.7 * ix );
+	}
+}
+
+static void randomSources( EMFieldSources &sources, int n, double dim ) {
+	// Arbitrary positions, axes, amplitudes and phases from a fixed LCG so
+	// every run checks the same field
+	unsigned int seed = 12345;
+	double v[8];
+	sources.reset();
+	for( int i=0; i<n; i++ ) {
+		for( int k=0; k<8; k++ ) {
+			seed = seed * 1664525u + 1013904223u;
+			v[k] = (double)( seed >> 8 ) / 16777216.0;
+		}
+		DVec3 pos( (v[0]-0.5)*dim, (v[1]-0.5)*dim, (v[2]-0.5)*dim );
+		DVec3 axis( v[3]-0.5, v[4]-0.5, v[5]-0.5 );
+		sources.add( pos, axis, 0.5 + v[6], 6.28318530717958647693 * v[7] );
+	}
+}
+
+static void cloudSources( EMFieldSources &sources, int n, DVec3 center, double size ) {
+	// A dense random cloud of dipoles, the case cluster expansions are for
+	unsigned int seed = 54321;
+	double v[8];
+	sources.reset();
+	for( int i=0; i<n; i++ ) {
+		for( int k=0; k<8; k++ ) {
+			seed = seed * 1664525u + 1013904223u;
+			v[k] = (double)( seed >> 8 ) / 16777216.0;
+		}
+		DVec3 pos( center.x + (v[0]-0.5)*size, center.y + (v[1]-0.5)*size, center.z + (v[2]-0.5)*size );
+		DVec3 axis( v[3]-0.5, v[4]-0.5, v[5]-0.5 );
+		sources.add( pos, axis, 0.5 + v[6], 6.28318530717958647693 * v[7] );
+	}
+}
+
+static DVec3 cloudCenter( EMFieldGrid &grid ) {
+	return DVec3( 0.5 * ( grid.lo.x + grid.hi.x ), 0.5 * ( grid.lo.y + grid.hi.y ), grid.lo.z - 4.0 );
+}
+
+template< class T >
+static int verifyMultipole( EMFieldSamplerT<T> &sampler, EMFieldSampler &ref, const char *precision, double tolerance ) {
+	// A cloud entirely below the grid takes the pure expansion path, one in
+	// the corner of the grid mixes expansion and direct points per brick
+	EMFieldSources sources;
+	EMFieldMultipole multipole;
+	multipole.tolerance = 1e-7;
+	sampler.sources = &sources;
+	sampler.multipole = &multipole;
+	sampler.magnetic = 1;
+	ref.sources = &sources;
+	ref.unitAmplitude = 0;
+	ref.magnetic = 1;
+	int failed = 0;
+	printf( "%-8s %-8s %-8s %-10s %-12s %-12s\n", "layout", "prec", "clusters", "t", "direct", "cached" );
+	for( int layout=0; layout<2; layout++ ) {
+		DVec3 center = layout ? ref.grid.lo : cloudCenter( ref.grid );
+		cloudSources( sources, 600, center, 2.0 );
+		const double times[] = { 0.0, 12.5 };
+		for( int ti=0; ti<2; ti++ ) {
+			ref.sampleReference( times[ti] );
+			sampler.sampleDirect( times[ti] );
+			double directErr = maxRelativeError( sampler, ref );
+			sampler.sample( times[ti] );
+			double cachedErr = maxRelativeError( sampler, ref );
+			int ok = directErr <= tolerance && cachedErr <= tolerance;
+			failed |= !ok;
+			printf( "%-8s %-8s %-8d %-10g %-12.3e %-12.3e %s\n", layout ? "corner" : "below", precision, multipole.numClusters, times[ti], directErr, cachedErr, ok ? "ok" : "FAIL" );
+		}
+	}
+	sampler.sources = 0;
+	sampler.multipole = 0;
+	sampler.magnetic = 0;
+	ref.sources = 0;
+	ref.magnetic = 0;
+	printf( "%s multipole %s (tolerance %g)\n\n", precision, failed ? "FAILED" : "passed", tolerance );
+	return failed;
+}
+
+template< class T >
+static int verifySampler( EMFieldSamplerT<T> &sampler, EMFieldSampler &ref, const char *precision, double tolerance ) {
+	// Every path of sampler against the original scalar math in double
+	const double times[] = { 0.0, 0.37, 12.5, 4321.0 };
+	const int numTimes = sizeof(times) / sizeof(times[0]);
+	int best = emfieldIsaDetect();
+	int failed = 0;
+
+	// H rides along in the same kernels, and S and u in the same loops, so
+	// check E alone, E with H and everything
+	const char *fieldNames[] = { "E", "EH", "EHSu" };
+	printf( "%-8s %-8s %-5s %-6s %-10s %-12s %-12s\n", "isa", "prec", "unit", "fields", "t", "direct", "cached" );
+	for( int isa=EMFIELD_ISA_SCALAR; isa<=best; isa++ ) {
+		emfieldIsaSet( isa );
+		for( int unit=0; unit<2; unit++ ) {
+			for( int fields=0; fields<3; fields++ ) {
+				sampler.unitAmplitude = unit;
+				sampler.magnetic = fields == 1;
+				sampler.derived = fields == 2;
+				sampler.invalidate();
+				ref.unitAmplitude = unit;
+				ref.magnetic = fields == 1;
+				ref.derived = fields == 2;
+				for( int ti=0; ti<numTimes; ti++ ) {
+					ref.sampleReference( times[ti] );
+					sampler.sampleDirect( times[ti] );
+					double directErr = maxRelativeError( sampler, ref );
+					sampler.sample( times[ti] );
+					double cachedErr = maxRelativeError( sampler, ref );
+
+					int ok = directErr <= tolerance && cachedErr <= tolerance;
+					failed |= !ok;
+					printf( "%-8s %-8s %-5d %-6s %-10g %-12.3e %-12.3e %s\n", emfieldIsaName( isa ), precision, unit, fieldNames[fields], times[ti], directErr, cachedErr, ok ? "ok" : "FAIL" );
+				}
+			}
+		}
+	}
+
+	// The incremental path accumulates rounding between resyncs, so check
+	// it after a long run with and without resyncing, with everything on so
+	// the fused S and u update is covered too
+	const int numSteps = 10000;
+	const double dt = 0.016;
+	sampler.derived = 1;
+	ref.derived = 1;
+	printf( "\n%-8s %-8s %-5s %-8s %-10s %-12s\n", "isa", "prec", "unit", "resync", "t", "step" );
+	for( int isa=EMFIELD_ISA_SCALAR; isa<=best; isa++ ) {
+		emfieldIsaSet( isa );
+		for( int unit=0; unit<2; unit++ ) {
+			for( int resync=0; resync<=256; resync+=256 ) {
+				sampler.unitAmplitude = unit;
+				sampler.resyncSteps = resync;
+				sampler.invalidate();
+				sampler.sample( 0.0 );
+				for( int i=0; i<numSteps; i++ ) {
+					sampler.step( dt );
+				}
+				ref.unitAmplitude = unit;
+				ref.sampleReference( sampler.stepTime );
+				double stepErr = maxRelativeError( sampler, ref );
+
+				int ok = stepErr <= tolerance;
+				failed |= !ok;
+				printf( "%-8s %-8s %-5d %-8d %-10g %-12.3e %s\n", emfieldIsaName( isa ), precision, unit, resync, sampler.stepTime, stepErr, ok ? "ok" : "FAIL" );
+			}
+		}
+	}
+	sampler.resyncSteps = 256;
+
+	// The mean of S(t) and u(t) over a period must be the analytic average.
+	// Both are a constant plus a 2 omega sinusoid, so any number of uniform
+	// samples above two averages them exactly.
+	const int numPhases = 64;
+	double period = 2.0 * 3.14159265358979323846 / sampler.omega;
+	int n = sampler.count;
+	double *mean = (double *)calloc( 4 * (size_t)n, sizeof(double) );
+	for( int k=0; k<numPhases; k++ ) {
+		sampler.sample( 3.0 + period * k / numPhases );
+		T *inst[4] = { sampler.sX, sampler.sY, sampler.sZ, sampler.u };
+		for( int c=0; c<4; c++ ) {
+			for( int i=0; i<n; i++ ) {
+				mean[c*n+i] += (double)inst[c][i] / numPhases;
+			}
+		}
+	}
+	ref.sampleReference( 3.0 );
+	double meanErr = derivedError( sampler.sAvgX, sampler.sAvgY, sampler.sAvgZ, sampler.uAvg, &mean[0], &mean[n], &mean[2*n], &mean[3*n], ref.uAvg, n, ref.beta / ref.omega );
+	free( mean );
+	int meanOk = meanErr <= tolerance;
+	failed |= !meanOk;
+	printf( "\nperiod mean of S and u against their averages %.3e %s\n", meanErr, meanOk ? "ok" : "FAIL" );
+
+	sampler.derived = 0;
+	ref.derived = 0;
+	printf( "%s %s (tolerance %g)\n\n", precision, failed ? "FAILED" : "passed", tolerance );
+	return failed;
+}
+
+static void randomCharges( EMFieldCharges &charges, int n, double dim ) {
+	// Charges of +-1 uniform in the cube from the same fixed LCG
+	unsigned int seed = 54321;
+	double v[4];
+	charges.reset();
+	for( int i=0; i<n; i++ ) {
+		for( int k=0; k<4; k++ ) {
+			seed = seed * 1664525u + 1013904223u;
+			v[k] = (double)( seed >> 8 ) / 16777216.0;
+		}
+		charges.add( DVec3( (v[0]-0.5)*dim, (v[1]-0.5)*dim, (v[2]-0.5)*dim ), v[3] < 0.5 ? -1.0 : 1.0 );
+	}
+}
+
+static float *randomPoints( int n, double dim ) {
+	// Three streams of n in one block, x then y then z
+	unsigned int seed = 777;
+	float *p = (float *)malloc( sizeof(float) * 3 * (size_t)n );
+	for( int i=0; i<3*n; i++ ) {
+		seed = seed * 1664525u + 1013904223u;
+		p[i] = (float)( ( (double)( seed >> 8 ) / 16777216.0 - 0.5 ) * dim );
+	}
+	return p;
+}
+
+static double coulombError( EMFieldCharges &charges, int count, float *p, float *out[3], int samples ) {
+	// Worst error over a spread of the points, relative to sum |q|/r^2 there
+	// so that near cancellation between charges is not counted against float
+	double worst = 0.0;
+	int stride = count > samples ? count / samples : 1;
+	for( int i=0; i<count; i+=stride ) {
+		DVec3 pos( p[i], p[count+i], p[2*count+i] );
+		DVec3 f;
+		emfieldCoulombReference( pos, charges, f );
+		double scale = 0.0;
+		for( int j=0; j<charges.count; j++ ) {
+			DVec3 d( pos.x - charges.x[j], pos.y - charges.y[j], pos.z - charges.z[j] );
+			scale += fabs( charges.q[j] ) / d.mag2();
+		}
+		DVec3 e( out[0][i] - f.x, out[1][i] - f.y, out[2][i] - f.z );
+		double err = e.mag() / scale;
+		worst = worse( worst, err );
+	}
+	return worst;
+}
+
+static int verifyCoulomb( double dim, double tolerance ) {
+	// An odd number of points so every ISA runs its batch, single lane and scalar tails
+	EMFieldCharges charges;
+	randomCharges( charges, 301, dim );
+	int count = 1003;
+	float *p = randomPoints( count, dim );
+	float *block = (float *)malloc( sizeof(float) * 3 * (size_t)count );
+	float *out[3] = { block, &block[count], &block[2*count] };
+
+	int failed = 0;
+	printf( "%-8s %-8s %-8s %-12s\n", "isa", "charges", "points", "max error" );
+	int best = emfieldIsaDetect();
+	for( int isa=0; isa<=best; isa++ ) {
+		emfieldIsaSet( isa );
+		emfieldCoulomb( 0, count, p, &p[count], &p[2*count], charges, out );
+		double err = coulombError( charges, count, p, out, count );
+		int ok = err <= tolerance;
+		failed |= !ok;
+		printf( "%-8s %-8d %-8d %-12.3e %s\n", emfieldIsaName( isa ), charges.count, count, err, ok ? "ok" : "FAIL" );
+	}
+	emfieldIsaSet( best );
+	free( block );
+	free( p );
+	printf( "coulomb %s (tolerance %g)\n\n", failed ? "FAILED" : "passed", tolerance );
+	return failed;
+}
+
+struct TreeVec3 {
+	// The float vector ChargeTreeT needs, shaped after OVR's Vector3f
+	float x, y, z;
+	TreeVec3() { x = y = z = 0.f; }
+	TreeVec3( float _x, float _y, float _z ) { x = _x; y = _y; z = _z; }
+	float LengthSq() const { return x*x + y*y + z*z; }
+	float Length() const { return sqrtf( LengthSq() ); }
+	void Normalize() { float l = Length(); if( l > 0.f ) { x /= l; y /= l; z /= l; } }
+	TreeVec3 &operator += ( TreeVec3 b ) { x += b.x; y += b.y; z += b.z; return *this; }
+};
+
+static inline TreeVec3 operator + ( TreeVec3 a, TreeVec3 b ) { return TreeVec3( a.x + b.x, a.y + b.y, a.z + b.z ); }
+static inline TreeVec3 operator - ( TreeVec3 a, TreeVec3 b ) { return TreeVec3( a.x - b.x, a.y - b.y, a.z - b.z ); }
+static inline TreeVec3 operator * ( TreeVec3 a, float c ) { return TreeVec3( a.x * c, a.y * c, a.z * c ); }
+static inline TreeVec3 operator / ( TreeVec3 a, float c ) { return TreeVec3( a.x / c, a.y / c, a.z / c ); }
+
+typedef ChargeTreeT<TreeVec3> EMChargeTree;
+
+static int sameVec( TreeVec3 a, TreeVec3 b ) {
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static int sameTree( EMChargeTree &a, EMChargeTree &b ) {
+	// Node for node and charge for charge, bitwise in every float
+	if( a.Nodes.size() != b.Nodes.size() || a.NumCharges != b.NumCharges ) {
+		return 0;
+	}
+	for( size_t i=0; i<a.Nodes.size(); i++ ) {
+		EMChargeTree::Node &m = a.Nodes[i];
+		EMChargeTree::Node &n = b.Nodes[i];
+		int same = sameVec( m.Centre, n.Centre ) && m.Half == n.Half && sameVec( m.Pos, n.Pos );
+		same = same && m.Q == n.Q && m.AbsQ == n.AbsQ && sameVec( m.Dipole, n.Dipole ) && m.Radius == n.Radius;
+		same = same && m.First == n.First && m.Count == n.Count && m.Leaf == n.Leaf;
+		same = same && !memcmp( m.Child, n.Child, sizeof(m.Child) );
+		if( !same ) {
+			return 0;
+		}
+	}
+	for( int j=0; j<a.NumCharges; j++ ) {
+		if( !sameVec( a.ChargePos[j], b.ChargePos[j] ) || a.ChargeQ[j] != b.ChargeQ[j] ) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static int verifyTree( double dim ) {
+	// Both sizes are over ParallelCharges, so the pool builds the root's
+	// octants concurrently; the pool has threads even on one core
+	static const int sizes[2] = { 5000, 20000 };
+	static const float thetas[4] = { 0.f, 0.3f, 0.5f, 0.7f };
+	EMWorkPool pool( 4 );
+	int count = 1003;
+	float *p = randomPoints( count, dim );
+	float *block = (float *)malloc( sizeof(float) * 3 * (size_t)count );
+	float *out[3] = { block, &block[count], &block[2*count] };
+
+	int failed = 0;
+	printf( "%-8s %-8s %-8s %-12s %-12s\n", "charges", "nodes", "theta", "pool build", "max error" );
+	for( int si=0; si<2; si++ ) {
+		EMFieldCharges charges;
+		randomCharges( charges, sizes[si], dim );
+		TreeVec3 *pos = (TreeVec3 *)malloc( sizeof(TreeVec3) * charges.count );
+		for( int j=0; j<charges.count; j++ ) {
+			pos[j] = TreeVec3( charges.x[j], charges.y[j], charges.z[j] );
+		}
+
+		EMChargeTree serial, pooled;
+		serial.Build( charges.count, pos, charges.q );
+		pooled.Build( charges.count, pos, charges.q, &pool );
+		int same = sameTree( serial, pooled );
+		failed |= !same;
+
+		for( int ti=0; ti<4; ti++ ) {
+			pooled.Theta = thetas[ti];
+			for( int i=0; i<count; i++ ) {
+				TreeVec3 f = pooled.Field( TreeVec3( p[i], p[count+i], p[2*count+i] ) );
+				out[0][i] = f.x;
+				out[1][i] = f.y;
+				out[2][i] = f.z;
+			}
+			// Relative to sum |q|/r^2 like the coulomb check. Theta 0 leaves
+			// the float direct sum; past that the terms the expansion drops
+			// grow as theta^3, and these charges come in at half the bound
+			double theta = thetas[ti];
+			double tolerance = 1e-5 + 0.1 * theta * theta * theta;
+			double err = coulombError( charges, count, p, out, count );
+			int ok = err <= tolerance;
+			failed |= !ok;
+			printf( "%-8d %-8d %-8g %-12s %-12.3e %s\n", charges.count, (int)pooled.Nodes.size(), thetas[ti], same ? "identical" : "DIFFERS", err, ok && same ? "ok" : "FAIL" );
+		}
+		free( pos );
+	}
+	free( block );
+	free( p );
+	printf( "tree %s\n\n", failed ? "FAILED" : "passed" );
+	return failed;
+}
+
+static uint64_t splitmix64Reference( uint64_t &x ) {
+	// splitmix64.c from the xoshiro authors
+	uint64_t z = ( x += 0x9e3779b97f4a7c15ull );
+	z = ( z ^ ( z >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+	z = ( z ^ ( z >> 27 ) ) * 0x94d049bb133111ebull;
+	return z ^ ( z >> 31 );
+}
+
+static uint32_t xoshiro128PlusReference( uint32_t s[4] ) {
+	// xoshiro128plus.c from the xoshiro authors
+	uint32_t result = s[0] + s[3];
+	uint32_t t = s[1] << 9;
+	s[2] ^= s[0];
+	s[3] ^= s[1];
+	s[1] ^= s[2];
+	s[0] ^= s[3];
+	s[2] ^= t;
+	s[3] = ( s[3] << 11 ) | ( s[3] >> 21 );
+	return result;
+}
+
+static int verifyRandom() {
+	// Each lane must be the reference xoshiro128+ seeded from consecutive
+	// splitmix64 outputs, and a seed must always give the same numbers, so
+	// that the particle runs the benchmarks compare can be repeated
+	int failed = 0;
+	const int outputs = 1000;
+
+	Xoshiro128 gen( 1 );
+	uint32_t s[Xoshiro128::Lanes][4];
+	uint64_t x = 1;
+	for( int l=0; l<Xoshiro128::Lanes; l++ ) {
+		for( int k=0; k<4; k+=2 ) {
+			uint64_t z = splitmix64Reference( x );
+			s[l][k] = (uint32_t)z;
+			s[l][k+1] = (uint32_t)( z >> 32 );
+		}
+	}
+	int mismatches = 0;
+	uint32_t out[Xoshiro128::Lanes];
+	for( int i=0; i<outputs; i++ ) {
+		gen.Next( out );
+		for( int l=0; l<Xoshiro128::Lanes; l++ ) {
+			mismatches += out[l] != xoshiro128PlusReference( s[l] );
+		}
+	}
+	printf( "%-36s %-8d %s\n", "lanes against reference xoshiro128+", mismatches, mismatches ? "FAIL" : "ok" );
+	failed |= mismatches != 0;
+
+	// The first outputs of seed 1, as every build so far has produced them
+	static const uint32_t seed1[Xoshiro128::Lanes] = {
+		0x47edea62u, 0x6cf3dbeeu, 0x944ec1b8u, 0x5d1df7b4u, 0x00c19a36u, 0x9c5323aeu, 0xd35d9f96u, 0x9a0f25bfu
+	};
+	gen.Seed( 1 );
+	gen.Next( out );
+	mismatches = 0;
+	for( int l=0; l<Xoshiro128::Lanes; l++ ) {
+		mismatches += out[l] != seed1[l];
+	}
+	printf( "%-36s %-8d %s\n", "seed 1 against recorded outputs", mismatches, mismatches ? "FAIL" : "ok" );
+	failed |= mismatches != 0;
+
+	// Equal seeds repeat through every call, another seed does not
+	const int n = 1001;
+	float *block = (float *)malloc( sizeof(float) * 8 * n );
+	float *a = block, *b = &block[4*n];
+	Xoshiro128 genA( 12345 ), genB( 12345 ), genC( 12346 );
+	genA.Uniform( a, n, -1.f, 1.f );
+	genA.UnitSphere( &a[n], &a[2*n], &a[3*n], n );
+	genB.Uniform( b, n, -1.f, 1.f );
+	genB.UnitSphere( &b[n], &b[2*n], &b[3*n], n );
+	int differ = memcmp( a, b, sizeof(float) * 4 * n ) != 0;
+	differ |= genA.Uniform() != genB.Uniform();
+	genC.Uniform( b, n, -1.f, 1.f );
+	int same = memcmp( a, b, sizeof(float) * n ) == 0;
+	printf( "%-36s %-8s %s\n", "same seed repeats", differ ? "no" : "yes", differ ? "FAIL" : "ok" );
+	printf( "%-36s %-8s %s\n", "next seed differs", same ? "no" : "yes", same ? "FAIL" : "ok" );
+	failed |= differ | same;
+
+	// The sphere's polynomial sine and cosine keep points on it
+	double radiusErr = 0.0;
+	double mean[3] = { 0.0, 0.0, 0.0 };
+	for( int i=0; i<n; i++ ) {
+		double px = a[n+i], py = a[2*n+i], pz = a[3*n+i];
+		radiusErr = worse( radiusErr, fabs( sqrt( px*px + py*py + pz*pz ) - 1.0 ) );
+		mean[0] += px / n;
+		mean[1] += py / n;
+		mean[2] += pz / n;
+	}
+	double meanErr = sqrt( mean[0]*mean[0] + mean[1]*mean[1] + mean[2]*mean[2] );
+	int radiusOk = radiusErr <= 1e-6;
+	int meanOk = meanErr <= 0.1;
+	printf( "%-36s %-8.1e %s\n", "sphere radius error", radiusErr, radiusOk ? "ok" : "FAIL" );
+	printf( "%-36s %-8.1e %s\n", "sphere mean", meanErr, meanOk ? "ok" : "FAIL" );
+	failed |= !radiusOk | !meanOk;
+	free( block );
+
+	printf( "random %s\n\n", failed ? "FAILED" : "passed" );
+	return failed;
+}
+
+static int verify( EMFieldGrid &grid ) {
+	EMFieldSampler ref;
+	ref.setGrid( grid );
+	EMFieldSampler samplerD;
+	samplerD.setGrid( grid );
+	EMFieldSamplerF samplerF;
+	samplerF.setGrid( grid );
+
+	int failed = verifySampler( samplerD, ref, "double", 1e-11 );
+	failed |= verifySampler( samplerF, ref, "float", 1e-5 );
+
+	// An odd resolution over these symmetric bounds puts a sample on the
+	// dipole at the origin, which must come out as zeros and not NaN
+	printf( "odd resolution\n" );
+	EMFieldGrid odd( grid.lo, grid.hi, 17, 17, 17 );
+	ref.setGrid( odd );
+	samplerD.setGrid( odd );
+	samplerF.setGrid( odd );
+	failed |= verifySampler( samplerD, ref, "double", 1e-11 );
+	failed |= verifySampler( samplerF, ref, "float", 1e-5 );
+	ref.setGrid( grid );
+	samplerD.setGrid( grid );
+	samplerF.setGrid( grid );
+
+	// Superposition against the per-source local frame reference
+	printf( "sources\n" );
+	EMFieldSources sources;
+	randomSources( sources, 37, grid.hi.x - grid.lo.x );
+	ref.sources = &sources;
+	samplerD.sources = &sources;
+	samplerF.sources = &sources;
+	// Float sums of many sources can cancel, so allow it a little more
+	failed |= verifySampler( samplerD, ref, "double", 1e-11 );
+	failed |= verifySampler( samplerF, ref, "float", 5e-5 );
+
+	printf( "multipole\n" );
+	emfieldIsaSet( emfieldIsaDetect() );
+	ref.sources = 0;
+	samplerD.sources = 0;
+	samplerF.sources = 0;
+	failed |= verifyMultipole( samplerD, ref, "double", 1e-5 );
+	failed |= verifyMultipole( samplerF, ref, "float", 5e-5 );
+
+	printf( "coulomb\n" );
+	failed |= verifyCoulomb( grid.hi.x - grid.lo.x, 1e-5 );
+
+	printf( "tree\n" );
+	failed |= verifyTree( grid.hi.x - grid.lo.x );
+
+	printf( "random\n" );
+	failed |= verifyRandom();
+	return failed ? 1 : 0;
+}
+
+template< class T >
+static double timeEvals( EMFieldSamplerT<T> &sampler, int mode, int iters, double dt ) {
+	double t = 0.0;
+	double start = nowSeconds();
+	for( int i=0; i<iters; i++ ) {
+		switch( mode ) {
+			case 0: sampler.sample( t ); break;
+			case 1: sampler.sampleDirect( t ); break;
+			case 2: sampler.sampleReference( t ); break;
+			case 3: sampler.step( dt ); break;
+		}
+		t += dt;
+	}
+	return nowSeconds() - start;
+}
+
+template< class T >
+static int scaling( EMFieldSamplerT<T> &sampler, int mode, int iters, double dt, int maxThreads ) {
+	if( maxThreads <= 0 ) {
+		maxThreads = EMWorkPool::hardwareThreads();
+	}
+	EMWorkPool pool( 1 );
+	sampler.pool = &pool;
+
+	sampler.sample( 0.0 );
+	timeEvals( sampler, mode, 1, dt );
+	T *ref = 0;
+	double base = 0.0;
+	int mismatch = 0;
+
+	printf( "%-8s %-12s %-10s %-10s %s\n", "threads", "per eval ms", "speedup", "effic", "output" );
+	for( int n=1; ; n = n*2 < maxThreads ? n*2 : maxThreads ) {
+		pool.setThreadCount( n );
+		double perEval = timeEvals( sampler, mode, iters, dt ) / (double)iters;
+		int same = 1;
+		if( !ref ) {
+			ref = copyE( sampler );
+			base = perEval;
+		}
+		else {
+			T *got = copyE( sampler );
+			same = !memcmp( got, ref, sizeof(T) * 6 * sampler.count );
+			free( got );
+		}
+		mismatch |= !same;
+		printf( "%-8d %-12.3f %-10.2f %-10.2f %s\n", n, perEval * 1000.0, base / perEval, base / perEval / (double)n, same ? "identical" : "DIFFERS" );
+		if( n >= maxThreads ) {
+			break;
+		}
+	}
+	free( ref );
+	sampler.pool = 0;
+	return mismatch ? 1 : 0;
+}
+
+struct BenchArgs {
+	int res;
+	int iters;
+	double dt;
+	int mode;
+	int unit;
+	int threads;
+	int threadsGiven;
+	int doScaling;
+	int resync;
+	int numSources;
+	int cloud;
+	double multipoleTol;
+	int magnetic;
+	int derived;
+};
+
+static void makeSources( EMFieldSources &sources, int n, EMFieldGrid &grid, int cloud ) {
+	if( cloud ) {
+		cloudSources( sources, n, cloudCenter( grid ), 2.0 );
+	}
+	else {
+		makeArray( sources, n, grid );
+	}
+}
+
+template< class T >
+static int sourceScaling( EMFieldSamplerT<T> &sampler, EMFieldGrid &grid, BenchArgs &args ) {
+	EMFieldSources sources;
+	EMFieldMultipole multipole;
+	multipole.tolerance = args.multipoleTol;
+	EMFieldSampler direct;
+	direct.setGrid( grid );
+	direct.sources = &sources;
+	sampler.setGrid( grid );
+	sampler.sources = &sources;
+	int iters = args.iters;
+	if( args.multipoleTol > 0.0 ) {
+		printf( "%-8s %-12s %-12s %-10s %-12s %-12s %-10s %s\n", "sources", "per eval ms", "Mpairs/s", "ns/pair", "build ms", "multipole ms", "speedup", "max error" );
+	}
+	else {
+		printf( "%-8s %-12s %-12s %s\n", "sources", "per eval ms", "Mpairs/s", "ns/pair" );
+	}
+	for( int n=1; n<=10000; n*=10 ) {
+		makeSources( sources, n, grid, args.cloud );
+		sampler.multipole = 0;
+		sampler.sampleDirect( 0.0 );
+		double start = nowSeconds();
+		for( int i=0; i<iters; i++ ) {
+			sampler.sampleDirect( 0.016 * i );
+		}
+		double perEval = ( nowSeconds() - start ) / (double)iters;
+		double pairs = (double)n * (double)sampler.count;
+		if( args.multipoleTol <= 0.0 ) {
+			printf( "%-8d %-12.3f %-12.2f %.3f\n", n, perEval * 1000.0, pairs / perEval / 1e6, perEval / pairs * 1e9 );
+			continue;
+		}
+
+		sampler.multipole = &multipole;
+		start = nowSeconds();
+		multipole.build( sources, sampler.omega, sampler.beta, sampler.magnetic );
+		double build = nowSeconds() - start;
+		start = nowSeconds();
+		for( int i=0; i<iters; i++ ) {
+			sampler.sampleDirect( 0.016 * i );
+		}
+		double perEvalM = ( nowSeconds() - start ) / (double)iters;
+		direct.sampleDirect( 0.016 * ( iters - 1 ) );
+		double err = maxRelativeError( sampler, direct );
+		printf( "%-8d %-12.3f %-12.2f %-10.3f %-12.3f %-12.3f %-10.2f %.3e\n", n, perEval * 1000.0, pairs / perEval / 1e6, perEval / pairs * 1e9, build * 1000.0, perEvalM * 1000.0, perEval / perEvalM, err );
+	}
+	sampler.sources = 0;
+	sampler.multipole = 0;
+	return 0;
+}
+
+template< class T >
+static int bench( EMFieldSamplerT<T> &sampler, EMFieldGrid &grid, BenchArgs &args ) {
+	EMFieldSources sources;
+	EMFieldMultipole multipole;
+	if( args.numSources > 0 ) {
+		makeSources( sources, args.numSources, grid, args.cloud );
+		sampler.sources = &sources;
+		if( args.multipoleTol > 0.0 ) {
+			multipole.tolerance = args.multipoleTol;
+			sampler.multipole = &multipole;
+		}
+	}
+	sampler.setGrid( grid );
+	sampler.unitAmplitude = args.unit;
+	sampler.magnetic = args.magnetic;
+	sampler.derived = args.derived;
+	sampler.resyncSteps = args.resync;
+
+	if( args.doScaling ) {
+		return scaling( sampler, args.mode, args.iters, args.dt, args.threadsGiven ? args.threads : 0 );
+	}
+
+	EMWorkPool pool( args.threads );
+	if( pool.threadCount() > 1 ) {
+		sampler.pool = &pool;
+	}
+
+	// The first pass builds the phasor cache; time it on its own
+	double start = nowSeconds();
+	sampler.sample( 0.0 );
+	double cacheBuild = nowSeconds() - start;
+
+	double elapsed = timeEvals( sampler, args.mode, args.iters, args.dt );
+	sampler.pool = 0;
+
+	const char *modeNames[] = { "phasor cache", "direct", "reference", "incremental step" };
+	double perEval = elapsed / (double)args.iters;
+	printf( "mode        %s\n", modeNames[args.mode] );
+	printf( "precision   %s\n", sizeof(T) == sizeof(float) ? "float" : "double" );
+	printf( "fields      %s\n", sampler.derived ? "E, H, S and u" : sampler.magnetic ? "E and H" : "E" );
+	printf( "isa         %s\n", emfieldIsaName( emfieldIsaGet() ) );
+	printf( "threads     %d\n", pool.threadCount() );
+	printf( "points      %d (%d^3)\n", sampler.count, args.res );
+	printf( "sources     %d\n", sampler.sources ? sampler.sources->count : 1 );
+	printf( "cache build %.3f ms\n", cacheBuild * 1000.0 );
+	printf( "iterations  %d\n", args.iters );
+	printf( "total       %.3f ms\n", elapsed * 1000.0 );
+	printf( "per eval    %.3f ms\n", perEval * 1000.0 );
+	printf( "throughput  %.2f Mpoints/s\n", (double)sampler.count / perEval / 1e6 );
+	printf( "checksum    %.9g\n", checksum( sampler ) );
+	if( sampler.multipole ) {
+		printf( "clusters    %d (tolerance %g)\n", multipole.numClusters, multipole.tolerance );
+	}
+	sampler.sources = 0;
+	sampler.multipole = 0;
+	return 0;
+}
+
+static int coulombBench( int numCharges, int count, double dim, BenchArgs &args ) {
+	EMFieldCharges charges;
+	randomCharges( charges, numCharges, dim );
+	float *p = randomPoints( count, dim );
+	float *block = (float *)malloc( sizeof(float) * 3 * (size_t)count );
+	float *out[3] = { block, &block[count], &block[2*count] };
+	EMWorkPool pool( args.threads );
+
+	// One untimed pass to wake the pool and fault in the output
+	emfieldCoulomb( &pool, count, p, &p[count], &p[2*count], charges, out );
+	double start = nowSeconds();
+	for( int i=0; i<args.iters; i++ ) {
+		emfieldCoulomb( &pool, count, p, &p[count], &p[2*count], charges, out );
+	}
+	double perEval = ( nowSeconds() - start ) / (double)args.iters;
+	double pairs = (double)numCharges * (double)count;
+
+	printf( "isa         %s\n", emfieldIsaName( emfieldIsaGet() ) );
+	printf( "threads     %d\n", pool.threadCount() );
+	printf( "charges     %d\n", numCharges );
+	printf( "points      %d\n", count );
+	printf( "iterations  %d\n", args.iters );
+	printf( "per eval ms %.3f\n", perEval * 1000.0 );
+	printf( "Gpairs/s    %.2f\n", pairs / perEval / 1e9 );
+	printf( "max error   %.3e\n", coulombError( charges, count, p, out, 256 ) );
+	free( block );
+	free( p );
+	return 0;
+}
+
+int main( int argc, char **argv ) {
+	BenchArgs args;
+	args.res = 16;
+	args.iters = 100;
+	args.dt = 0.016;
+	args.mode = 0;
+	args.unit = 0;
+	args.threads = 1;
+	args.threadsGiven = 0;
+	args.doScaling = 0;
+	args.resync = 256;
+	args.numSources = 0;
+	args.cloud = 0;
+	args.multipoleTol = 0.0;
+	args.magnetic = 0;
+	args.derived = 0;
+	double dim = 15.0;
+	int isa = -1;
+	int doVerify = 0;
+	int useFloat = 0;
+	int doSourceScaling = 0;
+	int numCharges = 0;
+	int numPoints = 0;
+
+	for( int i=1; i<argc; i++ ) {
+		if( !strcmp( argv[i], "-res" ) && i+1 < argc ) {
+			args.res = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-dim" ) && i+1 < argc ) {
+			dim = atof( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-iters" ) && i+1 < argc ) {
+			args.iters = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-dt" ) && i+1 < argc ) {
+			args.dt = atof( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-direct" ) ) {
+			args.mode = 1;
+		}
+		else if( !strcmp( argv[i], "-reference" ) ) {
+			args.mode = 2;
+		}
+		else if( !strcmp( argv[i], "-step" ) ) {
+			args.mode = 3;
+		}
+		else if( !strcmp( argv[i], "-resync" ) && i+1 < argc ) {
+			args.resync = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-sources" ) && i+1 < argc ) {
+			args.numSources = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-cloud" ) ) {
+			args.cloud = 1;
+		}
+		else if( !strcmp( argv[i], "-multipole" ) && i+1 < argc ) {
+			args.multipoleTol = atof( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-sourcescaling" ) ) {
+			doSourceScaling = 1;
+		}
+		else if( !strcmp( argv[i], "-float" ) ) {
+			useFloat = 1;
+		}
+		else if( !strcmp( argv[i], "-isa" ) && i+1 < argc ) {
+			i++;
+			for( int k=0; k<EMFIELD_ISA_COUNT; k++ ) {
+				if( !strcmp( argv[i], emfieldIsaName( k ) ) ) {
+					isa = k;
+				}
+			}
+			if( isa < 0 ) {
+				fprintf( stderr, "unknown isa %s\n", argv[i] );
+				return 1;
+			}
+		}
+		else if( !strcmp( argv[i], "-unit" ) ) {
+			args.unit = 1;
+		}
+		else if( !strcmp( argv[i], "-magnetic" ) ) {
+			args.magnetic = 1;
+		}
+		else if( !strcmp( argv[i], "-derived" ) ) {
+			args.derived = 1;
+		}
+		else if( !strcmp( argv[i], "-verify" ) ) {
+			doVerify = 1;
+		}
+		else if( !strcmp( argv[i], "-threads" ) && i+1 < argc ) {
+			args.threads = atoi( argv[++i] );
+			args.threadsGiven = 1;
+		}
+		else if( !strcmp( argv[i], "-scaling" ) ) {
+			args.doScaling = 1;
+		}
+		else if( !strcmp( argv[i], "-coulomb" ) && i+2 < argc ) {
+			numCharges = atoi( argv[++i] );
+			numPoints = atoi( argv[++i] );
+		}
+		else {
+			fprintf( stderr, "usage: %s [-res n] [-dim d] [-iters n] [-dt s] [-direct|-reference|-step] [-resync n] [-float] [-sources n] [-cloud] [-multipole tol] [-sourcescaling] [-isa name] [-unit] [-magnetic] [-derived] [-verify] [-threads n] [-scaling] [-coulomb c p]\n", argv[0] );
+			return 1;
+		}
+	}
+	if( args.res < 1 || args.iters < 1 ) {
+		fprintf( stderr, "res and iters must be positive\n" );
+		return 1;
+	}
+
+	EMFieldGrid grid( DVec3( -dim/2.0, -dim/2.0, -dim/2.0 ), DVec3( dim/2.0, dim/2.0, dim/2.0 ), args.res, args.res, args.res );
+
+	if( doVerify ) {
+		return verify( grid );
+	}
+
+	if( isa >= 0 && emfieldIsaSet( isa ) != isa ) {
+		fprintf( stderr, "isa %s is not supported here, using %s\n", emfieldIsaName( isa ), emfieldIsaName( emfieldIsaGet() ) );
+	}
+
+	if( numCharges > 0 && numPoints > 0 ) {
+		return coulombBench( numCharges, numPoints, dim, args );
+	}
+
+	if( doSourceScaling ) {
+		if( useFloat ) {
+			EMFieldSamplerF sampler;
+			return sourceScaling( sampler, grid, args );
+		}
+		EMFieldSampler sampler;
+		return sourceScaling( sampler, grid, args );
+	}
+
+	if( useFloat ) {
+		EMFieldSamplerF sampler;
+		return bench( sampler, grid, args );
+	}
+	EMFieldSampler sampler;
+	return bench( sampler, grid, args );
+}
@@ -0,0 +1,688 @@
+// @ZBS {
+//		*MODULE_OWNER_NAME emfield
+// }
+
+// Lane-generic dipole kernel shared by the scalar and SIMD builds of emfield.
+// Each ISA translation unit defines a lane type with the small set of
+// operations used below and instantiates emfieldDipoleBlock and
+// emfieldSourcesBlock with it.
+// Outputs are the twelve channels eRe.xyz, eIm.xyz, hRe.xyz, hIm.xyz. The
+// H half is only written when magnetic is set; it is built from the same
+// distances, angles and phase as E so it costs a fraction of a second pass.
+// emfieldDerivedBlock forms the Poynting vector and energy density from
+// those channels. emfieldCoulombBlock is the odd one out: the static field
+// of point charges in float, for the particle tools.
+// Everything here is trig-free except for the phase, which goes through
+// a polynomial sincos so that it vectorizes. Lanes come in a double and a
+// float flavour; V::Real picks the matching sincos and the scalar tail.
+//
+// A lane type V must provide:
+//		V::Width, V::Mask, V::Real
+//		V(double) broadcast, V::load, vstore
+//		+ - * / operators
+//		vsqrt, vround (to nearest), vfloor
+//		vcmpeq -> V::Mask, vor on masks, vselect( mask, ifTrue, ifFalse )
+// and float lanes also vrsqrt, an estimate of 1/sqrt good to at least 11 bits
+// that emfieldCoulombBlock refines with one Newton step.
+
+#ifndef EMFIELDKERNEL_H
+#define EMFIELDKERNEL_H
+
+#include "math.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+	#define EMFIELD_X86
+#endif
+#if !defined(EMFIELD_X86) || ( defined(_MSC_VER) && _MSC_VER < 1910 )
+	#ifndef EMFIELD_NO_AVX512
+		#define EMFIELD_NO_AVX512
+	#endif
+#endif
+
+// Everything below is compiled once per ISA translation unit with different
+// target flags. The anonymous namespace keeps each copy local to its unit so
+// the linker can never hand an AVX build of a helper to the scalar path.
+namespace {
+
+template< class T >
+struct EMLaneScalarT {
+	enum { Width = 1 };
+	typedef int Mask;
+	typedef T Real;
+	T v;
+	EMLaneScalarT() {}
+	EMLaneScalarT( double _v ) { v = (T)_v; }
+	static EMLaneScalarT load( const T *p ) { return EMLaneScalarT( *p ); }
+};
+
+typedef EMLaneScalarT<double> EMLaneScalar;
+typedef EMLaneScalarT<float> EMLaneScalarF;
+
+template< class T > inline void vstore( T *p, EMLaneScalarT<T> a ) { *p = a.v; }
+template< class T > inline EMLaneScalarT<T> operator + ( EMLaneScalarT<T> a, EMLaneScalarT<T> b ) { return EMLaneScalarT<T>( a.v + b.v ); }
+template< class T > inline EMLaneScalarT<T> operator - ( EMLaneScalarT<T> a, EMLaneScalarT<T> b ) { return EMLaneScalarT<T>( a.v - b.v ); }
+template< class T > inline EMLaneScalarT<T> operator * ( EMLaneScalarT<T> a, EMLaneScalarT<T> b ) { return EMLaneScalarT<T>( a.v * b.v ); }
+template< class T > inline EMLaneScalarT<T> operator / ( EMLaneScalarT<T> a, EMLaneScalarT<T> b ) { return EMLaneScalarT<T>( a.v / b.v ); }
+template< class T > inline EMLaneScalarT<T> vsqrt( EMLaneScalarT<T> a ) { return EMLaneScalarT<T>( sqrt( a.v ) ); }
+template< class T > inline EMLaneScalarT<T> vround( EMLaneScalarT<T> a ) { return EMLaneScalarT<T>( floor( a.v + (T)0.5 ) ); }
+template< class T > inline EMLaneScalarT<T> vfloor( EMLaneScalarT<T> a ) { return EMLaneScalarT<T>( floor( a.v ) ); }
+template< class T > inline int vcmpeq( EMLaneScalarT<T> a, EMLaneScalarT<T> b ) { return a.v == b.v; }
+inline int vor( int a, int b ) { return a || b; }
+template< class T > inline EMLaneScalarT<T> vselect( int m, EMLaneScalarT<T> a, EMLaneScalarT<T> b ) { return m ? a : b; }
+template< class T > inline EMLaneScalarT<T> vrsqrt( EMLaneScalarT<T> a ) { return EMLaneScalarT<T>( (T)1 / sqrt( a.v ) ); }
+
+template< class V >
+inline void emfieldSinCosQuadrant( V q, V sr, V cr, V &s, V &c ) {
+	// Quadrant in 0..3 kept in floating point so no integer lanes are needed
+	V quad = q - V( 4.0 ) * vfloor( q * V( 0.25 ) );
+	typename V::Mask q1 = vcmpeq( quad, V( 1.0 ) );
+	typename V::Mask q2 = vcmpeq( quad, V( 2.0 ) );
+	typename V::Mask q3 = vcmpeq( quad, V( 3.0 ) );
+	typename V::Mask swap = vor( q1, q3 );
+	V zero( 0.0 );
+	V ss = vselect( swap, cr, sr );
+	V cc = vselect( swap, sr, cr );
+	s = vselect( vor( q2, q3 ), zero - ss, ss );
+	c = vselect( vor( q1, q2 ), zero - cc, cc );
+}
+
+template< class V >
+inline void emfieldSinCos( V x, V &s, V &c, double ) {
+	// Cody-Waite reduction by pi/2 followed by the cephes minimax polynomials
+	// on [-pi/4, pi/4]. Good to a few ulp for |x| well beyond 1e5.
+	V q = vround( x * V( 0.63661977236758134308 ) );
+	V r = x - q * V( 1.57079632673412561417e+00 );
+	r = r - q * V( 6.07710050630396597660e-11 );
+	r = r - q * V( 2.02226624879595063154e-21 );
+
+	V z = r * r;
+	V ps = V( 1.58962301576546568060e-10 );
+	ps = ps * z + V( -2.50507477628578072866e-8 );
+	ps = ps * z + V( 2.75573136213857245213e-6 );
+	ps = ps * z + V( -1.98412698295895385996e-4 );
+	ps = ps * z + V( 8.33333333332211858878e-3 );
+	ps = ps * z + V( -1.66666666666666307295e-1 );
+	V sr = r + r * z * ps;
+
+	V pc = V( -1.13585365213876817300e-11 );
+	pc = pc * z + V( 2.08757008419747316778e-9 );
+	pc = pc * z + V( -2.75573141792967388112e-7 );
+	pc = pc * z + V( 2.48015872888517045348e-5 );
+	pc = pc * z + V( -1.38888888888730564116e-3 );
+	pc = pc * z + V( 4.16666666666665929218e-2 );
+	V cr = V( 1.0 ) - V( 0.5 ) * z + z * z * pc;
+
+	emfieldSinCosQuadrant( q, sr, cr, s, c );
+}
+
+template< class V >
+inline void emfieldSinCos( V x, V &s, V &c, float ) {
+	// The cephes sinf/cosf polynomials with a three part pi/2 whose leading
+	// parts are exact in float. Only meant for the small phases the float
+	// kernels see; emfieldDipoleKernel() reduces omega*t in double first.
+	V q = vround( x * V( 0.63661977236758134308 ) );
+	V r = x - q * V( 1.5703125 );
+	r = r - q * V( 4.837512969970703125e-4 );
+	r = r - q * V( 7.54978995489188216e-8 );
+
+	V z = r * r;
+	V ps = V( -1.9515295891e-4 );
+	ps = ps * z + V( 8.3321608736e-3 );
+	ps = ps * z + V( -1.6666654611e-1 );
+	V sr = r + r * z * ps;
+
+	V pc = V( 2.443315711809948e-5 );
+	pc = pc * z + V( -1.388731625493765e-3 );
+	pc = pc * z + V( 4.166664568298827e-2 );
+	V cr = V( 1.0 ) - V( 0.5 ) * z + z * z * pc;
+
+	emfieldSinCosQuadrant( q, sr, cr, s, c );
+}
+
+template< class V, int Magnetic >
+inline void emfieldDipoleLanes( V x, V y, V z, double omega, double beta, double phase, int unitAmplitude, V e[12] ) {
+	// Same math as emfieldDipoleReference() but with theta and phi replaced by
+	// their direction cosines. phi is atan2(x,y) there so sin(phi) = x/rho.
+	// phase is omega*t, possibly already reduced by whole turns. A point on
+	// the dipole itself gets zeros rather than the inf/NaN of 1/r.
+	V zero( 0.0 );
+	V one( 1.0 );
+	V rho = vsqrt( x*x + y*y );
+	V r = vsqrt( x*x + y*y + z*z );
+	typename V::Mask atDipole = vcmpeq( r, zero );
+	V invR = one / vselect( atDipole, one, r );
+	V ct = z * invR;
+	V st = rho * invR;
+	typename V::Mask onAxis = vcmpeq( rho, zero );
+	V invRho = one / vselect( onAxis, one, rho );
+	V sp = vselect( onAxis, zero, x * invRho );
+	V cp = vselect( onAxis, one, y * invRho );
+
+	V rRe, rIm, tRe, tIm, pRe, pIm;
+	if( unitAmplitude ) {
+		rRe = zero;
+		rIm = zero;
+		tRe = one;
+		tIm = zero;
+		pRe = one;
+		pIm = zero;
+	}
+	else {
+		V invR2 = invR * invR;
+		V invR3 = invR2 * invR;
+		rRe = V( 2.0 * omega / beta ) * invR2 * ct;
+		rIm = V( -2.0 * omega / (beta*beta) ) * invR3 * ct;
+		tRe = V( omega / beta ) * invR2 * st;
+		tIm = ( V( omega ) * invR - V( omega / (beta*beta) ) * invR3 ) * st;
+		// H phi shares its real part with E theta
+		pRe = tRe;
+		pIm = V( omega ) * invR * st;
+	}
+
+	V s, c;
+	emfieldSinCos( V( phase ) - V( beta ) * r, s, c, (typename V::Real)0 );
+	V rReal = rRe * c - rIm * s;
+	V rImag = rIm * c + rRe * s;
+	V tReal = tRe * c - tIm * s;
+	V tImag = tIm * c + tRe * s;
+
+	// rectToSphereUnitVectors(theta,phi).mul() with a zero phi component
+	V stcp = st * cp;
+	V stsp = st * sp;
+	V ctcp = ct * cp;
+	V ctsp = ct * sp;
+	e[0] = rReal * stcp + tReal * stsp;
+	e[1] = rReal * ctcp + tReal * ctsp;
+	e[2] = tReal * cp - rReal * sp;
+	e[3] = rImag * stcp + tImag * stsp;
+	e[4] = rImag * ctcp + tImag * ctsp;
+	e[5] = tImag * cp - rImag * sp;
+
+	if( Magnetic ) {
+		// H is all phi, and the phi column of that matrix is (ct, -st, 0)
+		V pReal = pRe * c - pIm * s;
+		V pImag = pIm * c + pRe * s;
+		e[6] = pReal * ct;
+		e[7] = zero - pReal * st;
+		e[8] = zero;
+		e[9] = pImag * ct;
+		e[10] = zero - pImag * st;
+		e[11] = zero;
+	}
+	for( int k=0; k<( Magnetic ? 12 : 6 ); k++ ) {
+		e[k] = vselect( atDipole, zero, e[k] );
+	}
+}
+
+template< class V, int Magnetic >
+void emfieldDipoleBlockT( int count, const typename V::Real *px, const typename V::Real *py, const typename V::Real *pz, double omega, double beta, double phase, int unitAmplitude, typename V::Real *out[12] ) {
+	typedef EMLaneScalarT<typename V::Real> Tail;
+	const int channels = Magnetic ? 12 : 6;
+	int i = 0;
+	V e[12];
+	for( ; i + V::Width <= count; i += V::Width ) {
+		emfieldDipoleLanes<V,Magnetic>( V::load( &px[i] ), V::load( &py[i] ), V::load( &pz[i] ), omega, beta, phase, unitAmplitude, e );
+		for( int k=0; k<channels; k++ ) {
+			vstore( &out[k][i], e[k] );
+		}
+	}
+
+	// Remainder one point at a time with the same math
+	Tail es[12];
+	for( ; i < count; i++ ) {
+		emfieldDipoleLanes<Tail,Magnetic>( Tail( px[i] ), Tail( py[i] ), Tail( pz[i] ), omega, beta, phase, unitAmplitude, es );
+		for( int k=0; k<channels; k++ ) {
+			out[k][i] = es[k].v;
+		}
+	}
+}
+
+template< class V >
+void emfieldDipoleBlock( int count, const typename V::Real *px, const typename V::Real *py, const typename V::Real *pz, double omega, double beta, double phase, int unitAmplitude, int magnetic, typename V::Real *out[12] ) {
+	if( magnetic ) {
+		emfieldDipoleBlockT<V,1>( count, px, py, pz, omega, beta, phase, unitAmplitude, out );
+	}
+	else {
+		emfieldDipoleBlockT<V,0>( count, px, py, pz, omega, beta, phase, unitAmplitude, out );
+	}
+}
+
+template< class V, int Magnetic >
+inline void emfieldSourceLanes( V x, V y, V z, const double *src[8], int j, double omega, double beta, double phase, V acc[12] ) {
+	// Adds source j to the six accumulators. src holds the EMFieldSources
+	// streams x, y, z, nx, ny, nz, aRe, aIm. This is the textbook Hertzian
+	// dipole: with d the offset from the source, n its unit axis and
+	// cos(theta) = n.d/r, the theta unit vector times sin(theta) is
+	// cos(theta) d/r - n, so E = cos(theta) (Er + Et) d/r - Et n with no
+	// division by sin(theta) and no special case on the axis. Likewise the
+	// phi unit vector times sin(theta) is n x d/r, so H = Hphi n x d/r.
+	V zero( 0.0 );
+	V sx( src[3][j] ), sy( src[4][j] ), sz( src[5][j] );
+	V dx = x - V( src[0][j] );
+	V dy = y - V( src[1][j] );
+	V dz = z - V( src[2][j] );
+	V r = vsqrt( dx*dx + dy*dy + dz*dz );
+	V invR = V( 1.0 ) / r;
+	V invR2 = invR * invR;
+	V invR3 = invR2 * invR;
+	V ct = ( dx*sx + dy*sy + dz*sz ) * invR;
+
+	V tRe = V( omega / beta ) * invR2;
+	V tIm = V( omega ) * invR - V( omega / (beta*beta) ) * invR3;
+	V rRe = V( 2.0 * omega / beta ) * invR2;
+	V rIm = V( -2.0 * omega / (beta*beta) ) * invR3;
+
+	// Source amplitude and phase times e^(i (phase - beta r))
+	V s, c;
+	emfieldSinCos( V( phase ) - V( beta ) * r, s, c, (typename V::Real)0 );
+	V aRe( src[6][j] ), aIm( src[7][j] );
+	V wRe = aRe * c - aIm * s;
+	V wIm = aRe * s + aIm * c;
+
+	V ctr = ct * invR;
+	V qRe = ctr * ( rRe + tRe );
+	V qIm = ctr * ( rIm + tIm );
+	V kRe = qRe * wRe - qIm * wIm;
+	V kIm = qRe * wIm + qIm * wRe;
+	V mRe = zero - ( tRe * wRe - tIm * wIm );
+	V mIm = zero - ( tRe * wIm + tIm * wRe );
+
+	acc[0] = acc[0] + kRe * dx + mRe * sx;
+	acc[1] = acc[1] + kRe * dy + mRe * sy;
+	acc[2] = acc[2] + kRe * dz + mRe * sz;
+	acc[3] = acc[3] + kIm * dx + mIm * sx;
+	acc[4] = acc[4] + kIm * dy + mIm * sy;
+	acc[5] = acc[5] + kIm * dz + mIm * sz;
+
+	if( Magnetic ) {
+		// Hphi / sin(theta) = omega/(beta r^2) + i omega/r, with the 1/r of n x d/r folded in
+		V hRe = tRe * invR;
+		V hIm = V( omega ) * invR2;
+		V gRe = hRe * wRe - hIm * wIm;
+		V gIm = hRe * wIm + hIm * wRe;
+		V cx = sy * dz - sz * dy;
+		V cy = sz * dx - sx * dz;
+		V cz = sx * dy - sy * dx;
+		acc[6] = acc[6] + gRe * cx;
+		acc[7] = acc[7] + gRe * cy;
+		acc[8] = acc[8] + gRe * cz;
+		acc[9] = acc[9] + gIm * cx;
+		acc[10] = acc[10] + gIm * cy;
+		acc[11] = acc[11] + gIm * cz;
+	}
+}
+
+#define EMFIELD_SOURCE_TILE (256)
+	// Sources per pass over a brick. 256 sources of 8 doubles is 16KB so a
+	// tile stays in L1 while every lane of points in the brick walks it.
+
+template< class V, int Magnetic >
+void emfieldSourcesBlockT( int count, const typename V::Real *px, const typename V::Real *py, const typename V::Real *pz, int numSources, const double *src[8], double omega, double beta, double phase, typename V::Real *out[12] ) {
+	// Lanes are grid points and each source is broadcast, so even a single
+	// source fills every lane and no horizontal sums are needed. Sources are
+	// walked in tiles and the partial sums carried in out between tiles.
+	typedef typename V::Real Real;
+	typedef EMLaneScalarT<Real> Tail;
+	const int channels = Magnetic ? 12 : 6;
+	for( int k=0; k<channels; k++ ) {
+		for( int i=0; i<count; i++ ) {
+			out[k][i] = (Real)0;
+		}
+	}
+
+	for( int j0=0; j0<numSources; j0+=EMFIELD_SOURCE_TILE ) {
+		int j1 = j0 + EMFIELD_SOURCE_TILE < numSources ? j0 + EMFIELD_SOURCE_TILE : numSources;
+		int i = 0;
+		for( ; i + V::Width <= count; i += V::Width ) {
+			V x = V::load( &px[i] );
+			V y = V::load( &py[i] );
+			V z = V::load( &pz[i] );
+			V acc[12];
+			for( int k=0; k<channels; k++ ) {
+				acc[k] = V::load( &out[k][i] );
+			}
+			for( int j=j0; j<j1; j++ ) {
+				emfieldSourceLanes<V,Magnetic>( x, y, z, src, j, omega, beta, phase, acc );
+			}
+			for( int k=0; k<channels; k++ ) {
+				vstore( &out[k][i], acc[k] );
+			}
+		}
+
+		for( ; i < count; i++ ) {
+			Tail acc[12];
+			for( int k=0; k<channels; k++ ) {
+				acc[k] = Tail( out[k][i] );
+			}
+			for( int j=j0; j<j1; j++ ) {
+				emfieldSourceLanes<Tail,Magnetic>( Tail( px[i] ), Tail( py[i] ), Tail( pz[i] ), src, j, omega, beta, phase, acc );
+			}
+			for( int k=0; k<channels; k++ ) {
+				out[k][i] = acc[k].v;
+			}
+		}
+	}
+}
+
+template< class V >
+void emfieldSourcesBlock( int count, const typename V::Real *px, const typename V::Real *py, const typename V::Real *pz, int numSources, const double *src[8], double omega, double beta, double phase, int magnetic, typename V::Real *out[12] ) {
+	if( magnetic ) {
+		emfieldSourcesBlockT<V,1>( count, px, py, pz, numSources, src, omega, beta, phase, out );
+	}
+	else {
+		emfieldSourcesBlockT<V,0>( count, px, py, pz, numSources, src, omega, beta, phase, out );
+	}
+}
+
+
+#define EMFIELD_MULTIPOLE_MAX_ORDER (48)
+
+template< class V, int Channels >
+inline void emfieldMultipoleLanes( V x, V y, V z, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, V acc[12] ) {
+	// Adds the outgoing expansion of one source cluster. Every cartesian
+	// component of E is a radiating solution of the Helmholtz equation outside
+	// the cluster, so each is sum_nm c_nm h_n(kr) Y_nm with h_n the spherical
+	// Hankel function of the second kind (the kernel's e^(-i beta r)) and Y_nm
+	// real orthonormal harmonics. H components are radiating solutions too.
+	// coef holds the Channels (6 for E, 12 for E and H) components of c_nm
+	// at n*n+n+m, invH holds 1/h_n(kR) for the fitting radius R, and ab the
+	// Legendre recurrence factors at n*(n+1)/2+m.
+	V zero( 0.0 );
+	V one( 1.0 );
+	V dx = x - V( cx );
+	V dy = y - V( cy );
+	V dz = z - V( cz );
+	V rho = vsqrt( dx*dx + dy*dy );
+	V r = vsqrt( dx*dx + dy*dy + dz*dz );
+	V invR = one / r;
+	V ct = dz * invR;
+	V st = rho * invR;
+	typename V::Mask onAxis = vcmpeq( rho, zero );
+	V invRho = one / vselect( onAxis, one, rho );
+	V cp = vselect( onAxis, one, dx * invRho );
+	V sp = vselect( onAxis, zero, dy * invRho );
+
+	// cos(m phi) and sin(m phi) by repeated rotation
+	V cm[EMFIELD_MULTIPOLE_MAX_ORDER+1];
+	V sm[EMFIELD_MULTIPOLE_MAX_ORDER+1];
+	cm[0] = one;
+	sm[0] = zero;
+	for( int m=1; m<=order; m++ ) {
+		cm[m] = cm[m-1] * cp - sm[m-1] * sp;
+		sm[m] = sm[m-1] * cp + cm[m-1] * sp;
+	}
+
+	// h_n(kr) = j_n - i y_n by upward recurrence, which is stable for h_n
+	// as a whole because y_n dominates once n > kr
+	V kr = V( k ) * r;
+	V invKr = one / kr;
+	V s, c;
+	emfieldSinCos( kr, s, c, (typename V::Real)0 );
+	V hRe0 = s * invKr;
+	V hIm0 = c * invKr;
+	V hRe1 = ( s * invKr - c ) * invKr;
+	V hIm1 = ( c * invKr + s ) * invKr;
+
+	// Three rolling rows of the normalized associated Legendre functions
+	V rows[3][EMFIELD_MULTIPOLE_MAX_ORDER+1];
+	V *p0 = rows[0];
+	V *p1 = rows[1];
+	V *p2 = rows[2];
+	V sqrt2( 1.41421356237309504880 );
+
+	for( int n=0; n<=order; n++ ) {
+		V hRe, hIm;
+		if( n == 0 ) {
+			hRe = hRe0;
+			hIm = hIm0;
+		}
+		else if( n == 1 ) {
+			hRe = hRe1;
+			hIm = hIm1;
+		}
+		else {
+			V f = V( (double)(2*n-1) ) * invKr;
+			hRe = f * hRe1 - hRe0;
+			hIm = f * hIm1 - hIm0;
+			hRe0 = hRe1;
+			hIm0 = hIm1;
+			hRe1 = hRe;
+			hIm1 = hIm;
+		}
+
+		// Row n from rows n-1 (p1) and n-2 (p2) into p0
+		if( n == 0 ) {
+			p0[0] = V( 0.28209479177387814347 );
+		}
+		else {
+			for( int m=0; m<=n-2; m++ ) {
+				const double *f = &ab[ ( n*(n+1)/2 + m ) * 2 ];
+				p0[m] = V( f[0] ) * ( ct * p1[m] - V( f[1] ) * p2[m] );
+			}
+			p0[n-1] = V( sqrt( 2.0*n + 1.0 ) ) * ct * p1[n-1];
+			p0[n] = V( -sqrt( ( 2.0*n + 1.0 ) / ( 2.0*n ) ) ) * st * p1[n-1];
+		}
+
+		// S = sum over m of c_nm Y_nm for each component
+		const double *cn = &coef[ n*n*Channels ];
+		V sum[Channels];
+		for( int q=0; q<Channels; q++ ) {
+			sum[q] = V( cn[n*Channels + q] ) * p0[0];
+		}
+		for( int m=1; m<=n; m++ ) {
+			V yc = sqrt2 * p0[m] * cm[m];
+			V ys = sqrt2 * p0[m] * sm[m];
+			const double *cPos = &cn[ (n+m)*Channels ];
+			const double *cNeg = &cn[ (n-m)*Channels ];
+			for( int q=0; q<Channels; q++ ) {
+				sum[q] = sum[q] + V( cPos[q] ) * yc + V( cNeg[q] ) * ys;
+			}
+		}
+
+		// Times h_n(kr) / h_n(kR). Channels come in (Re xyz, Im xyz) sextets.
+		V gRe = hRe * V( invH[2*n] ) - hIm * V( invH[2*n+1] );
+		V gIm = hRe * V( invH[2*n+1] ) + hIm * V( invH[2*n] );
+		for( int q0=0; q0<Channels; q0+=6 ) {
+			for( int q=q0; q<q0+3; q++ ) {
+				acc[q] = acc[q] + gRe * sum[q] - gIm * sum[q+3];
+				acc[q+3] = acc[q+3] + gRe * sum[q+3] + gIm * sum[q];
+			}
+		}
+
+		V *t = p2;
+		p2 = p1;
+		p1 = p0;
+		p0 = t;
+	}
+}
+
+template< class V, int Channels >
+void emfieldMultipoleBlockT( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, double *out[12] ) {
+	// Adds one cluster's expansion to out. Lanes are target points.
+	int i = 0;
+	for( ; i + V::Width <= count; i += V::Width ) {
+		V acc[12];
+		for( int q=0; q<Channels; q++ ) {
+			acc[q] = V::load( &out[q][i] );
+		}
+		emfieldMultipoleLanes<V,Channels>( V::load( &px[i] ), V::load( &py[i] ), V::load( &pz[i] ), cx, cy, cz, k, order, invH, coef, ab, acc );
+		for( int q=0; q<Channels; q++ ) {
+			vstore( &out[q][i], acc[q] );
+		}
+	}
+	for( ; i < count; i++ ) {
+		EMLaneScalar acc[12];
+		for( int q=0; q<Channels; q++ ) {
+			acc[q] = EMLaneScalar( out[q][i] );
+		}
+		emfieldMultipoleLanes<EMLaneScalar,Channels>( EMLaneScalar( px[i] ), EMLaneScalar( py[i] ), EMLaneScalar( pz[i] ), cx, cy, cz, k, order, invH, coef, ab, acc );
+		for( int q=0; q<Channels; q++ ) {
+			out[q][i] = acc[q].v;
+		}
+	}
+}
+
+template< class V >
+void emfieldMultipoleBlock( int count, const double *px, const double *py, const double *pz, double cx, double cy, double cz, double k, int order, const double *invH, const double *coef, const double *ab, int magnetic, double *out[12] ) {
+	if( magnetic ) {
+		emfieldMultipoleBlockT<V,12>( count, px, py, pz, cx, cy, cz, k, order, invH, coef, ab, out );
+	}
+	else {
+		emfieldMultipoleBlockT<V,6>( count, px, py, pz, cx, cy, cz, k, order, invH, coef, ab, out );
+	}
+}
+
+template< class V, int Rotate, int Inst, int Avg >
+inline void emfieldDerivedLanes( V f[12], double c, double sn, double halfEps, V d[8] ) {
+	// f holds the twelve channels of E and H. With Rotate they are first
+	// multiplied by c + i sn in place. Inst gives the instantaneous
+	// S = Re E x Re H and u = eps/2 (|Re E|^2 + |Re H|^2) in d[0..3], Avg the
+	// period averages 1/2 Re( E x conj H ) and eps/4 (|E|^2 + |H|^2) in d[4..7].
+	if( Rotate ) {
+		V vc( c ), vs( sn );
+		for( int q0=0; q0<12; q0+=6 ) {
+			for( int q=q0; q<q0+3; q++ ) {
+				V re = f[q] * vc - f[q+3] * vs;
+				f[q+3] = f[q+3] * vc + f[q] * vs;
+				f[q] = re;
+			}
+		}
+	}
+	if( Inst ) {
+		d[0] = f[1] * f[8] - f[2] * f[7];
+		d[1] = f[2] * f[6] - f[0] * f[8];
+		d[2] = f[0] * f[7] - f[1] * f[6];
+		d[3] = V( halfEps ) * ( f[0]*f[0] + f[1]*f[1] + f[2]*f[2] + f[6]*f[6] + f[7]*f[7] + f[8]*f[8] );
+	}
+	if( Avg ) {
+		V half( 0.5 );
+		d[4] = half * ( f[1] * f[8] - f[2] * f[7] + f[4] * f[11] - f[5] * f[10] );
+		d[5] = half * ( f[2] * f[6] - f[0] * f[8] + f[5] * f[9] - f[3] * f[11] );
+		d[6] = half * ( f[0] * f[7] - f[1] * f[6] + f[3] * f[10] - f[4] * f[9] );
+		V mag2 = f[0]*f[0] + f[1]*f[1] + f[2]*f[2] + f[3]*f[3] + f[4]*f[4] + f[5]*f[5];
+		mag2 = mag2 + f[6]*f[6] + f[7]*f[7] + f[8]*f[8] + f[9]*f[9] + f[10]*f[10] + f[11]*f[11];
+		d[7] = V( 0.5 * halfEps ) * mag2;
+	}
+}
+
+template< class V, int Rotate, int Inst, int Avg >
+void emfieldDerivedBlockT( int count, typename V::Real *src[12], typename V::Real *dst[12], double c, double sn, double halfEps, typename V::Real *out[8] ) {
+	// One pass over the points that reads E and H once and writes everything
+	// derived from them. Touching every stream at once is what makes it a
+	// single pass, so the streams must not share cache sets.
+	typedef EMLaneScalarT<typename V::Real> Tail;
+	int i = 0;
+	for( ; i + V::Width <= count; i += V::Width ) {
+		V f[12], d[8];
+		for( int q=0; q<12; q++ ) {
+			f[q] = V::load( &src[q][i] );
+		}
+		emfieldDerivedLanes<V,Rotate,Inst,Avg>( f, c, sn, halfEps, d );
+		for( int q=0; Rotate && q<12; q++ ) {
+			vstore( &dst[q][i], f[q] );
+		}
+		for( int q=Inst ? 0 : 4; q<( Avg ? 8 : 4 ); q++ ) {
+			vstore( &out[q][i], d[q] );
+		}
+	}
+	for( ; i < count; i++ ) {
+		Tail f[12], d[8];
+		for( int q=0; q<12; q++ ) {
+			f[q] = Tail( src[q][i] );
+		}
+		emfieldDerivedLanes<Tail,Rotate,Inst,Avg>( f, c, sn, halfEps, d );
+		for( int q=0; Rotate && q<12; q++ ) {
+			dst[q][i] = f[q].v;
+		}
+		for( int q=Inst ? 0 : 4; q<( Avg ? 8 : 4 ); q++ ) {
+			out[q][i] = d[q].v;
+		}
+	}
+}
+
+template< class V >
+void emfieldDerivedBlock( int count, typename V::Real *src[12], typename V::Real *dst[12], double c, double sn, double halfEps, int inst, int avg, typename V::Real *out[8] ) {
+	// Only the combinations the sampler uses are instantiated
+	if( dst ) {
+		emfieldDerivedBlockT<V,1,1,0>( count, src, dst, c, sn, halfEps, out );
+	}
+	else if( inst && avg ) {
+		emfieldDerivedBlockT<V,0,1,1>( count, src, dst, c, sn, halfEps, out );
+	}
+	else if( inst ) {
+		emfieldDerivedBlockT<V,0,1,0>( count, src, dst, c, sn, halfEps, out );
+	}
+	else {
+		emfieldDerivedBlockT<V,0,0,1>( count, src, dst, c, sn, halfEps, out );
+	}
+}
+
+template< class V, int Batch >
+inline void emfieldCoulombLanes( int i, const float *px, const float *py, const float *pz, int c0, int c1, const float *chg[4], float *out[3] ) {
+	// Adds charges c0..c1-1 to the Batch lane groups of points from i. Each
+	// charge is broadcast once for the whole batch, which is what keeps the
+	// loop on the arithmetic rather than on the broadcasts.
+	V x[Batch], y[Batch], z[Batch], fx[Batch], fy[Batch], fz[Batch];
+	for( int b=0; b<Batch; b++ ) {
+		int k = i + b * V::Width;
+		x[b] = V::load( &px[k] );
+		y[b] = V::load( &py[k] );
+		z[b] = V::load( &pz[k] );
+		fx[b] = V::load( &out[0][k] );
+		fy[b] = V::load( &out[1][k] );
+		fz[b] = V::load( &out[2][k] );
+	}
+	V half( 0.5 ), threeHalves( 1.5 );
+	for( int j=c0; j<c1; j++ ) {
+		V cx( chg[0][j] ), cy( chg[1][j] ), cz( chg[2][j] ), q( chg[3][j] );
+		for( int b=0; b<Batch; b++ ) {
+			V dx = x[b] - cx;
+			V dy = y[b] - cy;
+			V dz = z[b] - cz;
+			V r2 = dx*dx + dy*dy + dz*dz;
+			V inv = vrsqrt( r2 );
+			inv = inv * ( threeHalves - half * r2 * inv * inv );
+			V s = q * inv * inv * inv;
+			fx[b] = fx[b] + dx * s;
+			fy[b] = fy[b] + dy * s;
+			fz[b] = fz[b] + dz * s;
+		}
+	}
+	for( int b=0; b<Batch; b++ ) {
+		int k = i + b * V::Width;
+		vstore( &out[0][k], fx[b] );
+		vstore( &out[1][k], fy[b] );
+		vstore( &out[2][k], fz[b] );
+	}
+}
+
+template< class V, int Batch >
+void emfieldCoulombBlock( int count, const float *px, const float *py, const float *pz, int numCharges, const float *chg[4], float *out[3] ) {
+	// Float only. The charges are taken in tiles small enough to stay in L1
+	// while every point of the block passes over them, with the partial sums
+	// waiting in out between tiles.
+	typedef EMLaneScalarT<float> Tail;
+	const int tile = 1024;
+	for( int k=0; k<3; k++ ) {
+		for( int i=0; i<count; i++ ) {
+			out[k][i] = 0.f;
+		}
+	}
+	for( int c0=0; c0<numCharges; c0+=tile ) {
+		int c1 = c0 + tile < numCharges ? c0 + tile : numCharges;
+		int i = 0;
+		for( ; i + Batch * V::Width <= count; i += Batch * V::Width ) {
+			emfieldCoulombLanes<V,Batch>( i, px, py, pz, c0, c1, chg, out );
+		}
+		for( ; i + V::Width <= count; i += V::Width ) {
+			emfieldCoulombLanes<V,1>( i, px, py, pz, c0, c1, chg, out );
+		}
+		for( ; i < count; i++ ) {
+			emfieldCoulombLanes<Tail,1>( i, px, py, pz, c0, c1, chg, out );
+		}
+	}
+}
+
+}
+
+#endif
@@ -0,0 +1,572 @@
+// @ZBS {
+//		*MASTER_FILE 1
+//		+DESCRIPTION {
+//			Multipole accelerated evaluation of many dipole sources
+//		}
+//		*PORTABILITY win32 unix
+//		*REQUIRED_FILES emmultipole.cpp emmultipole.h emfield.cpp emfield.h emfieldkernel.h
+//		*VERSION 1.0
+//		+HISTORY {
+//		}
+//		+TODO {
+//			Local expansions per grid brick would turn this into a two level FMM
+//		}
+//		*SELF_TEST no
+//		*PUBLISH no
+// }
+// OPERATING SYSTEM specific includes:
+// SDK includes:
+// STDLIB includes:
+#include "math.h"
+#include "stdlib.h"
+#include "string.h"
+// MODULE includes:
+#include "emmultipole.h"
+#include "emfield.h"
+#include "emfieldkernel.h"
+// ZBSLIB includes:
+
+#define EMMULTIPOLE_PI (3.14159265358979323846)
+
+static int emmultipoleCoefCount( int order ) {
+	return (order+1) * (order+1);
+}
+
+static void emmultipoleGaussLegendre( int n, double *x, double *w ) {
+	// Nodes and weights on [-1,1] by Newton iteration on P_n
+	for( int i=0; i<n; i++ ) {
+		double z = cos( EMMULTIPOLE_PI * ( i + 0.75 ) / ( n + 0.5 ) );
+		double dp = 1.0;
+		for( int iter=0; iter<100; iter++ ) {
+			double p0 = 1.0;
+			double p1 = 0.0;
+			for( int j=1; j<=n; j++ ) {
+				double p2 = p1;
+				p1 = p0;
+				p0 = ( ( 2.0*j - 1.0 ) * z * p1 - ( j - 1.0 ) * p2 ) / j;
+			}
+			dp = n * ( z * p0 - p1 ) / ( z*z - 1.0 );
+			double dz = p0 / dp;
+			z -= dz;
+			if( fabs( dz ) < 1e-16 ) {
+				break;
+			}
+		}
+		x[i] = z;
+		w[i] = 2.0 / ( ( 1.0 - z*z ) * dp * dp );
+	}
+}
+
+static void emmultipoleLegendre( double ct, double st, int order, const double *ab, double *p ) {
+	// Normalized associated Legendre functions at n*(n+1)/2+m, the same
+	// recurrence as emfieldMultipoleLanes()
+	p[0] = 0.28209479177387814347;
+	for( int n=1; n<=order; n++ ) {
+		double *row = &p[ n*(n+1)/2 ];
+		double *prev = &p[ (n-1)*n/2 ];
+		double *prev2 = n >= 2 ? &p[ (n-2)*(n-1)/2 ] : 0;
+		for( int m=0; m<=n-2; m++ ) {
+			const double *f = &ab[ ( n*(n+1)/2 + m ) * 2 ];
+			row[m] = f[0] * ( ct * prev[m] - f[1] * prev2[m] );
+		}
+		row[n-1] = sqrt( 2.0*n + 1.0 ) * ct * prev[n-1];
+		row[n] = -sqrt( ( 2.0*n + 1.0 ) / ( 2.0*n ) ) * st * prev[n-1];
+	}
+}
+
+static void emmultipoleHankel( double x, int order, double *h ) {
+	// h_n(x) = j_n(x) - i y_n(x) as interleaved complex pairs
+	double s = sin( x );
+	double c = cos( x );
+	h[0] = s / x;
+	h[1] = c / x;
+	if( order >= 1 ) {
+		h[2] = ( s / x - c ) / x;
+		h[3] = ( c / x + s ) / x;
+	}
+	for( int n=2; n<=order; n++ ) {
+		double f = ( 2.0*n - 1.0 ) / x;
+		h[2*n] = f * h[2*n-2] - h[2*n-4];
+		h[2*n+1] = f * h[2*n-1] - h[2*n-3];
+	}
+}
+
+struct EMMultipoleKey {
+	int cell[3];
+	int index;
+};
+
+static int emmultipoleKeyCompare( const void *a, const void *b ) {
+	const EMMultipoleKey *ka = (const EMMultipoleKey *)a;
+	const EMMultipoleKey *kb = (const EMMultipoleKey *)b;
+	for( int k=0; k<3; k++ ) {
+		if( ka->cell[k] != kb->cell[k] ) {
+			return ka->cell[k] < kb->cell[k] ? -1 : 1;
+		}
+	}
+	return ka->index - kb->index;
+}
+
+static int emmultipoleSameCell( const EMMultipoleKey *a, const EMMultipoleKey *b ) {
+	return a->cell[0] == b->cell[0] && a->cell[1] == b->cell[1] && a->cell[2] == b->cell[2];
+}
+
+EMFieldMultipole::EMFieldMultipole() {
+	tolerance = 1e-6;
+	separation = 3.0;
+	cellSize = 0.0;
+	version = 0;
+	builtSources = 0;
+	builtSourcesVersion = 0;
+	builtOmega = builtBeta = 0.0;
+	builtTolerance = builtSeparation = builtCellSize = 0.0;
+	builtMagnetic = 0;
+	numClusters = 0;
+	clusters = 0;
+	numSources = 0;
+	numDirectSources = 0;
+	for( int k=0; k<8; k++ ) {
+		src[k] = 0;
+	}
+	ab = 0;
+	srcBlock = 0;
+	coefBlock = 0;
+}
+
+EMFieldMultipole::~EMFieldMultipole() {
+	clear();
+}
+
+void EMFieldMultipole::clear() {
+	if( clusters ) {
+		free( clusters );
+	}
+	if( srcBlock ) {
+		free( srcBlock );
+	}
+	if( coefBlock ) {
+		free( coefBlock );
+	}
+	if( ab ) {
+		free( ab );
+	}
+	clusters = 0;
+	srcBlock = 0;
+	coefBlock = 0;
+	ab = 0;
+	numClusters = 0;
+	numSources = 0;
+	numDirectSources = 0;
+	for( int k=0; k<8; k++ ) {
+		src[k] = 0;
+	}
+	builtSources = 0;
+	version++;
+}
+
+int EMFieldMultipole::stale( EMFieldSources &sources, double omega, double beta, int magnetic ) {
+	return builtSources != &sources || builtSourcesVersion != sources.version
+		|| builtOmega != omega || builtBeta != beta || builtMagnetic != magnetic
+		|| builtTolerance != tolerance || builtSeparation != separation || builtCellSize != cellSize;
+}
+
+void EMFieldMultipole::build( EMFieldSources &sources, double omega, double beta, int magnetic ) {
+	clear();
+	builtSources = &sources;
+	builtSourcesVersion = sources.version;
+	builtOmega = omega;
+	builtBeta = beta;
+	builtMagnetic = magnetic;
+	builtTolerance = tolerance;
+	builtSeparation = separation;
+	builtCellSize = cellSize;
+
+	int n = sources.count;
+	if( n <= 0 ) {
+		return;
+	}
+	double sep = separation > 1.01 ? separation : 1.01;
+	int channels = magnetic ? 12 : 6;
+	double cell = cellSize > 0.0 ? cellSize : 2.0 * EMMULTIPOLE_PI / beta;
+
+	// Recurrence factors shared by every cluster and the lane kernel
+	int maxOrder = EMFIELD_MULTIPOLE_MAX_ORDER;
+	ab = (double *)malloc( sizeof(double) * ( maxOrder+1 ) * ( maxOrder+2 ) );
+	for( int l=0; l<=maxOrder; l++ ) {
+		for( int m=0; m<=l; m++ ) {
+			double *f = &ab[ ( l*(l+1)/2 + m ) * 2 ];
+			f[0] = f[1] = 0.0;
+			if( m <= l-2 ) {
+				f[0] = sqrt( ( 4.0*l*l - 1.0 ) / ( (double)l*l - (double)m*m ) );
+				f[1] = sqrt( ( (l-1.0)*(l-1.0) - (double)m*m ) / ( 4.0*(l-1.0)*(l-1.0) - 1.0 ) );
+			}
+		}
+	}
+
+	// Sort the sources by cell so each cluster is a contiguous run
+	EMMultipoleKey *keys = (EMMultipoleKey *)malloc( sizeof(EMMultipoleKey) * n );
+	for( int i=0; i<n; i++ ) {
+		keys[i].cell[0] = (int)floor( sources.x[i] / cell );
+		keys[i].cell[1] = (int)floor( sources.y[i] / cell );
+		keys[i].cell[2] = (int)floor( sources.z[i] / cell );
+		keys[i].index = i;
+	}
+	qsort( keys, n, sizeof(EMMultipoleKey), emmultipoleKeyCompare );
+
+	numSources = n;
+	srcBlock = malloc( sizeof(double) * 8 * (size_t)n );
+	double *from[8] = { sources.x, sources.y, sources.z, sources.nx, sources.ny, sources.nz, sources.aRe, sources.aIm };
+	for( int k=0; k<8; k++ ) {
+		src[k] = &((double *)srcBlock)[ (size_t)k * n ];
+		for( int i=0; i<n; i++ ) {
+			src[k][i] = from[k][ keys[i].index ];
+		}
+	}
+
+	numClusters = 0;
+	for( int i=0; i<n; i++ ) {
+		if( i == 0 || emmultipoleSameCell( &keys[i], &keys[i-1] ) == 0 ) {
+			numClusters++;
+		}
+	}
+	clusters = (EMFieldCluster *)malloc( sizeof(EMFieldCluster) * numClusters );
+
+	// Bounding sphere and order of each cluster
+	int c = -1;
+	size_t coefDoubles = 0;
+	double logTol = log( 1.0 / ( tolerance > 1e-15 ? tolerance : 1e-15 ) );
+	for( int i=0; i<n; i++ ) {
+		if( i == 0 || emmultipoleSameCell( &keys[i], &keys[i-1] ) == 0 ) {
+			c++;
+			clusters[c].first = i;
+			clusters[c].count = 0;
+		}
+		clusters[c].count++;
+	}
+	free( keys );
+
+	for( c=0; c<numClusters; c++ ) {
+		EMFieldCluster &cl = clusters[c];
+		DVec3 lo( src[0][cl.first], src[1][cl.first], src[2][cl.first] );
+		DVec3 hi = lo;
+		for( int i=cl.first; i<cl.first+cl.count; i++ ) {
+			DVec3 p( src[0][i], src[1][i], src[2][i] );
+			lo = DVec3( p.x < lo.x ? p.x : lo.x, p.y < lo.y ? p.y : lo.y, p.z < lo.z ? p.z : lo.z );
+			hi = DVec3( p.x > hi.x ? p.x : hi.x, p.y > hi.y ? p.y : hi.y, p.z > hi.z ? p.z : hi.z );
+		}
+		cl.center = DVec3( 0.5*(lo.x+hi.x), 0.5*(lo.y+hi.y), 0.5*(lo.z+hi.z) );
+		cl.radius = 0.0;
+		for( int i=cl.first; i<cl.first+cl.count; i++ ) {
+			DVec3 d( src[0][i] - cl.center.x, src[1][i] - cl.center.y, src[2][i] - cl.center.z );
+			double r = d.mag();
+			cl.radius = r > cl.radius ? r : cl.radius;
+		}
+		// A lone source still needs a sphere to fit on
+		cl.radius = cl.radius > 0.05 * cell ? cl.radius : 0.05 * cell;
+
+		// Truncation error falls as separation^-p once p exceeds beta*radius
+		int order = (int)ceil( beta * cl.radius + logTol / log( sep ) ) + 1;
+		order = order < EMFIELD_MULTIPOLE_MAX_ORDER ? order : EMFIELD_MULTIPOLE_MAX_ORDER;
+
+		// An expansion costs about as much as a dozen direct sources per
+		// coefficient row, so small clusters are always summed directly
+		cl.order = cl.count * 12 > ( order+1 ) * ( order+1 ) ? order : -1;
+		cl.invH = 0;
+		cl.coef = 0;
+		if( cl.order >= 0 ) {
+			coefDoubles += 2 * (order+1) + channels * emmultipoleCoefCount( order );
+		}
+	}
+	coefBlock = malloc( sizeof(double) * ( coefDoubles > 0 ? coefDoubles : 1 ) );
+
+	// Move the sources of every direct only cluster to the front so that
+	// evaluate() sums all of them with one kernel call
+	double *packed = (double *)malloc( sizeof(double) * 8 * (size_t)n );
+	int at = 0;
+	for( int pass=0; pass<2; pass++ ) {
+		for( c=0; c<numClusters; c++ ) {
+			EMFieldCluster &cl = clusters[c];
+			if( ( cl.order < 0 ) != ( pass == 0 ) ) {
+				continue;
+			}
+			for( int k=0; k<8; k++ ) {
+				memcpy( &packed[ (size_t)k * n + at ], &src[k][cl.first], sizeof(double) * cl.count );
+			}
+			cl.first = at;
+			at += cl.count;
+		}
+		if( pass == 0 ) {
+			numDirectSources = at;
+		}
+	}
+	free( srcBlock );
+	srcBlock = packed;
+	for( int k=0; k<8; k++ ) {
+		src[k] = &packed[ (size_t)k * n ];
+	}
+
+	// Fit every expansion by quadrature on a sphere of radius separation*radius.
+	// Gauss-Legendre in cos(theta) and uniform in phi, with enough nodes that
+	// field content up to about twice the order does not alias.
+	double *next = (double *)coefBlock;
+	for( c=0; c<numClusters; c++ ) {
+		EMFieldCluster &cl = clusters[c];
+		if( cl.order < 0 ) {
+			continue;
+		}
+		int p = cl.order;
+		int nt = (3*p)/2 + 2;
+		int np = 2*nt;
+		int nq = nt * np;
+		double fitR = sep * cl.radius;
+		cl.invH = next;
+		next += 2 * (p+1);
+		cl.coef = next;
+		next += channels * emmultipoleCoefCount( p );
+
+		double *work = (double *)malloc( sizeof(double) * ( 2*nt + ( 3 + channels ) * (size_t)nq + 2*np*(p+1) + (p+1)*(p+2)/2 + 2*channels*(p+1) ) );
+		double *gx = work;
+		double *gw = gx + nt;
+		double *qx = gw + nt;
+		double *qy = qx + nq;
+		double *qz = qy + nq;
+		double *e[12];
+		e[0] = qz + nq;
+		for( int k=1; k<channels; k++ ) {
+			e[k] = e[k-1] + nq;
+		}
+		double *cosT = e[channels-1] + nq;
+		double *sinT = cosT + np*(p+1);
+		double *leg = sinT + np*(p+1);
+		double *fc = leg + (p+1)*(p+2)/2;
+		double *fs = fc + channels*(p+1);
+
+		emmultipoleGaussLegendre( nt, gx, gw );
+		for( int j=0; j<np; j++ ) {
+			double phi = 2.0 * EMMULTIPOLE_PI * j / np;
+			for( int m=0; m<=p; m++ ) {
+				cosT[j*(p+1)+m] = cos( m * phi );
+				sinT[j*(p+1)+m] = sin( m * phi );
+			}
+		}
+		for( int i=0; i<nt; i++ ) {
+			double st = sqrt( 1.0 - gx[i]*gx[i] );
+			for( int j=0; j<np; j++ ) {
+				qx[i*np+j] = cl.center.x + fitR * st * cosT[j*(p+1)+1];
+				qy[i*np+j] = cl.center.y + fitR * st * sinT[j*(p+1)+1];
+				qz[i*np+j] = cl.center.z + fitR * gx[i];
+			}
+		}
+		const double *clSrc[8];
+		for( int k=0; k<8; k++ ) {
+			clSrc[k] = &src[k][cl.first];
+		}
+		emfieldSourcesKernel( nq, qx, qy, qz, cl.count, clSrc, omega, beta, 0.0, magnetic, e );
+
+		// Fourier in phi on each ring, then Legendre in theta
+		memset( cl.coef, 0, sizeof(double) * channels * emmultipoleCoefCount( p ) );
+		double sqrt2 = 1.41421356237309504880;
+		for( int i=0; i<nt; i++ ) {
+			for( int m=0; m<=p; m++ ) {
+				for( int q=0; q<channels; q++ ) {
+					double sc = 0.0;
+					double ss = 0.0;
+					for( int j=0; j<np; j++ ) {
+						sc += e[q][i*np+j] * cosT[j*(p+1)+m];
+						ss += e[q][i*np+j] * sinT[j*(p+1)+m];
+					}
+					double wphi = 2.0 * EMMULTIPOLE_PI / np * ( m ? sqrt2 : 1.0 );
+					fc[m*channels+q] = sc * wphi * gw[i];
+					fs[m*channels+q] = ss * wphi * gw[i];
+				}
+			}
+			emmultipoleLegendre( gx[i], sqrt( 1.0 - gx[i]*gx[i] ), p, ab, leg );
+			for( int l=0; l<=p; l++ ) {
+				for( int m=0; m<=l; m++ ) {
+					double pl = leg[ l*(l+1)/2 + m ];
+					for( int q=0; q<channels; q++ ) {
+						cl.coef[ (l*l+l+m)*channels + q ] += pl * fc[m*channels+q];
+						if( m > 0 ) {
+							cl.coef[ (l*l+l-m)*channels + q ] += pl * fs[m*channels+q];
+						}
+					}
+				}
+			}
+		}
+
+		double *h = fc;
+		emmultipoleHankel( beta * fitR, p, h );
+		for( int l=0; l<=p; l++ ) {
+			double re = h[2*l];
+			double im = h[2*l+1];
+			double d = re*re + im*im;
+			cl.invH[2*l] = re / d;
+			cl.invH[2*l+1] = -im / d;
+		}
+		free( work );
+	}
+	version++;
+}
+
+void EMFieldMultipole::evaluate( int count, const double *px, const double *py, const double *pz, double t, int magnetic, double *out[12] ) {
+	// Everything is evaluated at t=0 and rotated once at the end, as all
+	// sources share omega. magnetic must match the last build().
+	const int chunk = EMFIELD_BRICK_POINTS;
+	int channels = magnetic ? 12 : 6;
+	double *scratch = (double *)malloc( sizeof(double) * ( 3 + 2*channels ) * chunk + sizeof(int) * chunk );
+	double *gx = scratch;
+	double *gy = gx + chunk;
+	double *gz = gy + chunk;
+	double *ge[12];
+	double *te[12];
+	ge[0] = gz + chunk;
+	for( int k=1; k<channels; k++ ) {
+		ge[k] = ge[k-1] + chunk;
+	}
+	te[0] = ge[channels-1] + chunk;
+	for( int k=1; k<channels; k++ ) {
+		te[k] = te[k-1] + chunk;
+	}
+	int *far = (int *)( te[channels-1] + chunk );
+	double sep = builtSeparation > 1.01 ? builtSeparation : 1.01;
+
+	for( int lo=0; lo<count; lo+=chunk ) {
+		int n = count - lo < chunk ? count - lo : chunk;
+		const double *cx = &px[lo];
+		const double *cy = &py[lo];
+		const double *cz = &pz[lo];
+		double *o[12];
+		for( int k=0; k<channels; k++ ) {
+			o[k] = &out[k][lo];
+		}
+		if( numDirectSources > 0 ) {
+			emfieldSourcesKernel( n, cx, cy, cz, numDirectSources, (const double **)src, builtOmega, builtBeta, 0.0, magnetic, o );
+		}
+		else {
+			for( int k=0; k<channels; k++ ) {
+				memset( o[k], 0, sizeof(double) * n );
+			}
+		}
+
+		DVec3 bLo( cx[0], cy[0], cz[0] );
+		DVec3 bHi = bLo;
+		for( int i=1; i<n; i++ ) {
+			bLo = DVec3( cx[i] < bLo.x ? cx[i] : bLo.x, cy[i] < bLo.y ? cy[i] : bLo.y, cz[i] < bLo.z ? cz[i] : bLo.z );
+			bHi = DVec3( cx[i] > bHi.x ? cx[i] : bHi.x, cy[i] > bHi.y ? cy[i] : bHi.y, cz[i] > bHi.z ? cz[i] : bHi.z );
+		}
+
+		for( int c=0; c<numClusters; c++ ) {
+			EMFieldCluster &cl = clusters[c];
+			if( cl.order < 0 ) {
+				continue;
+			}
+			const double *clSrc[8];
+			for( int k=0; k<8; k++ ) {
+				clSrc[k] = &src[k][cl.first];
+			}
+
+			// Nearest and farthest distance from the cluster to the chunk's bounds
+			double dNear2 = 0.0;
+			double dFar2 = 0.0;
+			double *ctr = (double *)cl.center;
+			double *bl = (double *)bLo;
+			double *bh = (double *)bHi;
+			for( int k=0; k<3; k++ ) {
+				double dn = ctr[k] < bl[k] ? bl[k] - ctr[k] : ( ctr[k] > bh[k] ? ctr[k] - bh[k] : 0.0 );
+				double df = fabs( ctr[k] - bl[k] ) > fabs( ctr[k] - bh[k] ) ? fabs( ctr[k] - bl[k] ) : fabs( ctr[k] - bh[k] );
+				dNear2 += dn * dn;
+				dFar2 += df * df;
+			}
+			double farR = sep * cl.radius;
+
+			if( dNear2 >= farR * farR ) {
+				emfieldMultipoleKernel( n, cx, cy, cz, cl.center.x, cl.center.y, cl.center.z, builtBeta, cl.order, cl.invH, cl.coef, ab, magnetic, o );
+				continue;
+			}
+			if( dFar2 < farR * farR ) {
+				emfieldSourcesKernel( n, cx, cy, cz, cl.count, clSrc, builtOmega, builtBeta, 0.0, magnetic, te );
+				for( int k=0; k<channels; k++ ) {
+					for( int i=0; i<n; i++ ) {
+						o[k][i] += te[k][i];
+					}
+				}
+				continue;
+			}
+
+			// The cluster straddles the chunk: far points first, packed to the
+			// front of the gather buffers, near points packed to the back
+			int numFar = 0;
+			int numNear = 0;
+			for( int i=0; i<n; i++ ) {
+				double dx = cx[i] - cl.center.x;
+				double dy = cy[i] - cl.center.y;
+				double dz = cz[i] - cl.center.z;
+				int slot = dx*dx + dy*dy + dz*dz >= farR * farR ? numFar++ : n - 1 - numNear++;
+				far[slot] = i;
+				gx[slot] = cx[i];
+				gy[slot] = cy[i];
+				gz[slot] = cz[i];
+			}
+			for( int k=0; k<channels; k++ ) {
+				memset( ge[k], 0, sizeof(double) * numFar );
+			}
+			emfieldMultipoleKernel( numFar, gx, gy, gz, cl.center.x, cl.center.y, cl.center.z, builtBeta, cl.order, cl.invH, cl.coef, ab, magnetic, ge );
+			double *nearOut[12];
+			for( int k=0; k<channels; k++ ) {
+				nearOut[k] = &ge[k][numFar];
+			}
+			emfieldSourcesKernel( numNear, &gx[numFar], &gy[numFar], &gz[numFar], cl.count, clSrc, builtOmega, builtBeta, 0.0, magnetic, nearOut );
+			for( int k=0; k<channels; k++ ) {
+				for( int i=0; i<n; i++ ) {
+					o[k][far[i]] += ge[k][i];
+				}
+			}
+		}
+
+		if( t != 0.0 ) {
+			double c = cos( builtOmega * t );
+			double s = sin( builtOmega * t );
+			for( int k0=0; k0<channels; k0+=6 ) {
+				for( int k=k0; k<k0+3; k++ ) {
+					for( int i=0; i<n; i++ ) {
+						double re = o[k][i];
+						double im = o[k+3][i];
+						o[k][i] = re * c - im * s;
+						o[k+3][i] = im * c + re * s;
+					}
+				}
+			}
+		}
+	}
+	free( scratch );
+}
+
+void EMFieldMultipole::evaluate( int count, const float *px, const float *py, const float *pz, double t, int magnetic, float *out[12] ) {
+	// Widen a brick at a time and run the double path
+	const int chunk = EMFIELD_BRICK_POINTS;
+	int channels = magnetic ? 12 : 6;
+	double *scratch = (double *)malloc( sizeof(double) * ( 3 + channels ) * chunk );
+	double *dx = scratch;
+	double *dy = dx + chunk;
+	double *dz = dy + chunk;
+	double *de[12];
+	de[0] = dz + chunk;
+	for( int k=1; k<channels; k++ ) {
+		de[k] = de[k-1] + chunk;
+	}
+	for( int lo=0; lo<count; lo+=chunk ) {
+		int n = count - lo < chunk ? count - lo : chunk;
+		for( int i=0; i<n; i++ ) {
+			dx[i] = px[lo+i];
+			dy[i] = py[lo+i];
+			dz[i] = pz[lo+i];
+		}
+		evaluate( n, dx, dy, dz, t, magnetic, de );
+		for( int k=0; k<channels; k++ ) {
+			for( int i=0; i<n; i++ ) {
+				out[k][lo+i] = (float)de[k][i];
+			}
+		}
+	}
+	free( scratch );
+}
@@ -0,0 +1,80 @@
+// @ZBS {
+//		*MODULE_OWNER_NAME emmultipole
+// }
+
+// Accelerated evaluation of an EMFieldSources superposition. Sources are
+// bucketed into cubic cells and the field of each cell is fitted once with
+// an outgoing spherical harmonic expansion per cartesian component of E,
+// and of H when built with magnetic. Points
+// far enough from a cell use its expansion, nearer ones fall back to the
+// direct sum over that cell's sources. This is a single level tree code
+// rather than a full FMM: there are no local expansions, so it pays off
+// when cells hold many sources and most of the grid is far from them.
+
+#ifndef EMMULTIPOLE_H
+#define EMMULTIPOLE_H
+
+#include "zvec.h"
+
+struct EMFieldSources;
+
+struct EMFieldCluster {
+	DVec3 center;
+	double radius;
+		// Every source of the cluster lies within radius of center
+	int order;
+		// Expansion order, or -1 when the cluster is too small to be worth one
+	int first, count;
+		// Range of the cluster's sources in EMFieldMultipole::src
+	double *invH;
+		// 1/h_n(beta R) for the fitting radius R, complex, n = 0..order
+	double *coef;
+		// Six components per (n,m) at n*n+n+m, twelve with H, see emfieldMultipoleLanes()
+};
+
+struct EMFieldMultipole {
+	double tolerance;
+		// Target relative accuracy of the far field against the direct sum.
+		// It sets the expansion order of every cluster.
+	double separation;
+		// A point uses a cluster's expansion when it is at least separation
+		// cluster radii from the cluster's center. Must be greater than 1.
+	double cellSize;
+		// Edge of the cubic cells sources are grouped by. 0 means one wavelength.
+
+	int version;
+		// Bumped by every build()
+	EMFieldSources *builtSources;
+	int builtSourcesVersion;
+	double builtOmega, builtBeta;
+	int builtMagnetic;
+	double builtTolerance, builtSeparation, builtCellSize;
+		// What the clusters were built from
+
+	int numClusters;
+	EMFieldCluster *clusters;
+	int numSources;
+	int numDirectSources;
+	double *src[8];
+		// The sources reordered so that each cluster's are contiguous, with
+		// all of the direct only clusters first in numDirectSources
+	double *ab;
+		// Legendre recurrence factors at n*(n+1)/2+m up to EMFIELD_MULTIPOLE_MAX_ORDER
+	void *srcBlock;
+	void *coefBlock;
+
+	EMFieldMultipole();
+	~EMFieldMultipole();
+
+	int stale( EMFieldSources &sources, double omega, double beta, int magnetic );
+		// True when build() needs to run before the next evaluate()
+	void build( EMFieldSources &sources, double omega, double beta, int magnetic );
+		// With magnetic the expansions also cover H, at twice the fitting cost
+	void evaluate( int count, const double *px, const double *py, const double *pz, double t, int magnetic, double *out[12] );
+	void evaluate( int count, const float *px, const float *py, const float *pz, double t, int magnetic, float *out[12] );
+		// Same layout and meaning as emfieldSourcesKernel() for the sources last
+		// built. magnetic must be what they were built with.
+	void clear();
+};
+
+#endif
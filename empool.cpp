@@ -0,0 +1,207 @@
+// @ZBS {
+//		*MASTER_FILE 1
+//		+DESCRIPTION {
+//			Work-stealing thread pool used to evaluate field grids in bricks
+//		}
+//		*PORTABILITY win32 unix
+//		*REQUIRED_FILES empool.cpp empool.h
+//		*VERSION 1.0
+//		+HISTORY {
+//		}
+//		+TODO {
+//		}
+//		*SELF_TEST no
+//		*PUBLISH no
+// }
+// OPERATING SYSTEM specific includes:
+// SDK includes:
+// STDLIB includes:
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+// MODULE includes:
+#include "empool.h"
+// ZBSLIB includes:
+
+struct EMWorkSlice {
+	std::mutex lock;
+	int lo, hi;
+		// Remaining tasks [lo,hi). The owner takes from lo, thieves from hi.
+};
+
+struct EMWorkPoolState {
+	int numThreads;
+	std::thread *threads;
+	EMWorkSlice *slices;
+
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	int generation;
+	int active;
+	int quit;
+
+	EMWorkFunc func;
+	void *user;
+};
+
+static int emWorkTake( EMWorkPoolState *s, int self ) {
+	// Returns a task index or -1 when every slice is empty
+	EMWorkSlice &mine = s->slices[self];
+	{
+		std::lock_guard<std::mutex> g( mine.lock );
+		if( mine.lo < mine.hi ) {
+			return mine.lo++;
+		}
+	}
+
+	for( int k=1; k<s->numThreads; k++ ) {
+		EMWorkSlice &victim = s->slices[ (self + k) % s->numThreads ];
+		int lo, hi;
+		{
+			std::lock_guard<std::mutex> g( victim.lock );
+			int left = victim.hi - victim.lo;
+			if( left <= 0 ) {
+				continue;
+			}
+			hi = victim.hi;
+			lo = hi - (left + 1) / 2;
+			victim.hi = lo;
+		}
+		// Keep the first stolen task and make the rest our new slice
+		std::lock_guard<std::mutex> g( mine.lock );
+		mine.lo = lo + 1;
+		mine.hi = hi;
+		return lo;
+	}
+	return -1;
+}
+
+static void emWorkDrain( EMWorkPoolState *s, int self ) {
+	int task;
+	while( (task = emWorkTake( s, self )) >= 0 ) {
+		(*s->func)( s->user, task );
+	}
+}
+
+static void emWorkThreadMain( EMWorkPoolState *s, int self ) {
+	int seen = 0;
+	while( 1 ) {
+		{
+			std::unique_lock<std::mutex> g( s->lock );
+			while( !s->quit && s->generation == seen ) {
+				s->wake.wait( g );
+			}
+			if( s->quit ) {
+				return;
+			}
+			seen = s->generation;
+		}
+
+		emWorkDrain( s, self );
+
+		std::lock_guard<std::mutex> g( s->lock );
+		if( --s->active == 0 ) {
+			s->done.notify_all();
+		}
+	}
+}
+
+static void emWorkStop( EMWorkPoolState *s ) {
+	{
+		std::lock_guard<std::mutex> g( s->lock );
+		s->quit = 1;
+	}
+	s->wake.notify_all();
+	for( int i=0; i<s->numThreads-1; i++ ) {
+		s->threads[i].join();
+	}
+	delete [] s->threads;
+	delete [] s->slices;
+	s->threads = 0;
+	s->slices = 0;
+}
+
+static void emWorkStart( EMWorkPoolState *s, int numThreads ) {
+	if( numThreads <= 0 ) {
+		numThreads = EMWorkPool::hardwareThreads();
+	}
+	s->numThreads = numThreads;
+	s->quit = 0;
+	s->generation = 0;
+	s->active = 0;
+	s->slices = new EMWorkSlice[numThreads];
+	for( int i=0; i<numThreads; i++ ) {
+		s->slices[i].lo = s->slices[i].hi = 0;
+	}
+	// Slot 0 is the thread that calls run()
+	s->threads = new std::thread[numThreads-1];
+	for( int i=0; i<numThreads-1; i++ ) {
+		s->threads[i] = std::thread( emWorkThreadMain, s, i+1 );
+	}
+}
+
+EMWorkPool::EMWorkPool( int numThreads ) {
+	state = new EMWorkPoolState;
+	emWorkStart( state, numThreads );
+}
+
+EMWorkPool::~EMWorkPool() {
+	emWorkStop( state );
+	delete state;
+}
+
+void EMWorkPool::setThreadCount( int numThreads ) {
+	if( numThreads <= 0 ) {
+		numThreads = hardwareThreads();
+	}
+	if( numThreads != state->numThreads ) {
+		emWorkStop( state );
+		emWorkStart( state, numThreads );
+	}
+}
+
+int EMWorkPool::threadCount() {
+	return state->numThreads;
+}
+
+int EMWorkPool::hardwareThreads() {
+	int n = (int)std::thread::hardware_concurrency();
+	return n > 0 ? n : 1;
+}
+
+void EMWorkPool::run( int numTasks, EMWorkFunc func, void *user ) {
+	EMWorkPoolState *s = state;
+	if( numTasks <= 0 ) {
+		return;
+	}
+	if( s->numThreads == 1 || numTasks == 1 ) {
+		for( int i=0; i<numTasks; i++ ) {
+			(*func)( user, i );
+		}
+		return;
+	}
+
+	// Contiguous starting slices keep neighbouring bricks on the same core
+	for( int i=0; i<s->numThreads; i++ ) {
+		std::lock_guard<std::mutex> g( s->slices[i].lock );
+		s->slices[i].lo = (int)( (long long)numTasks * i / s->numThreads );
+		s->slices[i].hi = (int)( (long long)numTasks * (i+1) / s->numThreads );
+	}
+
+	{
+		std::lock_guard<std::mutex> g( s->lock );
+		s->func = func;
+		s->user = user;
+		s->active = s->numThreads - 1;
+		s->generation++;
+	}
+	s->wake.notify_all();
+
+	emWorkDrain( s, 0 );
+
+	std::unique_lock<std::mutex> g( s->lock );
+	while( s->active > 0 ) {
+		s->done.wait( g );
+	}
+}
@@ -0,0 +1,31 @@
+// @ZBS {
+//		*MODULE_OWNER_NAME empool
+// }
+
+// A small work-stealing thread pool for splitting grid evaluation into bricks.
+// run() hands out task indices 0..numTasks-1; each participant starts on its
+// own contiguous slice and steals half of another slice once its own is empty.
+// The calling thread takes part and run() returns when every task is done.
+
+#ifndef EMPOOL_H
+#define EMPOOL_H
+
+typedef void (*EMWorkFunc)( void *user, int task );
+
+struct EMWorkPoolState;
+
+struct EMWorkPool {
+	EMWorkPoolState *state;
+
+	EMWorkPool( int numThreads=0 );
+		// numThreads counts the calling thread. 0 means one per hardware thread.
+	~EMWorkPool();
+
+	void setThreadCount( int numThreads );
+	int threadCount();
+	void run( int numTasks, EMWorkFunc func, void *user );
+
+	static int hardwareThreads();
+};
+
+#endif
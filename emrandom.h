@@ -0,0 +1,123 @@
+// @ZBS {
+//		*MODULE_OWNER_NAME emrandom
+// }
+
+// xoshiro128+ run as Lanes independent streams side by side, so that the
+// batch calls below are plain loops over lanes the compiler can vectorize.
+// It is not thread safe by design: every thread that needs numbers owns
+// its own generator, seeded explicitly so that a run can be repeated.
+
+#ifndef EMRANDOM_H
+#define EMRANDOM_H
+
+#include "math.h"
+#include "stdint.h"
+
+struct Xoshiro128
+{
+    enum { Lanes = 8 };
+
+    uint32_t    S[4][Lanes];
+    uint32_t    Buffer[Lanes];  // Spare output for the one-at-a-time calls
+    int         Used;
+
+    Xoshiro128(uint64_t seed = 1)
+    {
+        Seed(seed);
+    }
+
+    // Every lane of every seed gets its own state from splitmix64, the
+    // seeding xoshiro's authors recommend
+    void Seed(uint64_t seed)
+    {
+        uint64_t x = seed;
+        for (int l = 0; l < Lanes; ++l) {
+            for (int k = 0; k < 4; k += 2) {
+                x += 0x9e3779b97f4a7c15ull;
+                uint64_t z = x;
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+                z ^= z >> 31;
+                S[k][l] = (uint32_t)z;
+                S[k + 1][l] = (uint32_t)(z >> 32);
+            }
+        }
+        Used = Lanes;
+    }
+
+    void Next(uint32_t out[Lanes])
+    {
+        for (int l = 0; l < Lanes; ++l) {
+            uint32_t r = S[0][l] + S[3][l];
+            uint32_t t = S[1][l] << 9;
+            S[2][l] ^= S[0][l];
+            S[3][l] ^= S[1][l];
+            S[1][l] ^= S[2][l];
+            S[0][l] ^= S[3][l];
+            S[2][l] ^= t;
+            S[3][l] = (S[3][l] << 11) | (S[3][l] >> 21);
+            out[l] = r;
+        }
+    }
+
+    // The top 24 bits, which are the good ones in a + generator, as [0, 1)
+    static float ToUnit(uint32_t r)
+    {
+        return (float)(r >> 8) * (1.f / 16777216.f);
+    }
+
+    float Uniform(float lo = 0.f, float hi = 1.f)
+    {
+        if (Used == Lanes) {
+            Next(Buffer);
+            Used = 0;
+        }
+        return lo + (hi - lo) * ToUnit(Buffer[Used++]);
+    }
+
+    // n uniform samples in [lo, hi)
+    void Uniform(float * out, int n, float lo, float hi)
+    {
+        uint32_t r[Lanes];
+        for (int i = 0; i < n; i += Lanes) {
+            Next(r);
+            int m = n - i < Lanes ? n - i : Lanes;
+            for (int l = 0; l < m; ++l)
+                out[i + l] = lo + (hi - lo) * ToUnit(r[l]);
+        }
+    }
+
+    // n points uniform on the unit sphere: z uniform in [-1, 1) and an
+    // angle around it, which needs no rejection loop. The angle's sine and
+    // cosine come from Taylor series of its half, which lies in [-pi/2, pi/2)
+    // where they are good to 1e-7, because library sinf and cosf would keep
+    // the loop from vectorizing.
+    void UnitSphere(float * x, float * y, float * z, int n)
+    {
+        uint32_t a[Lanes], b[Lanes];
+        float px[Lanes], py[Lanes], pz[Lanes];
+        for (int i = 0; i < n; i += Lanes) {
+            Next(a);
+            Next(b);
+            for (int l = 0; l < Lanes; ++l) {
+                float h = 2.f * ToUnit(a[l]) - 1.f;
+                float t = 3.14159265f * (ToUnit(b[l]) - 0.5f);
+                float t2 = t * t;
+                float sn = t * (1.f - t2 * (1.f / 6.f - t2 * (1.f / 120.f - t2 * (1.f / 5040.f - t2 * (1.f / 362880.f - t2 * (1.f / 39916800.f))))));
+                float cs = 1.f - t2 * (0.5f - t2 * (1.f / 24.f - t2 * (1.f / 720.f - t2 * (1.f / 40320.f - t2 * (1.f / 3628800.f - t2 * (1.f / 479001600.f))))));
+                float rho = sqrtf(fmaxf(0.f, 1.f - h * h));
+                px[l] = rho * (cs * cs - sn * sn);
+                py[l] = rho * (2.f * sn * cs);
+                pz[l] = h;
+            }
+            int m = n - i < Lanes ? n - i : Lanes;
+            for (int l = 0; l < m; ++l) {
+                x[i + l] = px[l];
+                y[i + l] = py[l];
+                z[i + l] = pz[l];
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,339 @@
+// @ZBS {
+//		*MODULE_OWNER_NAME emtree
+// }
+
+// Barnes-Hut octree over the charges, for when there are too many of them
+// for the direct sum per particle. Every node carries the monopole and
+// dipole moments of its charges about their |q| weighted centre, and a
+// particle takes a node's moments instead of opening it once the node's
+// radius is under Theta times the distance to it. Leaves, which hold at
+// most LeafSize charges, are always summed directly, so Theta = 0 (or a
+// handful of charges) reproduces the direct sum. Build() is cheap enough to run
+// every frame so the charges are free to move; above ParallelCharges the
+// eight octants of the root are built as tasks on the caller's worker pool.
+// Vec3 is any float vector with x, y and z, a zero default constructor, the
+// arithmetic operators, Length(), LengthSq() and Normalize(), such as OVR's
+// Vector3f. The viewer's ChargeTree is ChargeTreeT<Vector3f>.
+
+#ifndef EMTREE_H
+#define EMTREE_H
+
+#include "math.h"
+#include "string.h"
+#include <vector>
+#include "empool.h"
+
+template <class Vec3>
+struct ChargeTreeT
+{
+    enum { LeafSize = 8, MaxDepth = 20, ParallelCharges = 4096 };
+
+    struct Node
+    {
+        Vec3        Centre;     // Of the node's cube
+        float       Half;       // Half the cube's edge
+        Vec3        Pos;        // Expansion centre
+        float       Q, AbsQ;
+        Vec3        Dipole;     // Sum of q (x - Pos)
+        float       Radius;     // Farthest charge from Pos
+        int         First, Count;   // Range of ChargePos and ChargeQ
+        int         Child[8];   // -1 where an octant is empty
+        bool        Leaf;
+    };
+
+    float               Theta;
+    std::vector<Node>   Nodes;      // Root first
+    int                 NumCharges;
+    Vec3              * ChargePos;  // The charges sorted so every node's are contiguous
+    float             * ChargeQ;
+    Vec3              * ScratchPos;
+    float             * ScratchQ;
+    int                 Alloced;
+    std::vector<Node>   OctantNodes[8]; // Each octant's subtree while Build() runs them in parallel
+
+    ChargeTreeT() :
+        Theta(0.5f),
+        NumCharges(0),
+        ChargePos(nullptr),
+        ChargeQ(nullptr),
+        ScratchPos(nullptr),
+        ScratchQ(nullptr),
+        Alloced(0)
+    {
+    }
+
+    ~ChargeTreeT()
+    {
+        Release();
+    }
+
+    void Release()
+    {
+        delete[] ChargePos;
+        delete[] ChargeQ;
+        delete[] ScratchPos;
+        delete[] ScratchQ;
+        ChargePos = ScratchPos = nullptr;
+        ChargeQ = ScratchQ = nullptr;
+        NumCharges = Alloced = 0;
+        Nodes.clear();
+    }
+
+    static int Octant(Vec3 p, Vec3 centre)
+    {
+        return (p.x >= centre.x ? 1 : 0) | (p.y >= centre.y ? 2 : 0) | (p.z >= centre.z ? 4 : 0);
+    }
+
+    // Builds the subtree of charges first..first+count-1 in the cube at
+    // centre into nodes, children after their parent, and returns its
+    // index there. Subtrees of disjoint ranges can be built concurrently.
+    int BuildNode(std::vector<Node> & nodes, int first, int count, Vec3 centre, float half, int depth)
+    {
+        int index = (int)nodes.size();
+        nodes.push_back(Node());
+        Node n;
+        n.Centre = centre;
+        n.Half = half;
+        n.First = first;
+        n.Count = count;
+        for (int c = 0; c < 8; ++c)
+            n.Child[c] = -1;
+        n.Leaf = count <= LeafSize || depth >= MaxDepth;
+
+        if (!n.Leaf) {
+            // Counting sort of the range into octants through the scratch arrays
+            int start[9] = { 0 };
+            for (int j = first; j < first + count; ++j)
+                start[Octant(ChargePos[j], centre) + 1]++;
+            for (int c = 0; c < 8; ++c)
+                start[c + 1] += start[c];
+            int fill[8];
+            for (int c = 0; c < 8; ++c)
+                fill[c] = first + start[c];
+            for (int j = first; j < first + count; ++j) {
+                int k = fill[Octant(ChargePos[j], centre)]++;
+                ScratchPos[k] = ChargePos[j];
+                ScratchQ[k] = ChargeQ[j];
+            }
+            memcpy(ChargePos + first, ScratchPos + first, count * sizeof(Vec3));
+            memcpy(ChargeQ + first, ScratchQ + first, count * sizeof(float));
+
+            float h = half * 0.5f;
+            for (int c = 0; c < 8; ++c) {
+                if (start[c + 1] > start[c]) {
+                    Vec3 cc = centre + Vec3(c & 1 ? h : -h, c & 2 ? h : -h, c & 4 ? h : -h);
+                    n.Child[c] = BuildNode(nodes, first + start[c], start[c + 1] - start[c], cc, h, depth + 1);
+                }
+            }
+            Moments(n, nodes);
+        }
+        else {
+            LeafMoments(n);
+        }
+        nodes[index] = n;
+        return index;
+    }
+
+    void LeafMoments(Node & n)
+    {
+        n.Q = n.AbsQ = 0.f;
+        Vec3 weighted;
+        for (int j = n.First; j < n.First + n.Count; ++j) {
+            n.Q += ChargeQ[j];
+            n.AbsQ += fabsf(ChargeQ[j]);
+            weighted += ChargePos[j] * fabsf(ChargeQ[j]);
+        }
+        n.Pos = n.AbsQ > 0.f ? weighted / n.AbsQ : n.Centre;
+        n.Dipole = Vec3();
+        n.Radius = 0.f;
+        for (int j = n.First; j < n.First + n.Count; ++j) {
+            Vec3 d = ChargePos[j] - n.Pos;
+            n.Dipole += d * ChargeQ[j];
+            float r = d.Length();
+            n.Radius = r > n.Radius ? r : n.Radius;
+        }
+    }
+
+    // Combines the children's moments, shifting their dipoles to the new centre
+    static void Moments(Node & n, const std::vector<Node> & nodes)
+    {
+        n.Q = n.AbsQ = 0.f;
+        Vec3 weighted;
+        for (int c = 0; c < 8; ++c) {
+            if (n.Child[c] >= 0) {
+                const Node & k = nodes[n.Child[c]];
+                n.Q += k.Q;
+                n.AbsQ += k.AbsQ;
+                weighted += k.Pos * k.AbsQ;
+            }
+        }
+        n.Pos = n.AbsQ > 0.f ? weighted / n.AbsQ : n.Centre;
+        n.Dipole = Vec3();
+        n.Radius = 0.f;
+        for (int c = 0; c < 8; ++c) {
+            if (n.Child[c] >= 0) {
+                const Node & k = nodes[n.Child[c]];
+                Vec3 d = k.Pos - n.Pos;
+                n.Dipole += k.Dipole + d * k.Q;
+                float r = d.Length() + k.Radius;
+                n.Radius = r > n.Radius ? r : n.Radius;
+            }
+        }
+    }
+
+    // What the pool's tasks need to build the root's octants in Build()
+    struct OctantJob
+    {
+        ChargeTreeT    * Tree;
+        int             Start[9];   // Octant c holds charges Start[c]..Start[c + 1] - 1
+        Vec3            Centre;     // Of the root
+        float           Half;       // Of the octants
+    };
+
+    static void BuildOctant(void * user, int c)
+    {
+        OctantJob * job = (OctantJob *)user;
+        int count = job->Start[c + 1] - job->Start[c];
+        if (count == 0)
+            return;
+        float h = job->Half;
+        Vec3 cc = job->Centre + Vec3(c & 1 ? h : -h, c & 2 ? h : -h, c & 4 ? h : -h);
+        job->Tree->BuildNode(job->Tree->OctantNodes[c], job->Start[c], count, cc, h, 1);
+    }
+
+    // Sorts the charges into a new tree. Large trees split their root's
+    // octants over pool, and are built serially without one.
+    void Build(int numChg, const Vec3 * chgPos, const float * chg, EMWorkPool * pool = nullptr)
+    {
+        if (numChg > Alloced) {
+            Release();
+            Alloced = numChg;
+            ChargePos = new Vec3[numChg];
+            ChargeQ = new float[numChg];
+            ScratchPos = new Vec3[numChg];
+            ScratchQ = new float[numChg];
+        }
+        NumCharges = numChg;
+        Nodes.clear();
+        if (numChg == 0)
+            return;
+
+        Vec3 lo = chgPos[0], hi = chgPos[0];
+        for (int j = 0; j < numChg; j++) {
+            ChargePos[j] = chgPos[j];
+            ChargeQ[j] = chg[j];
+            lo = Vec3(fminf(lo.x, chgPos[j].x), fminf(lo.y, chgPos[j].y), fminf(lo.z, chgPos[j].z));
+            hi = Vec3(fmaxf(hi.x, chgPos[j].x), fmaxf(hi.y, chgPos[j].y), fmaxf(hi.z, chgPos[j].z));
+        }
+        Vec3 centre = (lo + hi) * 0.5f;
+        Vec3 size = hi - lo;
+        float half = 0.5f * fmaxf(size.x, fmaxf(size.y, size.z)) * 1.001f + 1e-6f;
+
+        if (numChg < ParallelCharges || !pool) {
+            BuildNode(Nodes, 0, numChg, centre, half, 0);
+            return;
+        }
+
+        // Split the root here, build each octant into its own node list as
+        // a task on the pool, then append the lists after the root
+        Node root;
+        root.Centre = centre;
+        root.Half = half;
+        root.First = 0;
+        root.Count = numChg;
+        root.Leaf = false;
+        OctantJob job;
+        job.Tree = this;
+        job.Centre = centre;
+        job.Half = half * 0.5f;
+        int * start = job.Start;
+        for (int c = 0; c < 9; ++c)
+            start[c] = 0;
+        for (int j = 0; j < numChg; ++j)
+            start[Octant(ChargePos[j], centre) + 1]++;
+        for (int c = 0; c < 8; ++c)
+            start[c + 1] += start[c];
+        int fill[8];
+        for (int c = 0; c < 8; ++c)
+            fill[c] = start[c];
+        for (int j = 0; j < numChg; ++j) {
+            int k = fill[Octant(ChargePos[j], centre)]++;
+            ScratchPos[k] = ChargePos[j];
+            ScratchQ[k] = ChargeQ[j];
+        }
+        memcpy(ChargePos, ScratchPos, numChg * sizeof(Vec3));
+        memcpy(ChargeQ, ScratchQ, numChg * sizeof(float));
+
+        // The lists keep their capacity between builds
+        for (int c = 0; c < 8; ++c)
+            OctantNodes[c].clear();
+        pool->run(8, BuildOctant, &job);
+
+        Nodes.push_back(root);
+        for (int c = 0; c < 8; ++c) {
+            Nodes[0].Child[c] = -1;
+            if (start[c + 1] == start[c])
+                continue;
+            int offset = (int)Nodes.size();
+            Nodes[0].Child[c] = offset;
+            const std::vector<Node> & sub = OctantNodes[c];
+            for (size_t i = 0; i < sub.size(); ++i) {
+                Node n = sub[i];
+                for (int k = 0; k < 8; ++k)
+                    if (n.Child[k] >= 0)
+                        n.Child[k] += offset;
+                Nodes.push_back(n);
+            }
+        }
+        Moments(Nodes[0], Nodes);
+    }
+
+    // Sum of q d/|d|^2 over the charges, d the unit vector from each to xyz
+    static Vec3 Coulomb(Vec3 xyz, int numChg, const Vec3 * chgPos, const float * chg)
+    {
+        Vec3 f;
+        for (int j = 0; j < numChg; j++) {
+            Vec3 r = xyz - chgPos[j];
+            float mag = chg[j] / r.LengthSq();
+            r.Normalize();
+            f += r * mag;
+        }
+        return f;
+    }
+
+    // The same field as Coulomb() through the tree
+    Vec3 Field(Vec3 p) const
+    {
+        Vec3 f;
+        if (Nodes.empty())
+            return f;
+        int stack[8 * MaxDepth + 8];
+        int top = 0;
+        stack[top++] = 0;
+        float theta2 = Theta * Theta;
+        while (top > 0) {
+            const Node & n = Nodes[stack[--top]];
+            if (n.Leaf) {
+                f += Coulomb(p, n.Count, ChargePos + n.First, ChargeQ + n.First);
+                continue;
+            }
+            Vec3 d = p - n.Pos;
+            float r2 = d.LengthSq();
+            if (n.Radius * n.Radius < theta2 * r2) {
+                // Monopole q d/r^3 plus dipole (3 (P.d) d/r^2 - P)/r^3
+                float inv = 1.f / sqrtf(r2);
+                float inv3 = inv * inv * inv;
+                float pd = n.Dipole.x * d.x + n.Dipole.y * d.y + n.Dipole.z * d.z;
+                f += d * ((n.Q + 3.f * pd * inv * inv) * inv3) - n.Dipole * inv3;
+            }
+            else {
+                for (int c = 0; c < 8; ++c)
+                    if (n.Child[c] >= 0)
+                        stack[top++] = n.Child[c];
+            }
+        }
+        return f;
+    }
+};
+
+#endif
@@ -100,8 +100,10 @@ static bool MainLoop(bool retryCreate)
 
     // Make scene - can simplify further if needed
     roomScene = new Scene(false);
+    roomScene->LogMemory();
 
     bool isVisible = true;
+    double statsTime = ovr_GetTimeInSeconds();
 
     // Main loop
     while (Platform.HandleMessages())
@@ -119,6 +121,21 @@ static bool MainLoop(bool retryCreate)
         if (Platform.Key['A'])                          Pos2+=Matrix4f::RotationY(Yaw).Transform(Vector3f(-0.05f,0,0));
         Pos2.y = ovr_GetFloat(HMD, OVR_KEY_EYE_HEIGHT, Pos2.y);
 
+        // How the arrows look up the charges' field: 1 direct sum, 2 trilinear, 3 tricubic grid,
+        // 7 Barnes-Hut tree, 8 the tree checked against the direct sum
+        if (Platform.Key['1'])                          roomScene->RequestedFieldMode = FieldGrid::Direct;
+        if (Platform.Key['2'])                          roomScene->RequestedFieldMode = FieldGrid::Trilinear;
+        if (Platform.Key['3'])                          roomScene->RequestedFieldMode = FieldGrid::Tricubic;
+        if (Platform.Key['7'])                          { roomScene->RequestedFieldMode = FieldGrid::Tree; roomScene->RequestedCheckTree = false; }
+        if (Platform.Key['8'])                          { roomScene->RequestedFieldMode = FieldGrid::Tree; roomScene->RequestedCheckTree = true; }
+        // and how they move along it: 4 Euler, 5 RK4, 6 adaptive RK45
+        if (Platform.Key['4'])                          roomScene->RequestedIntegrator = Scene::Euler;
+        if (Platform.Key['5'])                          roomScene->RequestedIntegrator = Scene::RK4;
+        if (Platform.Key['6'])                          roomScene->RequestedIntegrator = Scene::RK45;
+        // and how they are drawn: 9 one draw call per arrow for the first Scene::maxArrows, 0 all of them in a single instanced call per eye
+        if (Platform.Key['9'])                          roomScene->Instanced = false;
+        if (Platform.Key['0'])                          roomScene->Instanced = true;
+
 		// Animate the cube
         static float cubeClock = 0.1f;
 		//cubeClock += 0.015f;
@@ -150,6 +167,23 @@ static bool MainLoop(bool retryCreate)
         ovrTrackingState hmdState = ovr_GetTrackingState(HMD, ftiming.DisplayMidpointSeconds);
         ovr_CalcEyePoses(hmdState.HeadPose.ThePose, ViewOffset, EyeRenderPose);
 
+        // Take the newest arrows for this frame; both eyes then draw the same snapshot
+        double frameTime = ovr_GetTimeInSeconds();
+        roomScene->BeginFrame(frameTime);
+        if (roomScene->FramesDrawn % 900 == 0)
+        {
+            OVR_DEBUG_LOG(("%d of %d frames reused a stale snapshot, %d draw calls last frame\n",
+                           roomScene->StaleFrames, roomScene->FramesDrawn, roomScene->DrawCallsLastFrame));
+            roomScene->Particles->Instances->LogStats(frameTime - statsTime);
+            roomScene->Queue.LogStats();
+            // What the integrator costs: per arrow 1 for Euler, 4 for RK4, 6 per attempted substep for RK45
+            const ParticleSnapshot & snap = roomScene->Snapshots->Read();
+            OVR_DEBUG_LOG(("%d field evaluations for %d arrows in the last step\n", snap.FieldEvals, snap.Count));
+            if (snap.TreeChecked)
+                OVR_DEBUG_LOG(("Tree field differs from the direct sum by up to %g\n", snap.TreeError));
+            statsTime = frameTime;
+        }
+
         if (isVisible)
         {
             for (int eye = 0; eye < 2; ++eye)